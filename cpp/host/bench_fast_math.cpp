@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+
+#include "inochi/fast_math.hpp"
+
+// fast_math.hpp の近似関数を libm と比べる
+// 誤差が fast_math.hpp に書いた上限を超えたら終了コード 1 を返す
+
+namespace shapoco {
+
+using namespace shapoco::inochi;
+
+using clock = std::chrono::steady_clock;
+
+static constexpr int NUM_SAMPLES = 1 << 16;
+static constexpr int NUM_REPEATS = 64;
+
+struct Result {
+  double maxErr = 0;
+  double fastNs = 0;
+  double libmNs = 0;
+};
+
+// 誤差は double で計算した値に対して求める。各関数は i 番目のサンプルに対する値を返す
+// relative: 相対誤差で評価するか
+template<typename F, typename L, typename R>
+Result measure(int n, F fast, L libm, R reference, bool relative) {
+  Result r;
+  for (int i = 0; i < n; i++) {
+    double expected = reference(i);
+    double err = fabs((double)fast(i) - expected);
+    if (relative) err /= fabs(expected);
+    if (err > r.maxErr) r.maxErr = err;
+  }
+
+  volatile float sink = 0;
+  float sum = 0;
+  auto t = clock::now();
+  for (int rep = 0; rep < NUM_REPEATS; rep++) {
+    for (int i = 0; i < n; i++) sum += fast(i);
+  }
+  r.fastNs = std::chrono::duration<double, std::nano>(clock::now() - t).count() / NUM_REPEATS / n;
+  t = clock::now();
+  for (int rep = 0; rep < NUM_REPEATS; rep++) {
+    for (int i = 0; i < n; i++) sum += libm(i);
+  }
+  r.libmNs = std::chrono::duration<double, std::nano>(clock::now() - t).count() / NUM_REPEATS / n;
+  sink = sum;
+  (void)sink;
+  return r;
+}
+
+// 1 引数の関数
+template<typename F, typename L, typename R>
+Result measure1(const std::vector<float> &xs, F fast, L libm, R reference, bool relative) {
+  return measure(xs.size(),
+    [&](int i) { return fast(xs[i]); },
+    [&](int i) { return libm(xs[i]); },
+    [&](int i) { return reference(xs[i]); },
+    relative);
+}
+
+std::vector<float> uniform(float lo, float hi) {
+  std::vector<float> xs(NUM_SAMPLES);
+  for (auto &x : xs) x = lo + (hi - lo) * ((float)rand() / RAND_MAX);
+  return xs;
+}
+
+// 指数が一様になるように選ぶ
+std::vector<float> logUniform(float lo, float hi) {
+  std::vector<float> xs(NUM_SAMPLES);
+  float l0 = log2f(lo), l1 = log2f(hi);
+  for (auto &x : xs) x = exp2f(l0 + (l1 - l0) * ((float)rand() / RAND_MAX));
+  return xs;
+}
+
+int check(const char *name, const Result &r, double bound) {
+  bool ok = r.maxErr <= bound;
+  printf("%-10s %12.3g %12.3g %10.2f %10.2f %8.2f %s\n",
+    name, r.maxErr, bound, r.fastNs, r.libmNs, r.libmNs / r.fastNs, ok ? "" : "NG");
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  unsigned seed = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1;
+  srand(seed);
+  int numErrors = 0;
+
+  printf("%-10s %12s %12s %10s %10s %8s\n", "function", "max err", "bound", "fast[ns]", "libm[ns]", "speedup");
+
+  numErrors += check("log2", measure1(logUniform(1e-30f, 1e30f),
+    fastLog2, [](float x) { return log2f(x); }, [](float x) { return log2((double)x); }, false), 4.0e-6);
+
+  numErrors += check("exp2", measure1(uniform(-126, 127.9f),
+    fastExp2, [](float x) { return exp2f(x); }, [](float x) { return exp2((double)x); }, true), 3.0e-7);
+
+  // 指数は物理演算での使い方 (ステップ毎の減衰) に近い範囲にする
+  {
+    std::vector<float> as = logUniform(1e-4f, 1e4f);
+    std::vector<float> bs = uniform(0.5f, 2.0f);
+    numErrors += check("pow", measure(as.size(),
+      [&](int i) { return fastPow(as[i], bs[i]); },
+      [&](int i) { return powf(as[i], bs[i]); },
+      [&](int i) { return pow((double)as[i], (double)bs[i]); }, true), 1.0e-5);
+  }
+
+  numErrors += check("rsqrt", measure1(logUniform(1e-30f, 1e30f),
+    fastRsqrt, [](float x) { return 1.0f / sqrtf(x); }, [](float x) { return 1.0 / sqrt((double)x); }, true), 4.8e-6);
+
+  numErrors += check("sqrt", measure1(logUniform(1e-30f, 1e30f),
+    fastSqrt, [](float x) { return sqrtf(x); }, [](float x) { return sqrt((double)x); }, true), 4.8e-6);
+
+  numErrors += check("sinTurn", measure1(uniform(-2, 2),
+    sinTurn, [](float x) { return sinf(2 * (float)M_PI * x); }, [](float x) { return sin(2 * M_PI * (double)x); }, false), 7.6e-5);
+
+  numErrors += check("cosTurn", measure1(uniform(-2, 2),
+    cosTurn, [](float x) { return cosf(2 * (float)M_PI * x); }, [](float x) { return cos(2 * M_PI * (double)x); }, false), 7.6e-5);
+
+  if (numErrors) {
+    printf("%d functions exceed their error bound\n", numErrors);
+    return 1;
+  }
+  printf("fast math within documented error bounds\n");
+  return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+  return shapoco::main(argc, argv);
+}
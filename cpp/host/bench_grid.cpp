@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "inochi/inochi.hpp"
+
+// SpatialGrid による近傍探索と総当たりを比較する
+// 結果 (近傍のペアと物理ステップ後の位置) が一致しなければ終了コード 1 を返す
+
+namespace shapoco {
+
+using namespace shapoco::inochi;
+using clock = std::chrono::steady_clock;
+
+static constexpr int SCREEN_WIDTH = 480;
+static constexpr int SCREEN_HEIGHT = 320;
+static constexpr int CASE_BALLS[] = {15, 100, 500, 1000, 2000, 4000};
+static constexpr int NUM_WARMUP_STEPS = 5;
+static constexpr int NUM_STEPS = 20;
+static constexpr int NUM_POINTS = 1000;
+
+uint64_t getTimeMs() { return 0; }
+uint64_t getTimeUs() { return 0; }
+VecI getScreenSize() { return VecI{SCREEN_WIDTH, SCREEN_HEIGHT}; }
+void clearScreen() { }
+void drawCircle(VecI pos, int r, Palette col) { }
+void getTouchState(TouchState *touch) { touch->touched = false; }
+
+void setupWorld(World &world, int numBalls, unsigned seed, bool useGrid) {
+  srand(seed);
+  Context &ctx = world.ctx;
+  ctx.random.seed(seed);
+  ctx.intf.getTimeMs = getTimeMs;
+  ctx.intf.getTimeUs = getTimeUs;
+  ctx.intf.getScreenSize = getScreenSize;
+  ctx.intf.clearScreen = clearScreen;
+  ctx.intf.drawCircle = drawCircle;
+  ctx.intf.getTouchState = getTouchState;
+  ctx.screenSize = getScreenSize();
+  ctx.deltaMs = (real)1 / 60;
+  ctx.useSpatialGrid = useGrid;
+  for (int i = 0; i < numBalls; i++) {
+    float r = (float)CIRCLE_RADIUS + 1.1f * sqrtf(i);
+    float a = 2.39996f * i;
+    Ball::spawn(ctx, VecR(r * cosf(a), r * sinf(a)));
+  }
+}
+
+double usSince(clock::time_point t) {
+  return std::chrono::duration<double, std::micro>(clock::now() - t).count();
+}
+
+int main(int argc, char **argv) {
+  unsigned seed = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1;
+  int numErrors = 0;
+
+  printf("%6s %10s %12s %12s %8s %12s %12s %12s %12s\n",
+    "balls", "rebuild", "knn brute", "knn grid", "speedup",
+    "hit brute", "hit grid", "step brute", "step grid");
+  printf("%6s %10s %12s %12s %8s %12s %12s %12s %12s\n",
+    "", "[us]", "[us]", "[us]", "", "[us]", "[us]", "[us]", "[us]");
+
+  for (int numBalls : CASE_BALLS) {
+    std::unique_ptr<World> bruteWorldPtr(new World()), gridWorldPtr(new World());
+    World &bruteWorld = *bruteWorldPtr;
+    World &gridWorld = *gridWorldPtr;
+    setupWorld(bruteWorld, numBalls, seed, false);
+    setupWorld(gridWorld, numBalls, seed, true);
+
+    // 同じ初期状態から両方の経路で進め、位置が完全に一致することを確認する
+    double stepUs[2] = {0, 0};
+    World *worlds[2] = {&bruteWorld, &gridWorld};
+    for (int iw = 0; iw < 2; iw++) {
+      for (int i = 0; i < NUM_WARMUP_STEPS; i++) {
+        worlds[iw]->simulate();
+        worlds[iw]->removeDeadObjects();
+      }
+      auto t = clock::now();
+      for (int i = 0; i < NUM_STEPS; i++) {
+        worlds[iw]->simulate();
+        worlds[iw]->removeDeadObjects();
+      }
+      stepUs[iw] = usSince(t) / NUM_STEPS;
+    }
+    Context &bctx = bruteWorld.ctx;
+    Context &ctx = gridWorld.ctx;
+    bool same = bctx.balls.size() == ctx.balls.size();
+    for (int i = 0; same && i < ctx.balls.size(); i++) {
+      same = bctx.balls.handleAt(i) == ctx.balls.handleAt(i) &&
+        bctx.balls.bodyPos[i].x == ctx.balls.bodyPos[i].x &&
+        bctx.balls.bodyPos[i].y == ctx.balls.bodyPos[i].y;
+    }
+    if (!same) {
+      printf("  trajectory mismatch at %d balls\n", numBalls);
+      numErrors++;
+    }
+
+    auto t = clock::now();
+    gridWorld.rebuildGrid();
+    double rebuildUs = usSince(t);
+
+    int n = ctx.balls.size();
+    std::vector<Ball::Nearest> bruteResult(2 * n), gridResult(2 * n);
+    std::vector<int> bruteCount(n), gridCount(n);
+
+    t = clock::now();
+    for (int i = 0; i < n; i++) {
+      bruteCount[i] = Ball::findNearestBruteForce(ctx, i, &bruteResult[2 * i]);
+    }
+    double bruteUs = usSince(t);
+
+    t = clock::now();
+    for (int i = 0; i < n; i++) {
+      gridCount[i] = Ball::findNearestByGrid(ctx, i, &gridResult[2 * i]);
+    }
+    double gridUs = usSince(t);
+
+    for (int i = 0; i < n; i++) {
+      bool ok = bruteCount[i] == gridCount[i];
+      for (int k = 0; ok && k < bruteCount[i]; k++) {
+        ok = bruteResult[2 * i + k].index == gridResult[2 * i + k].index &&
+          bruteResult[2 * i + k].dist == gridResult[2 * i + k].dist;
+      }
+      if (!ok) {
+        printf("  neighbour mismatch at ball %d of %d\n", i, numBalls);
+        numErrors++;
+        break;
+      }
+    }
+
+    std::vector<VecR> points(NUM_POINTS);
+    for (auto &p : points) {
+      int i = rand() % n;
+      p = ctx.balls.bodyPos[i] + VecR(ctx.randR() - 0.5, ctx.randR() - 0.5) * 2;
+    }
+    std::vector<uint32_t> bruteHit(NUM_POINTS), gridHit(NUM_POINTS);
+    t = clock::now();
+    for (int i = 0; i < NUM_POINTS; i++) bruteHit[i] = gridWorld.findByWorldPosBruteForce(points[i]).key();
+    double hitBruteUs = usSince(t) / NUM_POINTS;
+    t = clock::now();
+    for (int i = 0; i < NUM_POINTS; i++) gridHit[i] = gridWorld.findByWorldPos(points[i]).key();
+    double hitGridUs = usSince(t) / NUM_POINTS;
+    if (bruteHit != gridHit) {
+      printf("  hit-test mismatch at %d balls\n", numBalls);
+      numErrors++;
+    }
+
+    printf("%6d %10.1f %12.1f %12.1f %8.2f %12.3f %12.3f %12.1f %12.1f\n",
+      n, rebuildUs, bruteUs, gridUs, bruteUs / gridUs,
+      hitBruteUs, hitGridUs, stepUs[0], stepUs[1]);
+  }
+
+  if (numErrors) {
+    printf("%d mismatches\n", numErrors);
+    return 1;
+  }
+  printf("grid results match brute force\n");
+  return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+  return shapoco::main(argc, argv);
+}
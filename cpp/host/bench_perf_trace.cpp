@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "perf_trace_reader.hpp"
+
+// perf_trace.hpp の記録 1 回あたりの時間と、書き出した記録を読み戻せるかを調べる
+// 読み戻した内容が違えば終了コード 1 を返す
+
+namespace shapoco {
+
+using clock = std::chrono::steady_clock;
+
+std::vector<uint8_t> sink;
+
+void sinkWrite(const uint8_t *data, int size) {
+  sink.insert(sink.end(), data, data + size);
+}
+
+// 溢れないよう、容量の半分ずつ記録しては書き出す
+double measureNsPerEvent(bool scope) {
+  static constexpr int BATCH = PERF_TRACE_CAPACITY / 2;
+  static constexpr int NUM_BATCHES = 2000;
+  double ns = 0;
+  for (int b = 0; b < NUM_BATCHES; b++) {
+    auto t = clock::now();
+    if (scope) {
+      for (int i = 0; i < BATCH / 2; i++) {
+        PERF_SCOPE(PAINT);
+      }
+    }
+    else {
+      for (int i = 0; i < BATCH; i++) {
+        PERF_INSTANT(SUBMIT);
+      }
+    }
+    ns += std::chrono::duration<double, std::nano>(clock::now() - t).count();
+    sink.clear();
+    perfTrace.drain(sinkWrite);
+  }
+  return ns / NUM_BATCHES / BATCH;
+}
+
+// 時刻の桁あふれ、長い間隔、テキストの混入、記録の取りこぼしを含む記録を読み戻す
+int roundTrip(unsigned seed) {
+  srand(seed);
+  PerfTrace trace(PERF_TICKS_PER_US);
+  std::vector<PerfTraceEvent> expected;
+  uint64_t ticks = 0xffff0000u;
+  sink.clear();
+  const char *noise = "fps=60 PT\n";
+  uint32_t expectedDrops = 0;
+  for (int round = 0; round < 50; round++) {
+    for (int core = 0; core < PerfTrace::NUM_CORES; core++) {
+      int n = rand() % 200;
+      for (int i = 0; i < n; i++) {
+        uint32_t delta = rand() % 4 == 0 ? rand() % 5000000 : rand() % 300;
+        ticks += delta;
+        PerfEvent ev = (PerfEvent)(rand() % (int)PerfEvent::NUM_EVENTS);
+        PerfPhase ph = (PerfPhase)(rand() % 3);
+        trace.rings[core].push((uint32_t)ticks, ev, ph);
+        expected.push_back(PerfTraceEvent{ticks, (uint8_t)core, (uint8_t)ev, (uint8_t)ph});
+      }
+    }
+    // 1 回だけ溢れさせる
+    if (round == 25) {
+      PerfTrace::Ring &ring = trace.rings[1];
+      int space = PERF_TRACE_CAPACITY - (ring.head - ring.tail);
+      for (int i = 0; i < space + 10; i++) {
+        ring.push((uint32_t)ticks, PerfEvent::UPDATE, PerfPhase::INSTANT);
+        if (i < space) {
+          expected.push_back(PerfTraceEvent{ticks, 1, (uint8_t)PerfEvent::UPDATE, (uint8_t)PerfPhase::INSTANT});
+        }
+        else {
+          expectedDrops++;
+        }
+      }
+    }
+    sinkWrite((const uint8_t *)noise, strlen(noise));
+    trace.drain(sinkWrite);
+  }
+
+  PerfTraceReader reader;
+  reader.parse(sink.data(), sink.size());
+  size_t numEvents = reader.events.size();
+  if (numEvents != expected.size() || reader.dropped != expectedDrops || reader.badPackets != 0 ||
+      reader.ticksPerUs != PERF_TICKS_PER_US) {
+    printf("round trip: %zu events (expected %zu), %llu dropped (expected %u), %d bad packets\n",
+      numEvents, expected.size(), (unsigned long long)reader.dropped, expectedDrops, reader.badPackets);
+    return 1;
+  }
+  // drain() はコア毎にまとめて書き出すので、各コアの中の順番だけ比べる
+  // 最初のパケットの時刻は 32 ビットのままなので、64 ビットに伸ばした結果は一定のずれで一致すればよい
+  size_t next[PerfTrace::NUM_CORES] = {};
+  int64_t offset = (int64_t)(reader.events[0].ticks - expected[0].ticks);
+  int numErrors = 0;
+  for (const PerfTraceEvent &e : reader.events) {
+    size_t &k = next[e.core];
+    while (k < expected.size() && expected[k].core != e.core) k++;
+    if (k >= expected.size()) {
+      numErrors++;
+      break;
+    }
+    const PerfTraceEvent &x = expected[k++];
+    if (e.ticks - offset != x.ticks || e.event != x.event || e.phase != x.phase) {
+      if (numErrors++ == 0) {
+        printf("round trip: core %d event at %llu differs (ticks %llu, event %d/%d, phase %d/%d)\n",
+          e.core, (unsigned long long)x.ticks, (unsigned long long)(e.ticks - offset), e.event, x.event, e.phase, x.phase);
+      }
+    }
+  }
+  printf("round trip: %zu events, %llu dropped, %zu bytes (%.2f bytes/event), %zu noise bytes skipped\n",
+    numEvents, (unsigned long long)reader.dropped, sink.size(), (double)sink.size() / numEvents, reader.skippedBytes);
+  return numErrors;
+}
+
+int main(int argc, char **argv) {
+  unsigned seed = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1;
+
+  int numErrors = roundTrip(seed);
+
+  double instantNs = measureNsPerEvent(false);
+  double scopeNs = measureNsPerEvent(true);
+  printf("record: %.1f ns/event (instant), %.1f ns/event (scope), ring %d events/core\n",
+    instantNs, scopeNs, PERF_TRACE_CAPACITY);
+
+  if (numErrors) {
+    printf("perf trace round trip failed\n");
+    return 1;
+  }
+  return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+  return shapoco::main(argc, argv);
+}
@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "inochi/inochi.hpp"
+
+// 物理ステップの処理時間と軌跡を計測する
+// 実機と同じく World::update() を模擬した時計で 1 フレームずつ呼ぶ
+// float 版と固定小数点版を別々にビルドし、--dump / --ref で軌跡を比較する
+// 軌跡全体は丸め誤差が増幅されて別の場面になるので比べるだけにし、誤差の上限は
+// 基準の各フレームの状態から 1 ステップ進めた位置と大きさで確かめる。超えたら終了コード 1 を返す
+
+namespace shapoco {
+
+using namespace shapoco::inochi;
+
+static constexpr int SCREEN_WIDTH = 480;
+static constexpr int SCREEN_HEIGHT = 320;
+static constexpr int NUM_CASES = 3;
+static constexpr int CASE_BALLS[NUM_CASES] = {15, 100, 1000};
+
+// 基準と同じ状態から 1 ステップ進めたときの位置と大きさの誤差の上限 [world units]
+// float 版は libm 版と、固定小数点版は float 版と比べる
+// 近い 2 つだけに働く力と速度の上限でステップは不連続なので、近いいのちが入れ替わる
+// 境目にあるごく一部は力 1 つ分ずれる。上限は 99.9 パーセンタイルに掛け、最大は表示だけする
+#if INOCHI_FIXED_POINT
+static constexpr float ONE_STEP_BOUND = 0.0025f;
+#else
+static constexpr float ONE_STEP_BOUND = 0.0001f;
+#endif
+
+// Context::updateCoeffs() の係数の、libm で求めた値に対する相対誤差の上限
+// deltaMs は real に丸めた値を両方に与え、係数の計算だけの誤差を見る
+#if INOCHI_FIXED_POINT
+static constexpr double COEFF_BOUND = 1e-4;
+#else
+static constexpr double COEFF_BOUND = 1e-5;
+#endif
+
+// 軌道からこれ以上離れたいのちは比べない
+// 引き戻す加速度が大きく、Q15.16 では速さの 2 乗 (32767 まで) が飽和する (24 を超えると起きる)
+// ゲームでは生まれる位置 (2 * VIEW_RADIUS) でも 13 以内。1000 個の初期配置の外側だけが当たる
+static constexpr float MAX_ORBIT_ERR = 20;
+
+// 位置を動かす状態だけを持つ (目の動きは位置に影響しない)
+struct Sample {
+  uint32_t id;
+  float x, y;
+  float vx, vy;
+  float size, sizeVel;
+  float orbitGoal, sizeGoal;
+};
+
+// update() 1 回分の結果
+struct Frame {
+  // 次の update() が使う乱数の状態
+  uint32_t randomState;
+  // この update() で進めたステップ数 (時計がミリ秒単位なので 0 や 2 のこともある)
+  int steps;
+  std::vector<Sample> balls;
+};
+
+using Trajectory = std::vector<Frame>;
+
+// 1 フレーム毎に World::STEP_US 進める
+static uint64_t simTimeUs = 0;
+
+uint64_t getTimeMs() { return simTimeUs / 1000; }
+uint64_t getTimeUs() { return simTimeUs; }
+VecI getScreenSize() { return VecI{SCREEN_WIDTH, SCREEN_HEIGHT}; }
+void clearScreen() { }
+void drawCircle(VecI pos, int r, Palette col) { }
+void getTouchState(TouchState *touch) { touch->touched = false; }
+
+void setupWorld(World &world, int numBalls, unsigned seed) {
+  Context &ctx = world.ctx;
+  ctx.random.seed(seed);
+  ctx.intf.getTimeMs = getTimeMs;
+  ctx.intf.getTimeUs = getTimeUs;
+  ctx.intf.getScreenSize = getScreenSize;
+  ctx.intf.clearScreen = clearScreen;
+  ctx.intf.drawCircle = drawCircle;
+  ctx.intf.getTouchState = getTouchState;
+  ctx.screenSize = getScreenSize();
+
+  // 重ならないようにひまわり状に並べる
+  for (int i = 0; i < numBalls; i++) {
+    float r = (float)CIRCLE_RADIUS + 1.1f * sqrtf(i);
+    float a = 2.39996f * i;
+    Ball::spawn(ctx, VecR(r * cosf(a), r * sinf(a)));
+  }
+}
+
+// 実機では描き終えたときに死んだいのちを取り除くので、ここでは update() の直後に取り除く
+int step(World &world) {
+  uint64_t steps = world.stepStats.steps;
+  simTimeUs += World::STEP_US;
+  world.update();
+  world.removeDeadObjects();
+  return world.stepStats.steps - steps;
+}
+
+Sample sampleOf(const BallStore &b, int i) {
+  return Sample{
+    b.handleAt(i).key(),
+    (float)b.bodyPos[i].x, (float)b.bodyPos[i].y,
+    (float)b.bodyPosVel[i].x, (float)b.bodyPosVel[i].y,
+    (float)b.bodySize[i], (float)b.bodySizeVel[i],
+    (float)b.orbitGoal[i], (float)b.bodySizeGoal[i]};
+}
+
+void record(Context &ctx, int steps, Trajectory &traj) {
+  Frame frame{ctx.random.state, steps, {}};
+  for (int i = 0; i < ctx.balls.size(); i++) frame.balls.push_back(sampleOf(ctx.balls, i));
+  traj.push_back(frame);
+}
+
+bool writeTrajectories(const char *path, const std::vector<Trajectory> &trajs) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp) return false;
+  for (const auto &traj : trajs) {
+    int numFrames = traj.size();
+    fwrite(&numFrames, sizeof(int), 1, fp);
+    for (const auto &frame : traj) {
+      int n = frame.balls.size();
+      fwrite(&frame.randomState, sizeof(uint32_t), 1, fp);
+      fwrite(&frame.steps, sizeof(int), 1, fp);
+      fwrite(&n, sizeof(int), 1, fp);
+      fwrite(frame.balls.data(), sizeof(Sample), n, fp);
+    }
+  }
+  fclose(fp);
+  return true;
+}
+
+bool readTrajectories(const char *path, std::vector<Trajectory> &trajs) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) return false;
+  trajs.resize(NUM_CASES);
+  bool ok = true;
+  for (auto &traj : trajs) {
+    int numFrames = 0;
+    ok = ok && fread(&numFrames, sizeof(int), 1, fp) == 1;
+    traj.resize(ok ? numFrames : 0);
+    for (auto &frame : traj) {
+      int n = 0;
+      ok = ok && fread(&frame.randomState, sizeof(uint32_t), 1, fp) == 1;
+      ok = ok && fread(&frame.steps, sizeof(int), 1, fp) == 1;
+      ok = ok && fread(&n, sizeof(int), 1, fp) == 1;
+      frame.balls.resize(ok ? n : 0);
+      ok = ok && fread(frame.balls.data(), sizeof(Sample), n, fp) == (size_t)n;
+    }
+  }
+  fclose(fp);
+  return ok;
+}
+
+// 位置、大きさとその速度、目標の差の最大 (速度は 1 ステップに進む量なので同じ単位)
+float sampleError(const Sample &a, const Sample &b) {
+  float err = fmaxf(fabsf(a.x - b.x), fabsf(a.y - b.y));
+  err = fmaxf(err, fmaxf(fabsf(a.size - b.size), fabsf(a.sizeVel - b.sizeVel)));
+  err = fmaxf(err, fmaxf(fabsf(a.orbitGoal - b.orbitGoal), fabsf(a.sizeGoal - b.sizeGoal)));
+  return err;
+}
+
+// 両方で生きているボールについて最大誤差を返す
+float maxError(const std::vector<Sample> &a, const std::vector<Sample> &b) {
+  std::map<uint32_t, const Sample *> byId;
+  for (const auto &s : b) byId[s.id] = &s;
+  float err = 0;
+  for (const auto &s : a) {
+    auto it = byId.find(s.id);
+    if (it == byId.end()) continue;
+    err = fmaxf(err, sampleError(s, *it->second));
+  }
+  return err;
+}
+
+// 1 ステップの長さを変えて係数を libm と比べ、上限を超えた数を返す
+int checkCoeffs() {
+  static constexpr double DELTAS[] = {1.0 / 120, 1.0 / 60, 1.0 / 30, 1.0 / 15};
+  std::unique_ptr<World> world(new World());
+  Context &ctx = world->ctx;
+  int numErrors = 0;
+  double maxErr = 0;
+  for (double delta : DELTAS) {
+    ctx.deltaMs = (real)delta;
+    ctx.updateCoeffs();
+    double d = (double)ctx.deltaMs;
+    const StepCoeffs &c = ctx.coeffs;
+    struct { const char *name; real value; double expected; } coeffs[] = {
+      {"posDamp", c.posDamp, pow(0.0018, d)},
+      {"sizeDamp", c.sizeDamp, pow(0.0000015, d)},
+      {"frameScale", c.frameScale, 60 * d},
+      {"fragmentShrink", c.fragmentShrink, 3 * d},
+    };
+    for (const auto &k : coeffs) {
+      double err = fabs((double)k.value - k.expected) / k.expected;
+      if (err > maxErr) maxErr = err;
+      if (err > COEFF_BOUND) {
+        printf("  coeffs: %s at deltaMs %.6f is %.8f, expected %.8f\n", k.name, d, (double)k.value, k.expected);
+        numErrors++;
+      }
+    }
+  }
+  printf("step coeffs: max relative error %.2e vs libm, bound %g\n", maxErr, COEFF_BOUND);
+  return numErrors;
+}
+
+// from の状態 (乱数を含む) を新しい World に読み込んで update() で 1 ステップ進め、
+// to と比べた誤差をいのち毎に errs に加える (最初の update() は必ず 1 ステップ進める)
+// どちらかで衝突して消えたいのちと、このステップで生まれたいのちは比べない
+void stepErrors(const Frame &from, const Frame &to, unsigned seed, std::vector<float> &errs) {
+  std::unique_ptr<World> world(new World());
+  setupWorld(*world, 0, seed);
+  world->ctx.random.state = from.randomState;
+  BallStore &b = world->ctx.balls;
+  std::vector<Handle> handles;
+  for (const auto &s : from.balls) {
+    int i = b.add(VecR(s.x, s.y));
+    handles.push_back(b.handleAt(i));
+    b.bodyPosVel[i] = VecR(s.vx, s.vy);
+    b.bodySize[i] = s.size;
+    b.bodySizeVel[i] = s.sizeVel;
+    b.orbitGoal[i] = s.orbitGoal;
+    b.bodySizeGoal[i] = s.sizeGoal;
+  }
+  step(*world);
+
+  std::map<uint32_t, const Sample *> byId;
+  for (const auto &s : to.balls) byId[s.id] = &s;
+  for (size_t k = 0; k < from.balls.size(); k++) {
+    const Sample &s = from.balls[k];
+    if (fabsf(sqrtf(s.x * s.x + s.y * s.y) - s.orbitGoal) > MAX_ORBIT_ERR) continue;
+    int i = b.indexOf(handles[k]);
+    auto it = byId.find(s.id);
+    if (i < 0 || it == byId.end()) continue;
+    errs.push_back(sampleError(sampleOf(b, i), *it->second));
+  }
+}
+
+int main(int argc, char **argv) {
+  int numFrames = 300;
+  unsigned seed = 1;
+  const char *dumpPath = nullptr;
+  const char *refPath = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      numFrames = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      seed = strtoul(argv[++i], nullptr, 0);
+    }
+    else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+      dumpPath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--ref") == 0 && i + 1 < argc) {
+      refPath = argv[++i];
+    }
+    else {
+      fprintf(stderr, "usage: %s [-n frames] [-s seed] [--dump file] [--ref file]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  printf("real: %s, frames: %d, seed: %u\n",
+    INOCHI_FIXED_POINT ? "fixed" : "float", numFrames, seed);
+  if (checkCoeffs() > 0) return 1;
+  printf("%8s %14s %8s\n", "balls", "update[us]", "alive");
+
+  std::vector<Trajectory> trajs(NUM_CASES);
+  for (int ic = 0; ic < NUM_CASES; ic++) {
+    std::unique_ptr<World> world(new World());
+    setupWorld(*world, CASE_BALLS[ic], seed);
+    record(world->ctx, 0, trajs[ic]);
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < numFrames; i++) {
+      int steps = step(*world);
+      record(world->ctx, steps, trajs[ic]);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    double updateUs = std::chrono::duration<double, std::micro>(t1 - t0).count() / numFrames;
+    printf("%8d %14.2f %8d\n", CASE_BALLS[ic], updateUs, world->ctx.balls.size());
+  }
+
+  if (dumpPath && !writeTrajectories(dumpPath, trajs)) {
+    fprintf(stderr, "failed to write %s\n", dumpPath);
+    return 1;
+  }
+
+  if (refPath) {
+    std::vector<Trajectory> refs;
+    if (!readTrajectories(refPath, refs)) {
+      fprintf(stderr, "failed to read %s\n", refPath);
+      return 1;
+    }
+    static constexpr int CHECK_FRAMES[] = {1, 10, 60, 300};
+    printf("max trajectory divergence vs %s [world units]\n", refPath);
+    printf("%8s", "balls");
+    for (int f : CHECK_FRAMES) printf(" %10s%-4d", "frame", f);
+    printf("\n");
+    for (int ic = 0; ic < NUM_CASES; ic++) {
+      printf("%8d", CASE_BALLS[ic]);
+      for (int f : CHECK_FRAMES) {
+        int n = std::min(std::min((int)trajs[ic].size(), (int)refs[ic].size()), f + 1);
+        float err = 0;
+        for (int i = 0; i < n; i++) err = fmaxf(err, maxError(trajs[ic][i].balls, refs[ic][i].balls));
+        printf(" %14.6f", err);
+      }
+      printf("\n");
+    }
+
+    printf("one-step error vs %s [world units], bound %g on p99.9\n", refPath, ONE_STEP_BOUND);
+    printf("%8s %10s %14s %14s\n", "balls", "compared", "p99.9", "max");
+    int numErrors = 0;
+    for (int ic = 0; ic < NUM_CASES; ic++) {
+      const Trajectory &ref = refs[ic];
+      std::vector<float> errs;
+      for (size_t f = 0; f + 1 < ref.size(); f++) {
+        if (ref[f + 1].steps == 1) stepErrors(ref[f], ref[f + 1], seed, errs);
+      }
+      if (errs.empty()) continue;
+      std::sort(errs.begin(), errs.end());
+      float p999 = errs[(errs.size() - 1) * 999 / 1000];
+      bool ok = p999 <= ONE_STEP_BOUND;
+      if (!ok) numErrors++;
+      printf("%8d %10zu %14.6f %14.6f%s\n", CASE_BALLS[ic], errs.size(), p999, errs.back(), ok ? "" : "  exceeds bound");
+    }
+    if (numErrors) return 1;
+  }
+  return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+  return shapoco::main(argc, argv);
+}
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "lcd_service.hpp"
+#include "inochi/inochi.hpp"
+
+// PackedRaster と CircleStampCache の円描画を LGFX_Sprite::fillCircle (スタンドイン) と比べる
+// 画素が一致しなければ終了コード 1 を返す
+// 時間は World が実際に描く円 (Context::fillCircle が出す半径) で計る
+
+namespace shapoco {
+
+using namespace shapoco::inochi;
+using clock = std::chrono::steady_clock;
+
+static constexpr int SCREEN_WIDTH = 480;
+static constexpr int SCREEN_HEIGHT = 320;
+static constexpr int NUM_RANDOM_CIRCLES = 20000;
+static constexpr int NUM_SCENE_FRAMES = 600;
+static constexpr int NUM_REPEATS = 20;
+
+struct DrawCall {
+  int x, y, r;
+  uint8_t col;
+};
+
+std::vector<std::vector<DrawCall>> sceneFrames;
+uint64_t simTimeMs = 0;
+
+uint64_t getTimeMs() { return simTimeMs; }
+uint64_t getTimeUs() { return simTimeMs * 1000; }
+VecI getScreenSize() { return VecI{SCREEN_WIDTH, SCREEN_HEIGHT}; }
+void clearScreen() { sceneFrames.back().clear(); }
+void drawCircle(VecI pos, int r, Palette col) { sceneFrames.back().push_back(DrawCall{pos.x, pos.y, r, (uint8_t)col}); }
+void getTouchState(TouchState *touch) { touch->touched = false; }
+
+// World を回して 1 フレーム毎の描画呼び出しを記録する
+void recordScene(unsigned seed, int numExtraBalls) {
+  srand(seed);
+  std::unique_ptr<World> world(new World());
+  HostAPI intf;
+  intf.getTimeMs = getTimeMs;
+  intf.getTimeUs = getTimeUs;
+  intf.getScreenSize = getScreenSize;
+  intf.clearScreen = clearScreen;
+  intf.drawCircle = drawCircle;
+  intf.getTouchState = getTouchState;
+  world->init(intf, seed);
+  for (int i = 0; i < numExtraBalls; i++) {
+    VecR pos(VIEW_RADIUS * (world->ctx.randR() - 0.5), VIEW_RADIUS * (world->ctx.randR() - 0.5));
+    Ball::spawn(world->ctx, pos);
+  }
+  for (int i = 0; i < NUM_SCENE_FRAMES; i++) {
+    simTimeMs += 16;
+    sceneFrames.emplace_back();
+    world->update();
+    while (!world->idle()) world->servicePaint();
+  }
+}
+
+double usSince(clock::time_point t) {
+  return std::chrono::duration<double, std::micro>(clock::now() - t).count();
+}
+
+template<typename PALETTE>
+struct RasterTest {
+  using Raster = PackedRaster<PALETTE::BPP>;
+  using Circle = typename Raster::Circle;
+  using Stamps = typename LcdService<PALETTE, SCREEN_WIDTH, SCREEN_HEIGHT>::StampCache;
+  static constexpr uint8_t PALETTE_INDEX[] = {PALETTE::BLACK, PALETTE::RED, PALETTE::BLUE, PALETTE::WHITE};
+
+  LGFX_Sprite ref;
+  LGFX_Sprite dut;
+  int stride;
+
+  RasterTest() {
+    ref.setColorDepth(PALETTE::BPP);
+    ref.createSprite(SCREEN_WIDTH, SCREEN_HEIGHT);
+    dut.setColorDepth(PALETTE::BPP);
+    dut.createSprite(SCREEN_WIDTH, SCREEN_HEIGHT);
+    stride = (SCREEN_WIDTH * PALETTE::BPP + 7) / 8;
+  }
+
+  uint8_t *dutBuff() { return (uint8_t*)dut.getBuffer(); }
+
+  bool same(const char *what) {
+    if (memcmp(ref.getBuffer(), dut.getBuffer(), stride * SCREEN_HEIGHT) == 0) return true;
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+      for (int x = 0; x < SCREEN_WIDTH; x++) {
+        if (ref.readPixelValue(x, y) != dut.readPixelValue(x, y)) {
+          printf("  %dbpp %s: mismatch at (%d, %d)\n", PALETTE::BPP, what, x, y);
+          return false;
+        }
+      }
+    }
+    return false;
+  }
+
+  void clear() {
+    ref.clear(PALETTE::BACKGROUND);
+    dut.clear(PALETTE::BACKGROUND);
+  }
+
+  int testExact() {
+    int numErrors = 0;
+
+    // 全ての半径を、画面の内側と端をまたぐ位置で
+    for (int r = 0; r <= Raster::MAX_RADIUS; r++) {
+      clear();
+      for (int k = 0; k < 8; k++) {
+        int x = rand() % (SCREEN_WIDTH + 2 * r + 1) - r;
+        int y = rand() % (SCREEN_HEIGHT + 2 * r + 1) - r;
+        uint8_t col = PALETTE_INDEX[k & 3];
+        ref.fillCircle(x, y, r, col);
+        Raster::fillCircle(dutBuff(), stride, SCREEN_WIDTH, SCREEN_HEIGHT, x, y, r, col);
+      }
+      if (!same("single")) {
+        printf("    radius %d\n", r);
+        numErrors++;
+        break;
+      }
+    }
+
+    // 小さい円を大量に重ねる (1 バイトの中の位置を全て踏む)
+    std::vector<Circle> circles(NUM_RANDOM_CIRCLES);
+    for (auto &c : circles) {
+      c.x = rand() % (SCREEN_WIDTH + 40) - 20;
+      c.y = rand() % (SCREEN_HEIGHT + 40) - 20;
+      c.r = rand() % 20;
+      c.col = PALETTE_INDEX[rand() & 3];
+    }
+    clear();
+    for (auto &c : circles) ref.fillCircle(c.x, c.y, c.r, c.col);
+    for (auto &c : circles) Raster::fillCircle(dutBuff(), stride, SCREEN_WIDTH, SCREEN_HEIGHT, c.x, c.y, c.r, c.col);
+    if (!same("random")) numErrors++;
+
+    dut.clear(PALETTE::BACKGROUND);
+    Raster::fillCircles(dutBuff(), stride, SCREEN_WIDTH, SCREEN_HEIGHT, circles.data(), circles.size());
+    if (!same("batch")) numErrors++;
+
+    // World が描いたフレームそのもの
+    for (size_t i = 0; i < sceneFrames.size(); i += 37) {
+      clear();
+      std::vector<Circle> frame;
+      for (auto &d : sceneFrames[i]) {
+        ref.fillCircle(d.x, d.y, d.r, PALETTE_INDEX[d.col]);
+        frame.push_back(Circle{(int16_t)d.x, (int16_t)d.y, (int16_t)d.r, PALETTE_INDEX[d.col]});
+      }
+      Raster::fillCircles(dutBuff(), stride, SCREEN_WIDTH, SCREEN_HEIGHT, frame.data(), frame.size());
+      if (!same("scene")) {
+        numErrors++;
+        break;
+      }
+    }
+
+    // スタンプ: 全ての半径が入る容量と、追い出しが起きる小さな容量で
+    std::unique_ptr<CircleStampCache<PALETTE::BPP, 16 * 1024>> large(new CircleStampCache<PALETTE::BPP, 16 * 1024>());
+    for (int r = 0; r <= Raster::MAX_RADIUS; r++) {
+      clear();
+      for (int k = 0; k < 8; k++) {
+        int x = rand() % (SCREEN_WIDTH + 2 * r + 1) - r;
+        int y = rand() % (SCREEN_HEIGHT + 2 * r + 1) - r;
+        if (k & 1) x = r + rand() % (SCREEN_WIDTH - 2 * r > 0 ? SCREEN_WIDTH - 2 * r : 1);
+        uint8_t col = PALETTE_INDEX[k & 3];
+        ref.fillCircle(x, y, r, col);
+        large->fillCircle(dutBuff(), stride, SCREEN_WIDTH, SCREEN_HEIGHT, x, y, r, col);
+      }
+      if (!same("stamp")) {
+        printf("    radius %d\n", r);
+        numErrors++;
+        break;
+      }
+    }
+    std::unique_ptr<CircleStampCache<PALETTE::BPP, 2 * 1024>> small(new CircleStampCache<PALETTE::BPP, 2 * 1024>());
+    clear();
+    for (auto &c : circles) ref.fillCircle(c.x, c.y, c.r, c.col);
+    for (auto &c : circles) small->fillCircle(dutBuff(), stride, SCREEN_WIDTH, SCREEN_HEIGHT, c.x, c.y, c.r, c.col);
+    if (!same("stamp random")) numErrors++;
+    if (small->stats.peakBytesUsed > 2 * 1024) {
+      printf("  %dbpp stamp: %d bytes used, over capacity\n", PALETTE::BPP, small->stats.peakBytesUsed);
+      numErrors++;
+    }
+    return numErrors;
+  }
+
+  // 容量毎のスタンプのヒット率
+  template<int CAPACITY>
+  void stampHitRate() {
+    std::unique_ptr<CircleStampCache<PALETTE::BPP, CAPACITY>> cache(new CircleStampCache<PALETTE::BPP, CAPACITY>());
+    for (auto &f : sceneFrames) {
+      for (auto &d : f) cache->fillCircle(dutBuff(), stride, SCREEN_WIDTH, SCREEN_HEIGHT, d.x, d.y, d.r, d.col);
+    }
+    const auto &st = cache->stats;
+    printf(" %7.1f%%", st.lookups ? 100.0 * st.hits / st.lookups : 0.0);
+  }
+
+  void stampHitRates() {
+    printf("%4dbpp", PALETTE::BPP);
+    stampHitRate<2 * 1024>();
+    stampHitRate<4 * 1024>();
+    stampHitRate<8 * 1024>();
+    stampHitRate<16 * 1024>();
+    stampHitRate<32 * 1024>();
+    printf("\n");
+  }
+
+  void bench() {
+    std::vector<std::vector<Circle>> frames;
+    size_t numCircles = 0;
+    for (auto &f : sceneFrames) {
+      frames.emplace_back();
+      for (auto &d : f) frames.back().push_back(Circle{(int16_t)d.x, (int16_t)d.y, (int16_t)d.r, PALETTE_INDEX[d.col]});
+      numCircles += f.size();
+    }
+
+    double us[4];
+    auto t = clock::now();
+    for (int rep = 0; rep < NUM_REPEATS; rep++) {
+      for (auto &f : frames) {
+        for (auto &c : f) ref.fillCircle(c.x, c.y, c.r, c.col);
+      }
+    }
+    us[0] = usSince(t);
+    t = clock::now();
+    for (int rep = 0; rep < NUM_REPEATS; rep++) {
+      for (auto &f : frames) {
+        for (auto &c : f) Raster::fillCircle(dutBuff(), stride, SCREEN_WIDTH, SCREEN_HEIGHT, c.x, c.y, c.r, c.col);
+      }
+    }
+    us[1] = usSince(t);
+    t = clock::now();
+    for (int rep = 0; rep < NUM_REPEATS; rep++) {
+      for (auto &f : frames) {
+        Raster::fillCircles(dutBuff(), stride, SCREEN_WIDTH, SCREEN_HEIGHT, f.data(), f.size());
+      }
+    }
+    us[2] = usSince(t);
+    std::unique_ptr<Stamps> stamps(new Stamps());
+    t = clock::now();
+    for (int rep = 0; rep < NUM_REPEATS; rep++) {
+      for (auto &f : frames) {
+        for (auto &c : f) stamps->fillCircle(dutBuff(), stride, SCREEN_WIDTH, SCREEN_HEIGHT, c.x, c.y, c.r, c.col);
+      }
+    }
+    us[3] = usSince(t);
+
+    double n = (double)numCircles * NUM_REPEATS;
+    const auto &st = stamps->stats;
+    printf("%4dbpp %12.1f %12.1f %12.1f %12.1f %8.2f %8.2f %8.2f %7.1f%% %8d\n",
+      PALETTE::BPP, us[0] * 1e3 / n, us[1] * 1e3 / n, us[2] * 1e3 / n, us[3] * 1e3 / n,
+      us[0] / us[1], us[0] / us[2], us[0] / us[3],
+      100.0 * st.hits / st.lookups, st.peakBytesUsed);
+  }
+};
+
+int main(int argc, char **argv) {
+  unsigned seed = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1;
+  int numExtraBalls = argc > 2 ? atoi(argv[2]) : 0;
+  recordScene(seed, numExtraBalls);
+
+  std::vector<int> radii;
+  for (auto &f : sceneFrames) {
+    for (auto &d : f) radii.push_back(d.r);
+  }
+  std::sort(radii.begin(), radii.end());
+  printf("scene: %d frames, %.1f circles/frame, radius min %d / p50 %d / p90 %d / max %d\n",
+    (int)sceneFrames.size(), (double)radii.size() / sceneFrames.size(),
+    radii.front(), radii[radii.size() / 2], radii[radii.size() * 9 / 10], radii.back());
+
+  int numErrors = 0;
+  std::unique_ptr<RasterTest<Palette1bpp>> t1(new RasterTest<Palette1bpp>());
+  std::unique_ptr<RasterTest<Palette2bpp>> t2(new RasterTest<Palette2bpp>());
+  std::unique_ptr<RasterTest<Palette4bpp>> t4(new RasterTest<Palette4bpp>());
+  std::unique_ptr<RasterTest<Palette8bpp>> t8(new RasterTest<Palette8bpp>());
+  numErrors += t1->testExact();
+  numErrors += t2->testExact();
+  numErrors += t4->testExact();
+  numErrors += t8->testExact();
+
+  printf("%7s %12s %12s %12s %12s %8s %8s %8s %8s %8s\n",
+    "", "lgfx", "native", "batch", "stamp", "speedup", "batch", "stamp", "stamp", "stamp");
+  printf("%7s %12s %12s %12s %12s %8s %8s %8s %8s %8s\n",
+    "", "[ns/circle]", "[ns/circle]", "[ns/circle]", "[ns/circle]", "", "speedup", "speedup", "hit", "[bytes]");
+  t1->bench();
+  t2->bench();
+  t4->bench();
+  t8->bench();
+
+  printf("stamp hit rate by capacity\n");
+  printf("%7s %8s %8s %8s %8s %8s\n", "", "2KB", "4KB", "8KB", "16KB", "32KB");
+  t1->stampHitRates();
+  t2->stampHitRates();
+  t4->stampHitRates();
+  t8->stampHitRates();
+
+  if (numErrors) {
+    printf("%d mismatches\n", numErrors);
+    return 1;
+  }
+  printf("packed raster and stamps match LGFX_Sprite::fillCircle\n");
+  return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+  return shapoco::main(argc, argv);
+}
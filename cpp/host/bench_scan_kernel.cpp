@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "lcd_service.hpp"
+
+// スキャンアウトのカーネル (差分区間の検出と画素の展開) を
+// 1 バイトずつの実装と比較する。結果が一致しなければ終了コード 1 を返す
+// パネルの内容を写したバッファと区間ハッシュのどちらで変更を見つけるかも比べる
+
+namespace shapoco {
+
+using clock = std::chrono::steady_clock;
+
+static constexpr int WIDTH = 480;
+static constexpr int STRIDE = WIDTH * 2 / 8;
+static constexpr int NUM_LINES = 256;
+static constexpr int NUM_REPEATS = 200;
+
+double usSince(clock::time_point t) {
+  return std::chrono::duration<double, std::micro>(clock::now() - t).count();
+}
+
+// density: 1 バイトあたりの変更確率 (1/1000 単位)、runLen: 変更の塊の長さ
+void makeLines(std::vector<uint8_t> &oldLines, std::vector<uint8_t> &newLines, int density, int runLen) {
+  for (size_t i = 0; i < oldLines.size(); i++) {
+    oldLines[i] = newLines[i] = rand();
+  }
+  for (size_t i = 0; i < newLines.size(); i++) {
+    if (rand() % 1000 < density) {
+      for (int k = 0; k < runLen && i < newLines.size(); k++, i++) {
+        newLines[i] = oldLines[i] ^ (1 + rand() % 255);
+      }
+    }
+  }
+}
+
+struct Run {
+  int start, end;
+  bool operator==(const Run &r) const { return start == r.start && end == r.end; }
+};
+
+template<typename F>
+void collectRuns(F find, const uint8_t *oldLine, const uint8_t *newLine, int from, int to, std::vector<Run> &runs) {
+  int ix = from;
+  Run r;
+  while (ix < to && find(oldLine, newLine, ix, to, &r.start, &r.end)) {
+    runs.push_back(r);
+    ix = r.end;
+  }
+}
+
+// 区間ハッシュで見つけた変更区間を、バイト毎に比べて求めた区間と比べる
+int testSegments(const std::vector<uint8_t> &oldBuff, const std::vector<uint8_t> &newBuff, const char *name) {
+  constexpr int numSegs = (STRIDE + HASH_SEGMENT_BYTES - 1) / HASH_SEGMENT_BYTES;
+  for (int y = 0; y < NUM_LINES; y++) {
+    const uint8_t *oldLine = oldBuff.data() + y * STRIDE;
+    const uint8_t *newLine = newBuff.data() + y * STRIDE;
+    uint32_t hashes[numSegs];
+    for (int i = 0; i < numSegs; i++) hashes[i] = hashSegmentAt(oldLine, STRIDE, i);
+
+    std::vector<Run> expected, actual;
+    for (int i = 0; i < numSegs; i++) {
+      int n = STRIDE - i * HASH_SEGMENT_BYTES;
+      if (n > HASH_SEGMENT_BYTES) n = HASH_SEGMENT_BYTES;
+      bool changed = memcmp(oldLine + i * HASH_SEGMENT_BYTES, newLine + i * HASH_SEGMENT_BYTES, n) != 0;
+      if (!changed) continue;
+      if (!expected.empty() && expected.back().end == i) expected.back().end++;
+      else expected.push_back(Run{i, i + 1});
+    }
+    int i = 0;
+    Run r;
+    while (i < numSegs && findChangedSegments(hashes, newLine, STRIDE, i, numSegs, &r.start, &r.end)) {
+      actual.push_back(r);
+      i = r.end;
+    }
+    if (expected != actual) {
+      printf("  segment mismatch: %s line=%d\n", name, y);
+      return 1;
+    }
+    for (int i = 0; i < numSegs; i++) {
+      if (hashes[i] != hashSegmentAt(newLine, STRIDE, i)) {
+        printf("  segment hash not updated: %s line=%d\n", name, y);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// 変更を見つけて覚えている内容を更新する時間 (写したバッファと区間ハッシュ)
+// 偶数回目は old から new へ、奇数回目は new から old へ更新する
+void timeShadow(const std::vector<uint8_t> &oldBuff, const std::vector<uint8_t> &newBuff, double *us) {
+  constexpr int numSegs = (STRIDE + HASH_SEGMENT_BYTES - 1) / HASH_SEGMENT_BYTES;
+  std::vector<uint8_t> shadow(oldBuff);
+  auto t = clock::now();
+  for (int rep = 0; rep < NUM_REPEATS; rep++) {
+    const std::vector<uint8_t> &target = rep % 2 == 0 ? newBuff : oldBuff;
+    for (int y = 0; y < NUM_LINES; y++) {
+      uint8_t *shadowLine = shadow.data() + y * STRIDE;
+      const uint8_t *line = target.data() + y * STRIDE;
+      int ix = 0;
+      int start, end;
+      while (ix < STRIDE && findChangedRun(shadowLine, line, ix, STRIDE, &start, &end)) {
+        memcpy(shadowLine + start, line + start, end - start);
+        ix = end;
+      }
+    }
+  }
+  us[0] = usSince(t) / NUM_REPEATS;
+
+  std::vector<uint32_t> hashes(numSegs * NUM_LINES);
+  for (int y = 0; y < NUM_LINES; y++) {
+    for (int i = 0; i < numSegs; i++) hashes[y * numSegs + i] = hashSegmentAt(oldBuff.data() + y * STRIDE, STRIDE, i);
+  }
+  t = clock::now();
+  for (int rep = 0; rep < NUM_REPEATS; rep++) {
+    const std::vector<uint8_t> &target = rep % 2 == 0 ? newBuff : oldBuff;
+    for (int y = 0; y < NUM_LINES; y++) {
+      const uint8_t *line = target.data() + y * STRIDE;
+      int i = 0;
+      int start, end;
+      while (i < numSegs && findChangedSegments(hashes.data() + y * numSegs, line, STRIDE, i, numSegs, &start, &end)) {
+        i = end;
+      }
+    }
+  }
+  us[1] = usSince(t) / NUM_REPEATS;
+}
+
+// LcdService<PALETTE, ...>::EXPAND_TABLE を 1 画素ずつの展開と比べる
+template<typename PALETTE>
+int testExpand() {
+  using Screen = LcdService<PALETTE, WIDTH, 1>;
+  constexpr int stride = Screen::stride;
+  constexpr int ppb = Screen::PIXELS_PER_BYTE;
+  std::vector<uint8_t> src(stride * NUM_LINES);
+  for (auto &b : src) b = rand();
+  std::vector<uint16_t> expected(src.size() * ppb), actual(src.size() * ppb);
+
+  double us[2];
+  auto t = clock::now();
+  for (int rep = 0; rep < NUM_REPEATS; rep++) {
+    for (int y = 0; y < NUM_LINES; y++) {
+      expandPixelsScalar<Screen::BPP>(src.data() + y * stride, stride, PALETTE::RGB565, expected.data() + y * WIDTH);
+    }
+  }
+  us[0] = usSince(t) / NUM_REPEATS;
+  t = clock::now();
+  for (int rep = 0; rep < NUM_REPEATS; rep++) {
+    for (int y = 0; y < NUM_LINES; y++) {
+      Screen::EXPAND_TABLE.expand(src.data() + y * stride, stride, actual.data() + y * WIDTH);
+    }
+  }
+  us[1] = usSince(t) / NUM_REPEATS;
+
+  char name[16];
+  snprintf(name, sizeof(name), "%dbpp", Screen::BPP);
+  printf("%-8s %12.2f %12.2f %8.2f\n", name, us[0], us[1], us[0] / us[1]);
+  if (expected != actual) {
+    printf("  expand mismatch at %dbpp\n", Screen::BPP);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  unsigned seed = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1;
+  srand(seed);
+  int numErrors = 0;
+
+  // 差分区間の検出
+  struct Case { const char *name; int density; int runLen; };
+  static constexpr Case CASES[] = {
+    {"none", 0, 1},
+    {"sparse", 2, 6},
+    {"medium", 20, 4},
+    {"dense", 300, 1},
+  };
+
+  printf("%-8s %12s %12s %8s\n", "diff", "scalar[us]", "swar[us]", "speedup");
+  for (const Case &c : CASES) {
+    // 先頭に余白を置いてポインタのずれも試す
+    std::vector<uint8_t> oldBuff(STRIDE * NUM_LINES + 8), newBuff(STRIDE * NUM_LINES + 8);
+    makeLines(oldBuff, newBuff, c.density, c.runLen);
+
+    for (int offset = 0; offset < 4; offset++) {
+      for (int trial = 0; trial < NUM_LINES; trial++) {
+        const uint8_t *oldLine = oldBuff.data() + offset + trial * STRIDE;
+        const uint8_t *newLine = newBuff.data() + (trial & 3) + trial * STRIDE;
+        int from = rand() % 16;
+        int to = STRIDE - rand() % 16;
+        std::vector<Run> expected, actual;
+        collectRuns(findChangedRunScalar, oldLine, newLine, from, to, expected);
+        collectRuns(findChangedRun, oldLine, newLine, from, to, actual);
+        if (expected != actual) {
+          printf("  run mismatch: %s offset=%d line=%d\n", c.name, offset, trial);
+          numErrors++;
+          break;
+        }
+      }
+    }
+
+    // ハードウェアに近い条件 (同じアラインメント) で時間を計る
+    std::vector<Run> runs;
+    runs.reserve(STRIDE);
+    double us[2];
+    for (int impl = 0; impl < 2; impl++) {
+      auto t = clock::now();
+      for (int rep = 0; rep < NUM_REPEATS; rep++) {
+        for (int y = 0; y < NUM_LINES; y++) {
+          runs.clear();
+          const uint8_t *oldLine = oldBuff.data() + y * STRIDE;
+          const uint8_t *newLine = newBuff.data() + y * STRIDE;
+          if (impl == 0) collectRuns(findChangedRunScalar, oldLine, newLine, 0, STRIDE, runs);
+          else collectRuns(findChangedRun, oldLine, newLine, 0, STRIDE, runs);
+        }
+      }
+      us[impl] = usSince(t) / NUM_REPEATS;
+    }
+    printf("%-8s %12.2f %12.2f %8.2f\n", c.name, us[0], us[1], us[0] / us[1]);
+  }
+
+  // パネルの内容の覚え方 (1 ライン STRIDE バイトに対し、写しは STRIDE バイト、ハッシュは区間毎に 4 バイト)
+  printf("%-8s %12s %12s %8s\n", "shadow", "copy[us]", "hash[us]", "speedup");
+  for (const Case &c : CASES) {
+    std::vector<uint8_t> oldBuff(STRIDE * NUM_LINES), newBuff(STRIDE * NUM_LINES);
+    makeLines(oldBuff, newBuff, c.density, c.runLen);
+    numErrors += testSegments(oldBuff, newBuff, c.name);
+    double us[2];
+    timeShadow(oldBuff, newBuff, us);
+    printf("%-8s %12.2f %12.2f %8.2f\n", c.name, us[0], us[1], us[0] / us[1]);
+  }
+
+  // 画素の展開
+  printf("%-8s %12s %12s %8s\n", "expand", "scalar[us]", "table[us]", "speedup");
+  numErrors += testExpand<Palette1bpp>();
+  numErrors += testExpand<Palette2bpp>();
+  numErrors += testExpand<Palette4bpp>();
+  numErrors += testExpand<Palette8bpp>();
+
+  if (numErrors) {
+    printf("%d mismatches\n", numErrors);
+    return 1;
+  }
+  printf("scan kernels match scalar reference\n");
+  return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+  return shapoco::main(argc, argv);
+}
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "spsc_queue.hpp"
+
+// SpscQueue を 2 スレッドで叩いて取りこぼし・順序の入れ替わり・
+// バッファ所有権の競合が無いことを確かめる。異常があれば終了コード 1 を返す
+// (-DSHAPOPAD_HOST_TSAN=ON でビルドすると ThreadSanitizer でも検査できる)
+
+namespace shapoco {
+
+using clock = std::chrono::steady_clock;
+
+static constexpr int NUM_ITEMS = 2000000;
+static constexpr int NUM_FRAMES = 20000;
+static constexpr int NUM_BUFFERS = 2;
+static constexpr int BUFFER_SIZE = 4096;
+
+struct Item {
+  uint32_t seq;
+  uint32_t check;
+};
+
+static uint32_t checkOf(uint32_t seq) {
+  return seq * 2654435761u ^ 0x5a5a5a5au;
+}
+
+double msSince(clock::time_point t) {
+  return std::chrono::duration<double, std::milli>(clock::now() - t).count();
+}
+
+// 連番を流して順序と内容を確かめる
+int testSequence() {
+  SpscQueue<Item, 8> queue;
+  int numErrors = 0;
+
+  auto t = clock::now();
+  std::thread producer([&] {
+    for (uint32_t i = 0; i < NUM_ITEMS; i++) {
+      Item item{i, checkOf(i)};
+      while (!queue.push(item)) std::this_thread::yield();
+    }
+  });
+
+  for (uint32_t i = 0; i < NUM_ITEMS; i++) {
+    Item item;
+    while (!queue.pop(&item)) std::this_thread::yield();
+    if (item.seq != i || item.check != checkOf(i)) {
+      if (numErrors++ == 0) {
+        printf("  sequence error: expected %u, got %u\n", i, item.seq);
+      }
+    }
+  }
+  producer.join();
+  if (!queue.empty()) {
+    printf("  queue not empty after drain\n");
+    numErrors++;
+  }
+
+  double ms = msSince(t);
+  printf("sequence:  %d items in %.1f ms (%.1f Mitems/s)\n", NUM_ITEMS, ms, NUM_ITEMS / ms / 1e3);
+  return numErrors;
+}
+
+// LcdService と同じ形で 2 つのバッファを受け渡す
+// 生産者はバッファ全体をフレーム番号で埋め、消費者は全て同じ値か確かめてから返す
+int testOwnership() {
+  static uint8_t buffers[NUM_BUFFERS][BUFFER_SIZE];
+  SpscQueue<uint8_t, 4> submitted;
+  SpscQueue<uint8_t, 4> released;
+  std::atomic<int> numErrors{0};
+
+  for (int i = 1; i < NUM_BUFFERS; i++) released.push(i);
+
+  auto t = clock::now();
+  std::thread consumer([&] {
+    int scanIndex = -1;
+    for (int frame = 0; frame < NUM_FRAMES; frame++) {
+      uint8_t index;
+      while (!submitted.pop(&index)) std::this_thread::yield();
+      if (scanIndex >= 0) {
+        while (!released.push(scanIndex)) std::this_thread::yield();
+      }
+      scanIndex = index;
+      uint8_t expected = (uint8_t)frame;
+      for (int k = 0; k < BUFFER_SIZE; k++) {
+        if (buffers[index][k] != expected) {
+          if (numErrors.fetch_add(1) == 0) {
+            printf("  ownership error: frame %d byte %d\n", frame, k);
+          }
+          break;
+        }
+      }
+    }
+  });
+
+  int drawIndex = 0;
+  for (int frame = 0; frame < NUM_FRAMES; frame++) {
+    if (drawIndex < 0) {
+      uint8_t index;
+      while (!released.pop(&index)) std::this_thread::yield();
+      drawIndex = index;
+    }
+    memset(buffers[drawIndex], (uint8_t)frame, BUFFER_SIZE);
+    while (!submitted.push(drawIndex)) std::this_thread::yield();
+    drawIndex = -1;
+  }
+  consumer.join();
+
+  double ms = msSince(t);
+  printf("ownership: %d frames in %.1f ms\n", NUM_FRAMES, ms);
+  return numErrors.load();
+}
+
+int main(int argc, char **argv) {
+  int numErrors = 0;
+  numErrors += testSequence();
+  numErrors += testOwnership();
+  if (numErrors) {
+    printf("%d errors\n", numErrors);
+    return 1;
+  }
+  printf("spsc queue ok\n");
+  return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+  return shapoco::main(argc, argv);
+}
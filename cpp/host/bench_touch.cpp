@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "seqlock_slot.hpp"
+#include "touch_sampler.hpp"
+
+// SeqLockSlot を 2 スレッドで叩いて書きかけの値を読まないこと、
+// TouchSampler が転送中にパネルを読まず、フレームの間を待ちすぎないこと、
+// 押下の確定と位置の均しが決めた通りに動くことを確かめる。異常があれば終了コード 1 を返す
+
+namespace shapoco {
+
+using clock = std::chrono::steady_clock;
+
+static constexpr int NUM_STORES = 2000000;
+
+struct Record {
+  uint32_t seq;
+  uint32_t words[5];
+};
+
+static uint32_t checkOf(uint32_t seq, int i) {
+  return (seq + i) * 2654435761u ^ 0x5a5a5a5au;
+}
+
+double msSince(clock::time_point t) {
+  return std::chrono::duration<double, std::milli>(clock::now() - t).count();
+}
+
+// 書く側が連番と検査用の値を書き続け、読む側は組が揃っていて連番が戻らないことを確かめる
+int testSeqLock() {
+  SeqLockSlot<Record> slot;
+  std::atomic<bool> done{false};
+  int numErrors = 0;
+  uint64_t numLoads = 0;
+
+  auto t = clock::now();
+  std::thread writer([&] {
+    for (uint32_t i = 1; i <= NUM_STORES; i++) {
+      Record r;
+      r.seq = i;
+      for (int k = 0; k < 5; k++) r.words[k] = checkOf(i, k);
+      slot.store(r);
+    }
+    done.store(true, std::memory_order_release);
+  });
+
+  uint32_t lastSeq = 0;
+  while (!done.load(std::memory_order_acquire)) {
+    Record r;
+    uint32_t n = slot.load(&r);
+    numLoads++;
+    if (n == 0) continue;
+    bool ok = r.seq == n && r.seq >= lastSeq;
+    for (int k = 0; k < 5; k++) ok = ok && r.words[k] == checkOf(r.seq, k);
+    if (!ok && numErrors++ == 0) {
+      printf("  seqlock: torn or stale value (seq %u after %u, count %u)\n", r.seq, lastSeq, n);
+    }
+    lastSeq = r.seq;
+  }
+  writer.join();
+
+  Record r;
+  if (slot.load(&r) != NUM_STORES || r.seq != NUM_STORES) {
+    printf("  seqlock: last value %u, expected %d\n", r.seq, NUM_STORES);
+    numErrors++;
+  }
+  double ms = msSince(t);
+  printf("seqlock:     %d stores, %llu loads in %.1f ms\n", NUM_STORES, (unsigned long long)numLoads, ms);
+  return numErrors;
+}
+
+// 仮想時刻でスキャンアウトを模擬する
+// フレーム毎に SCAN_US の間は BURST_US の転送と GAP_US の隙間を繰り返し、残りはフレームの間
+int testSchedule(uint32_t scanUs) {
+  static constexpr uint32_t FRAME_US = 16667;
+  static constexpr uint32_t BURST_US = 400;
+  static constexpr uint32_t GAP_US = 40;
+  static constexpr uint32_t STEP_US = 10;
+  static constexpr uint64_t DURATION_US = 5 * 1000 * 1000;
+
+  TouchSampler sampler;
+  int numErrors = 0;
+  bool busFree = true;
+  uint64_t lastSampleUs = 0;
+  uint32_t maxGapUs = 0;
+
+  for (uint64_t now = 0; now < DURATION_US; now += STEP_US) {
+    uint32_t inFrame = now % FRAME_US;
+    bool scanIdle = inFrame >= scanUs;
+    busFree = scanIdle || inFrame % (BURST_US + GAP_US) >= BURST_US;
+    sampler.poll(now, busFree, scanIdle, [&](int16_t *x, int16_t *y) {
+      if (!busFree && numErrors++ == 0) printf("  schedule: read during a transfer at %llu us\n", (unsigned long long)now);
+      if (lastSampleUs > 0 && now - lastSampleUs > maxGapUs) maxGapUs = now - lastSampleUs;
+      lastSampleUs = now;
+      return false;
+    });
+  }
+
+  const auto &st = sampler.stats;
+  // 隙間を待つのは TOUCH_MAX_DEFER_US まで。その後はライン間の隙間を待つだけ
+  // (フレームの境目では 2 回分の転送が続くことがある)
+  uint32_t limitUs = sampler.intervalUs + sampler.maxDeferUs + 2 * BURST_US + STEP_US;
+  if (maxGapUs > limitUs) {
+    printf("  schedule: %u us between samples (limit %u us)\n", maxGapUs, limitUs);
+    numErrors++;
+  }
+  if (st.busyRefusals == 0) {
+    printf("  schedule: never polled during a transfer\n");
+    numErrors++;
+  }
+  printf("schedule:    scan %5u us of %u us frames, %u samples, %u between lines, %u deferred, max %u us apart, max %u us late\n",
+    scanUs, FRAME_US, st.samples, st.midScanSamples, st.deferredSamples, maxGapUs, st.maxLateUs);
+  return numErrors;
+}
+
+// 読んだ値の列を与えて、確定した状態を比べる
+int testFilter() {
+  struct Step {
+    bool touched;
+    int16_t x, y;
+    bool expectTouched;
+    int16_t expectX, expectY;
+  };
+  static const Step STEPS[] = {
+    // 1 回だけの押下は確定しない
+    {true, 10, 10, false, 0, 0},
+    {false, 0, 0, false, 0, 0},
+    // 2 回続けば押下。位置はそのときの値
+    {true, 100, 50, false, 0, 0},
+    {true, 102, 52, true, 102, 52},
+    {true, 104, 54, true, 102, 52},
+    // 1 回だけ飛んだ値は中央値で捨てる
+    {true, 300, 54, true, 104, 54},
+    {true, 106, 56, true, 106, 54},
+    {true, 108, 58, true, 108, 56},
+    // 離し際の値は使わず、離れが 3 回続くまでは押したまま
+    {false, 0, 0, true, 108, 56},
+    {true, 110, 60, true, 110, 60},
+    {false, 0, 0, true, 110, 60},
+    {false, 0, 0, true, 110, 60},
+    {false, 0, 0, false, 110, 60},
+  };
+
+  TouchSampler sampler;
+  int numErrors = 0;
+  uint64_t now = 0;
+  int n = sizeof(STEPS) / sizeof(STEPS[0]);
+  for (int i = 0; i < n; i++) {
+    const Step &step = STEPS[i];
+    now += sampler.intervalUs;
+    bool sampled = sampler.poll(now, true, true, [&](int16_t *x, int16_t *y) {
+      *x = step.x;
+      *y = step.y;
+      return step.touched;
+    });
+    TouchSample s = sampler.latest();
+    bool ok = sampled && s.touched == step.expectTouched && s.timeUs == now;
+    if (step.expectTouched) ok = ok && s.x == step.expectX && s.y == step.expectY;
+    if (!ok && numErrors++ == 0) {
+      printf("  filter: step %d: touched %d at (%d, %d), expected %d at (%d, %d)\n",
+        i, s.touched, s.x, s.y, step.expectTouched, step.expectX, step.expectY);
+    }
+  }
+  const auto &st = sampler.stats;
+  if (st.presses != 1 || st.glitches != 2) {
+    printf("  filter: %u presses, %u glitches (expected 1, 2)\n", st.presses, st.glitches);
+    numErrors++;
+  }
+  printf("filter:      %d steps, %u presses, %u glitches\n", n, st.presses, st.glitches);
+  return numErrors;
+}
+
+int main(int argc, char **argv) {
+  int numErrors = 0;
+  numErrors += testSeqLock();
+  for (uint32_t scanUs : {4000u, 12000u, 16667u}) numErrors += testSchedule(scanUs);
+  numErrors += testFilter();
+  if (numErrors) {
+    printf("%d errors\n", numErrors);
+    return 1;
+  }
+  printf("touch sampler ok\n");
+  return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+  return shapoco::main(argc, argv);
+}
@@ -0,0 +1,312 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// ホストビルド用の LovyanGFX / LGFX_ILI9488 スタンドイン
+// LcdService が使う API だけを再現し、パネルへの転送はメモリ上で模擬する
+
+#define TOUCH_ENABLED (1)
+
+namespace lgfx {
+
+class LGFX_Sprite {
+  std::vector<uint8_t> _buff;
+  int _width = 0;
+  int _height = 0;
+  int _bpp = 16;
+  int _stride = 0;
+  uint32_t _textFg = 0;
+  uint32_t _textBg = 0;
+
+public:
+  void setColorDepth(int bpp) { _bpp = bpp; }
+
+  void *createSprite(int w, int h) {
+    _width = w;
+    _height = h;
+    _stride = (w * _bpp + 7) / 8;
+    _buff.assign(_stride * h, 0);
+    return _buff.data();
+  }
+
+  void *getBuffer() { return _buff.data(); }
+  const void *getBuffer() const { return _buff.data(); }
+  int width() const { return _width; }
+  int height() const { return _height; }
+  int getColorDepth() const { return _bpp; }
+
+  void clear(uint32_t col) { fillRect(0, 0, _width, _height, col); }
+
+  void drawPixel(int x, int y, uint32_t col) {
+    if (x < 0 || x >= _width || y < 0 || y >= _height) return;
+    if (_bpp >= 8) {
+      _buff[_stride * y + x] = col;
+      return;
+    }
+    int ppb = 8 / _bpp;
+    int shift = 8 - _bpp * (x % ppb + 1);
+    uint8_t mask = ((1 << _bpp) - 1) << shift;
+    uint8_t &b = _buff[_stride * y + x / ppb];
+    b = (b & ~mask) | ((col << shift) & mask);
+  }
+
+  uint32_t readPixelValue(int x, int y) const {
+    if (_bpp >= 8) return _buff[_stride * y + x];
+    int ppb = 8 / _bpp;
+    int shift = 8 - _bpp * (x % ppb + 1);
+    return (_buff[_stride * y + x / ppb] >> shift) & ((1 << _bpp) - 1);
+  }
+
+  void drawFastHLine(int x, int y, int w, uint32_t col) {
+    if (y < 0 || y >= _height) return;
+    if (x < 0) { w += x; x = 0; }
+    if (x + w > _width) w = _width - x;
+    if (w <= 0) return;
+    if (_bpp >= 8) {
+      memset(&_buff[_stride * y + x], col, w);
+      return;
+    }
+    int ppb = 8 / _bpp;
+    int x1 = x + w;
+    while (x < x1 && x % ppb != 0) drawPixel(x++, y, col);
+    while (x1 > x && x1 % ppb != 0) drawPixel(--x1, y, col);
+    if (x < x1) {
+      uint8_t pattern = 0;
+      for (int i = 0; i < ppb; i++) pattern = (pattern << _bpp) | (col & ((1 << _bpp) - 1));
+      memset(&_buff[_stride * y + x / ppb], pattern, (x1 - x) / ppb);
+    }
+  }
+
+  void fillRect(int x, int y, int w, int h, uint32_t col) {
+    for (int i = 0; i < h; i++) drawFastHLine(x, y + i, w, col);
+  }
+
+  // LGFXBase::fillCircle と同じ中点アルゴリズムで水平線を引く
+  void fillCircle(int x, int y, int r, uint32_t col) {
+    drawFastHLine(x - r, y, (r << 1) + 1, col);
+    if (r <= 0) return;
+    int f = 1 - r;
+    int ddF_y = -(r << 1);
+    int ddF_x = 1;
+    int i = 0;
+    int j = -1;
+    do {
+      while (f < 0) {
+        ++i;
+        f += (ddF_x += 2);
+      }
+      f += (ddF_y += 2);
+      if (i - j) {
+        drawFastHLine(x - i, y + r, (i << 1) + 1, col);
+        drawFastHLine(x - i, y - r, (i << 1) + 1, col);
+        j = i;
+      }
+      drawFastHLine(x - r, y + i, (r << 1) + 1, col);
+      drawFastHLine(x - r, y - i, (r << 1) + 1, col);
+    } while (++i < --r);
+  }
+
+  void setTextColor(uint32_t fg, uint32_t bg) {
+    _textFg = fg;
+    _textBg = bg;
+  }
+
+  // フォントは持たないので 6x8 のセルに文字コードから作った模様を描く
+  int drawString(const char *str, int x, int y, int font) {
+    int n = strlen(str);
+    fillRect(x, y, n * 6, 8, _textBg);
+    for (int ic = 0; ic < n; ic++) {
+      uint32_t bits = (uint8_t)str[ic] * 0x9e3779b1u;
+      for (int iy = 0; iy < 7; iy++) {
+        for (int ix = 0; ix < 5; ix++) {
+          if ((bits >> ((iy * 5 + ix) & 31)) & 1) {
+            drawPixel(x + ic * 6 + ix, y + iy, _textFg);
+          }
+        }
+      }
+    }
+    return n * 6;
+  }
+};
+
+}
+
+namespace shapoco {
+
+// ILI9488 の代わりに RGB565 のパネルメモリを持ち、転送量を数える
+class LGFX_ILI9488 {
+public:
+  // CASET + RASET + RAMWR (コマンド 3 + パラメータ 8)、dlen_16bit なので 2 倍
+  static constexpr int COMMAND_BYTES_PER_WINDOW = (3 + 8) * 2;
+  // XPT2046 を 1 回読むのに 1MHz で 25 バイトほどやり取りする
+  static constexpr uint64_t TOUCH_READ_NS = 200 * 1000;
+
+  struct BusStats {
+    uint64_t transactions = 0;
+    uint64_t windows = 0;
+    uint64_t commandBytes = 0;
+    uint64_t pixelBytes = 0;
+    uint64_t busyNs = 0;  // 転送時間の合計
+    uint64_t waitNs = 0;  // CPU が転送完了を待っていた時間
+    uint64_t touchReads = 0;
+    uint64_t touchNs = 0;  // タッチパネルの読み出しにバスを使った時間
+    // 表示の転送中 (startWrite() から endWrite() まで) にタッチパネルを読んだ回数
+    // 実機ではバスを共有しているので、転送を止めるか転送の完了を待つことになる
+    uint64_t touchConflicts = 0;
+  };
+
+  using clock = std::chrono::steady_clock;
+
+  const int panelWidth;
+  const int panelHeight;
+  std::vector<uint16_t> panel;
+  BusStats stats;
+  bool inTransaction = false;
+
+  // バスの時間モデル
+  // busHz: SPI のビットレート。0 なら転送は一瞬で終わる
+  // cpuScale: バスの呼び出し間にホストで経過した時間を何倍して実機の CPU 時間とみなすか
+  // 時間は仮想的に進めるので、待ちで実際に止まることはない
+  // 転送中のデータは完了時にパネルへ書き込むので、完了前に送信元を書き換えると検出できる
+  uint32_t busHz = 0;
+  double cpuScale = 1;
+  // true なら転送時間を実時間で待つ (cpuScale は使わない)。フレームの遅延を実時間で測るときに使う
+  bool realTime = false;
+
+
+  LGFX_ILI9488(int width, int height, int rotation = 0) :
+    panelWidth(width),
+    panelHeight(height),
+    panel(width * height, 0)
+  { }
+
+  bool init() { return true; }
+  void setRotation(int r) { }
+  void setColorDepth(int bpp) { }
+  int width() const { return panelWidth; }
+  int height() const { return panelHeight; }
+
+  void startWrite() {
+    if (!inTransaction) stats.transactions++;
+    inTransaction = true;
+  }
+
+  void endWrite() {
+    waitDMA();
+    inTransaction = false;
+  }
+
+  // 実機と同じく、前の転送が終わるのを待ってからウィンドウを設定して転送を始める
+  void pushImageDMA(int x, int y, int w, int h, const uint16_t *data) {
+    waitDMA();
+    int bytes = w * h * sizeof(uint16_t);
+    stats.windows++;
+    stats.commandBytes += COMMAND_BYTES_PER_WINDOW;
+    stats.pixelBytes += bytes;
+
+    pending = Transfer{x, y, w, h, data};
+    dmaActive = true;
+    busyUntilNs = virtualNow();
+    if (busHz > 0) {
+      uint64_t ns = (uint64_t)(COMMAND_BYTES_PER_WINDOW + bytes) * 8 * 1000000000ull / busHz;
+      busyUntilNs += ns;
+      stats.busyNs += ns;
+    }
+    lastCall = clock::now();
+  }
+
+  bool dmaBusy() {
+    if (dmaActive && virtualNow() >= busyUntilNs) complete();
+    lastCall = clock::now();
+    return dmaActive;
+  }
+
+  void waitDMA() {
+    if (!dmaActive) return;
+    uint64_t t = virtualNow();
+    if (t < busyUntilNs) {
+      stats.waitNs += busyUntilNs - t;
+      while (realTime && virtualNow() < busyUntilNs) std::this_thread::yield();
+      virtualNs = busyUntilNs;
+    }
+    complete();
+    lastCall = clock::now();
+  }
+
+  void *touch() { return this; }
+  void setTouchCalibrate(const uint16_t *data) { }
+
+  // パネルに触れている状態。読む側とは別のスレッドから変えてよい
+  // 実機と同じく、画面の外は端に寄せる
+  void setTouch(bool touched, int x, int y) {
+    x = x < 0 ? 0 : x >= panelWidth ? panelWidth - 1 : x;
+    y = y < 0 ? 0 : y >= panelHeight ? panelHeight - 1 : y;
+    touchState.store(touched ? (1u << 31) | ((uint32_t)(y & 0x7fff) << 16) | (x & 0x7fff) : 0, std::memory_order_release);
+  }
+
+  // 読み出しに掛かる時間は仮想時刻を進める (realTime では数えるだけ)
+  template<typename T>
+  bool getTouch(T *x, T *y) {
+    stats.touchReads++;
+    if (inTransaction || dmaBusy()) stats.touchConflicts++;
+    if (busHz > 0) {
+      virtualNow();
+      virtualNs += TOUCH_READ_NS;
+      stats.touchNs += TOUCH_READ_NS;
+    }
+    uint32_t t = touchState.load(std::memory_order_acquire);
+    bool touched = (t >> 31) != 0;
+    if (touched) {
+      *x = t & 0x7fff;
+      *y = (t >> 16) & 0x7fff;
+    }
+    return touched;
+  }
+
+private:
+  struct Transfer {
+    int x, y, w, h;
+    const uint16_t *data;
+  };
+
+  Transfer pending;
+  bool dmaActive = false;
+  std::atomic<uint32_t> touchState{0};
+  uint64_t busyUntilNs = 0;
+  uint64_t virtualNs = 0;
+  clock::time_point lastCall = clock::now();
+
+  // 前回の呼び出しからの CPU 時間を足した仮想時刻
+  uint64_t virtualNow() {
+    auto now = clock::now();
+    if (realTime) {
+      lastCall = now;
+      virtualNs = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+      return virtualNs;
+    }
+    virtualNs += (uint64_t)(std::chrono::duration_cast<std::chrono::nanoseconds>(now - lastCall).count() * cpuScale);
+    lastCall = now;
+    return virtualNs;
+  }
+
+  void complete() {
+    dmaActive = false;
+    int x = pending.x, y = pending.y, w = pending.w, h = pending.h;
+    const uint16_t *data = pending.data;
+    for (int iy = 0; iy < h; iy++) {
+      if (y + iy < 0 || y + iy >= panelHeight) continue;
+      for (int ix = 0; ix < w; ix++) {
+        if (x + ix < 0 || x + ix >= panelWidth) continue;
+        panel[(y + iy) * panelWidth + (x + ix)] = data[iy * w + ix];
+      }
+    }
+  }
+};
+
+}
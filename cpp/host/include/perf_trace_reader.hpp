@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "perf_trace.hpp"
+
+namespace shapoco {
+
+// perf_trace.hpp の PerfTrace::drain() が書き出したバイト列を読む
+// 同期バイトと checksum でパケットを探すので、テキストの出力が混ざっていてもよい
+struct PerfTraceEvent {
+  uint64_t ticks;  // 64 ビットに伸ばした時刻
+  uint8_t core;
+  uint8_t event;
+  uint8_t phase;
+};
+
+class PerfTraceReader {
+public:
+  uint32_t ticksPerUs = 0;
+  std::vector<PerfTraceEvent> events;
+  int numPackets = 0;
+  int badPackets = 0;
+  uint64_t dropped = 0;
+  // パケットの外にあったバイト数
+  size_t skippedBytes = 0;
+
+  void parse(const uint8_t *data, size_t size) {
+    size_t i = 0;
+    while (i < size) {
+      size_t n = tryPacket(data + i, size - i);
+      if (n > 0) {
+        i += n;
+        continue;
+      }
+      skippedBytes++;
+      i++;
+    }
+  }
+
+  double toUs(uint64_t ticks) const {
+    return ticksPerUs ? (double)ticks / ticksPerUs : (double)ticks;
+  }
+
+private:
+  bool started = false;
+  uint64_t lastTicks = 0;
+
+  // パケットとして読めたらその長さを、読めなければ 0 を返す
+  size_t tryPacket(const uint8_t *p, size_t size) {
+    if (size < 4 || p[0] != PERF_SYNC0 || p[1] != PERF_SYNC1) return 0;
+    size_t n = 3;
+    if (p[2] == 'H') {
+      if (size < n + 4 + 1) return 0;
+      uint32_t tpu = getU32(p, &n);
+      if (!checksumOk(p, n)) return badPacket();
+      ticksPerUs = tpu;
+      numPackets++;
+      return n + 1;
+    }
+    if (p[2] != 'E') return 0;
+    if (size < n + 8 + 1) return 0;
+    uint8_t core = p[n++];
+    int count = p[n++];
+    uint32_t drops = p[n] | (p[n + 1] << 8);
+    n += 2;
+    uint32_t base = getU32(p, &n);
+    if (core >= PerfTrace::NUM_CORES || count == 0 || count > PERF_MAX_EVENTS_PER_PACKET) return badPacket();
+
+    PerfTraceEvent evs[PERF_MAX_EVENTS_PER_PACKET];
+    // コアをまたいでも前後は書き出しの間隔より短いので、符号付きの差で伸ばす
+    uint64_t t = started ? lastTicks + (int32_t)(base - (uint32_t)lastTicks) : base;
+    for (int k = 0; k < count; k++) {
+      if (n >= size) return 0;
+      uint8_t tag = p[n++];
+      uint32_t delta = 0;
+      for (int shift = 0;; shift += 7) {
+        if (n >= size || shift > 28) return 0;
+        uint8_t b = p[n++];
+        delta |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+      }
+      t += delta;
+      evs[k] = PerfTraceEvent{t, core, (uint8_t)(tag & 0x3f), (uint8_t)(tag >> 6)};
+      if (evs[k].event >= (int)PerfEvent::NUM_EVENTS || evs[k].phase > (int)PerfPhase::INSTANT) return badPacket();
+    }
+    if (n >= size) return 0;
+    if (!checksumOk(p, n)) return badPacket();
+
+    events.insert(events.end(), evs, evs + count);
+    started = true;
+    lastTicks = t;
+    dropped += drops;
+    numPackets++;
+    return n + 1;
+  }
+
+  // 同期バイトが偶然現れただけかもしれないので、読み飛ばすのは 1 バイトだけ
+  size_t badPacket() {
+    badPackets++;
+    return 0;
+  }
+
+  static uint32_t getU32(const uint8_t *p, size_t *n) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) v |= (uint32_t)p[(*n)++] << (8 * i);
+    return v;
+  }
+
+  static bool checksumOk(const uint8_t *p, size_t n) {
+    uint8_t sum = 0;
+    for (size_t i = 2; i < n; i++) sum += p[i];
+    return sum == p[n];
+  }
+};
+
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "perf_trace_reader.hpp"
+
+// PERF_TRACE=1 のビルドが書き出した記録 (USB stdio のキャプチャか shapopad_host --perf-trace の出力) を
+// Chrome trace の JSON にする。chrome://tracing か ui.perfetto.dev で開ける
+// 区間毎の回数と時間も表示する。読めない記録や対応の取れない区間があれば終了コード 1 を返す
+
+namespace shapoco {
+
+struct EventStats {
+  uint64_t count = 0;
+  double totalUs = 0;
+  double maxUs = 0;
+};
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s trace.bin [trace.json]\n", argv[0]);
+    return 1;
+  }
+  const char *inPath = argv[1];
+  const char *outPath = argc > 2 ? argv[2] : nullptr;
+
+  FILE *fp = fopen(inPath, "rb");
+  if (!fp) {
+    fprintf(stderr, "failed to read %s\n", inPath);
+    return 1;
+  }
+  std::vector<uint8_t> buff;
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) buff.insert(buff.end(), chunk, chunk + n);
+  fclose(fp);
+
+  PerfTraceReader reader;
+  reader.parse(buff.data(), buff.size());
+  if (reader.events.empty() || reader.ticksPerUs == 0) {
+    fprintf(stderr, "%s: no perf trace events found\n", inPath);
+    return 1;
+  }
+
+  uint64_t t0 = reader.events[0].ticks;
+  for (const PerfTraceEvent &e : reader.events) {
+    if (e.ticks < t0) t0 = e.ticks;
+  }
+
+  // コア毎に開いている区間を積んで対応を取る
+  constexpr int NUM_EVENTS = (int)PerfEvent::NUM_EVENTS;
+  EventStats stats[NUM_EVENTS];
+  std::vector<const PerfTraceEvent *> open[PerfTrace::NUM_CORES];
+  int unmatched = 0;
+  int cutAtStart = 0;
+  for (const PerfTraceEvent &e : reader.events) {
+    auto &stack = open[e.core];
+    if (e.phase == (int)PerfPhase::BEGIN) {
+      stack.push_back(&e);
+    }
+    else if (e.phase == (int)PerfPhase::END) {
+      // 記録の途中から受け取ると、始まりの無い区間がある
+      if (stack.empty()) {
+        cutAtStart++;
+        continue;
+      }
+      if (stack.back()->event != e.event) {
+        unmatched++;
+        stack.pop_back();
+        continue;
+      }
+      double us = reader.toUs(e.ticks - stack.back()->ticks);
+      stack.pop_back();
+      EventStats &s = stats[e.event];
+      s.count++;
+      s.totalUs += us;
+      if (us > s.maxUs) s.maxUs = us;
+    }
+    else {
+      stats[e.event].count++;
+    }
+  }
+  int unclosed = 0;
+  for (auto &stack : open) unclosed += stack.size();
+
+  if (outPath) {
+    FILE *out = fopen(outPath, "w");
+    if (!out) {
+      fprintf(stderr, "failed to open %s\n", outPath);
+      return 1;
+    }
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (int core = 0; core < PerfTrace::NUM_CORES; core++) {
+      fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"core %d\"}},\n", core, core);
+    }
+    static constexpr char PHASES[] = {'B', 'E', 'i'};
+    for (size_t i = 0; i < reader.events.size(); i++) {
+      const PerfTraceEvent &e = reader.events[i];
+      fprintf(out, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":0,\"tid\":%d%s}%s\n",
+        PERF_EVENT_NAMES[e.event], PHASES[e.phase], reader.toUs(e.ticks - t0), e.core,
+        e.phase == (int)PerfPhase::INSTANT ? ",\"s\":\"t\"" : "",
+        i + 1 < reader.events.size() ? "," : "");
+    }
+    fprintf(out, "]}\n");
+    if (fclose(out) != 0) {
+      fprintf(stderr, "failed to write %s\n", outPath);
+      return 1;
+    }
+  }
+
+  double spanUs = 0;
+  for (const PerfTraceEvent &e : reader.events) {
+    double us = reader.toUs(e.ticks - t0);
+    if (us > spanUs) spanUs = us;
+  }
+  printf("%s: %zu events in %d packets over %.1f ms, %u ticks/us, %llu dropped, %d bad packets, %zu other bytes\n",
+    inPath, reader.events.size(), reader.numPackets, spanUs / 1e3, reader.ticksPerUs,
+    (unsigned long long)reader.dropped, reader.badPackets, reader.skippedBytes);
+  printf("%-10s %10s %12s %12s %12s\n", "event", "count", "total[ms]", "avg[us]", "max[us]");
+  for (int i = 0; i < NUM_EVENTS; i++) {
+    const EventStats &s = stats[i];
+    if (s.count == 0) continue;
+    printf("%-10s %10llu %12.3f %12.2f %12.2f\n", PERF_EVENT_NAMES[i], (unsigned long long)s.count,
+      s.totalUs / 1e3, s.totalUs / s.count, s.maxUs);
+  }
+  if (outPath) printf("wrote %s\n", outPath);
+
+  // 記録の途中から受け取った場合や、書き出し中の区間は閉じていなくてもよい
+  if (cutAtStart > 0) printf("%d spans began before the capture\n", cutAtStart);
+  if (unclosed > 0) printf("%d spans still open at the end\n", unclosed);
+  // 捨てた記録があれば対応が取れなくなる
+  if (reader.badPackets > 0 || (unmatched > 0 && reader.dropped == 0)) {
+    fprintf(stderr, "%d bad packets, %d unmatched span ends\n", reader.badPackets, unmatched);
+    return 1;
+  }
+  return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+  return shapoco::main(argc, argv);
+}
@@ -0,0 +1,972 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "lcd_service.hpp"
+#include "scanline_service.hpp"
+#include "inochi/inochi.hpp"
+#include "inochi/input_trace.hpp"
+#include "frame_hud.hpp"
+#include "frame_pacer.hpp"
+#include "perf_trace.hpp"
+#include "touch_sampler.hpp"
+
+// 実機の main.cpp と同じループをホスト上でヘッドレスに回して
+// フェーズ毎の処理時間と転送量を計測する
+// --core1 ではスキャンアウトを別スレッドで行い、コア間の受け渡しを検証する
+// --scanline ではフレームバッファを持たない ScanlineService を使う
+
+namespace shapoco {
+
+using namespace shapoco::inochi;
+
+static constexpr int SCREEN_WIDTH = 480;
+static constexpr int SCREEN_HEIGHT = 320;
+static constexpr int SCREEN_ROTATION = 3;
+static constexpr uint64_t FRAME_INTERVAL_US = 1000 * 1000 / 60;
+
+World world;
+// --pace のとき、フレームの間隔をスキャンアウトに掛かった時間から選ぶ
+FramePacer pacer(World::STEP_US);
+// --hud で表示を選び、--hud-cycle n では n フレーム毎に切り替える
+FrameHud hud;
+
+std::atomic<uint64_t> simTimeUs{0};
+
+uint64_t getTimeMs() {
+  return simTimeUs / 1000;
+}
+
+// 描画の時間配分は実際にかかった時間で行う
+uint64_t getTimeUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+VecI getScreenSize() {
+  return VecI{SCREEN_WIDTH, SCREEN_HEIGHT};
+}
+
+// --perf-trace の出力先。無ければ記録は捨てる
+FILE *perfFile = nullptr;
+uint64_t perfBytes = 0;
+
+void perfWrite(const uint8_t *data, int size) {
+  if (perfFile) fwrite(data, 1, size, perfFile);
+  perfBytes += size;
+}
+
+// main.cpp と同じく、スキャンアウトの合間に読んだタッチパネルの状態を update() に渡す
+// --touch auto はパネル (lgfx_host) に触れる操作を作り、--replay では記録した値をそのまま渡す
+TouchSampler touchSampler;
+TouchState touchState;
+
+void getTouchState(TouchState *touch) {
+  *touch = touchState;
+}
+
+// --touch auto: いのちを叩いたり何も無い所を叩いたり、引きずったりする操作を乱数で作る
+struct TouchScript {
+  Random random;
+  int waitFrames = 0;
+  int holdFrames = 0;
+  VecI pos{0, 0};
+  VecI vel{0, 0};
+
+  TouchScript(uint32_t seed) : random(seed) { }
+
+  int nextInt(int n) { return random.next() % n; }
+
+  void next(Context &ctx, TouchState *touch) {
+    if (holdFrames > 0) {
+      holdFrames--;
+      pos.x += vel.x;
+      pos.y += vel.y;
+      touch->touched = true;
+      touch->pos = pos;
+      return;
+    }
+    touch->touched = false;
+    if (waitFrames > 0) {
+      waitFrames--;
+      return;
+    }
+
+    VecR viewOrigin;
+    real viewRadius;
+    ctx.getViewPort(&viewOrigin, &viewRadius);
+    VecR target;
+    if (ctx.balls.size() > 0 && random.nextFloat() < 0.7f) {
+      target = ctx.balls.bodyPos[nextInt(ctx.balls.size())];
+    }
+    else {
+      target = VecR(VIEW_RADIUS * (random.nextFloat() - 0.5f), VIEW_RADIUS * (random.nextFloat() - 0.5f));
+    }
+    pos = (viewOrigin + target * viewRadius / VIEW_RADIUS).roundToInt();
+    bool drag = random.nextFloat() < 0.3f;
+    vel = drag ? VecI{nextInt(9) - 4, nextInt(9) - 4} : VecI{0, 0};
+    holdFrames = drag ? 20 + nextInt(40) : nextInt(3);
+    waitFrames = 2 + nextInt(20);
+    touch->touched = true;
+    touch->pos = pos;
+  }
+};
+
+struct PhaseTimer {
+  const char *name;
+  uint64_t totalNs = 0;
+  uint64_t maxFrameNs = 0;
+  uint64_t frameNs = 0;
+
+  void add(std::chrono::steady_clock::duration d) {
+    frameNs += std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+  }
+
+  void endFrame() {
+    totalNs += frameNs;
+    if (frameNs > maxFrameNs) maxFrameNs = frameNs;
+    frameNs = 0;
+  }
+
+  void print(int numFrames) const {
+    printf("%-8s %12.3f %14.2f %12.2f\n",
+      name,
+      (double)totalNs / 1e6,
+      (double)totalNs / numFrames / 1e3,
+      (double)maxFrameNs / 1e3);
+  }
+};
+
+using clock = std::chrono::steady_clock;
+
+// コア 1 の代わりのスレッド
+std::atomic<bool> scanThreadStop{false};
+// --verify のとき、コア 1 が送り終えたフレーム毎にパネルと比べた結果
+std::atomic<bool> scanVerifyFailed{false};
+
+struct Options {
+  int numFrames = 600;
+  unsigned seed = 1;
+  int numExtraBalls = 0;
+  int bpp = 2;
+  bool verify = false;
+  bool core1 = false;
+  bool fullDiff = false;
+  bool noCoalesce = false;
+  bool scanline = false;
+  const char *paintMode = "binned";
+  const char *shadow = "copy";
+  uint32_t busHz = 0;
+  double cpuScale = 1;
+  int numLineBuffs = 2;
+  uint32_t paintBudgetUs = INOCHI_PAINT_BUDGET_US;
+  int depth = LCD_PIPELINE_DEPTH;
+  bool busWait = false;
+  int fpsLimit = 0;
+  bool pace = false;
+  bool autoTouch = false;
+  bool priorityScan = LCD_PRIORITY_SCAN;
+  const char *recordPath = nullptr;
+  const char *replayPath = nullptr;
+  const char *perfTracePath = nullptr;
+  HudMode hudMode = (HudMode)HUD_DEFAULT_MODE;
+  int hudCycleFrames = 0;
+};
+
+// 出力方式毎の設定と統計の表示
+
+template<typename PALETTE, int W, int H, int D>
+void configureOutput(LcdService<PALETTE, W, H, D> &screen, const Options &opt) {
+  screen.hashShadow = strcmp(opt.shadow, "hash") == 0;
+#if LCD_RETAINED
+  using Screen = LcdService<PALETTE, W, H, D>;
+  if (strcmp(opt.paintMode, "immediate") == 0) screen.paintMode = Screen::PaintMode::IMMEDIATE;
+  else if (strcmp(opt.paintMode, "damage") == 0) screen.paintMode = Screen::PaintMode::DAMAGE;
+  else screen.paintMode = Screen::PaintMode::BINNED;
+#endif
+}
+
+template<typename PALETTE, int W, int H, int D>
+void configureOutput(ScanlineService<PALETTE, W, H, D> &screen, const Options &opt) { }
+
+// 描いた円が全てバックバッファに入っているか (入っていなければ全体を描いた結果と比べられない)
+template<typename PALETTE, int W, int H, int D>
+bool backFrameComplete(LcdService<PALETTE, W, H, D> &screen) { return true; }
+
+template<typename PALETTE, int W, int H, int D>
+bool backFrameComplete(ScanlineService<PALETTE, W, H, D> &screen) {
+  return screen.slots[screen.drawIndex].dropped == 0;
+}
+
+template<typename PALETTE, int W, int H, int D>
+void printOutputStats(LcdService<PALETTE, W, H, D> &screen) {
+  using Screen = LcdService<PALETTE, W, H, D>;
+  const auto &scan = screen.scanStats;
+  printf("diff: %s, %s shadow, dirty %.1f rows / %.1f bytes per frame, compared %.1f bytes/frame, skipped %.1f%%\n",
+    screen.dirtyTracking ? "dirty rows" : "full",
+    screen.hashShadow ? "hashed" : "copied",
+    (double)scan.dirtyRows / scan.frames,
+    (double)scan.dirtyBytes / scan.frames,
+    (double)scan.bytesCompared / scan.frames,
+    100.0 * scan.bytesSkipped / (scan.bytesCompared + scan.bytesSkipped));
+#if LCD_RETAINED
+  const auto &ret = screen.retained.stats;
+  const auto &bin = screen.binner.stats;
+  if (screen.paintMode == Screen::PaintMode::DAMAGE) {
+    // 背景色で塗り直したバイト数 (全体を消すなら毎フレーム stride * height)
+    constexpr int tileBytes = Screen::Retained::TILE_SIZE * Screen::Retained::TILE_SIZE * Screen::BPP / 8;
+    double n = ret.frames ? ret.frames : 1;
+    printf("paint: damage, %.1f items/frame, %.1f changed, %.1f tiles redrawn (of %d), cleared %.0f bytes/frame, "
+      "%.1f + %.1f clipped draws/frame, %llu full redraws, %llu overflows\n",
+      ret.items / n, ret.changedItems / n, ret.damagedTiles / n,
+      Screen::Retained::TILES_X * Screen::Retained::TILES_Y,
+      (ret.damagedTiles * tileBytes + ret.fullRedraws * Screen::stride * H) / n,
+      ret.fullDraws / n, ret.clippedDraws / n,
+      (unsigned long long)ret.fullRedraws,
+      (unsigned long long)ret.overflows);
+  }
+  else if (screen.paintMode == Screen::PaintMode::BINNED) {
+    constexpr int tileBytes = Screen::Binner::TILE_SIZE * Screen::Binner::TILE_SIZE * Screen::BPP / 8;
+    double n = bin.frames ? bin.frames : 1;
+    printf("paint: binned, %.1f refs/frame, %.1f tiles drawn, %.1f skipped, %.1f changed for scan-out (of %d), "
+      "cleared %.0f bytes/frame, %llu list overflows, %llu bin overflows\n",
+      bin.refs / n, bin.tilesDrawn / n, bin.tilesSkipped / n, bin.tilesChanged / n, Screen::Binner::NUM_TILES,
+      bin.tilesDrawn * tileBytes / n,
+      (unsigned long long)ret.overflows,
+      (unsigned long long)bin.refOverflows);
+  }
+  else {
+    printf("paint: immediate, cleared %d bytes/frame\n", Screen::stride * H);
+  }
+#endif
+#if LCD_NATIVE_RASTER && LCD_STAMP_CACHE
+  const auto &stamp = screen.stampCache.stats;
+  printf("stamps: hit %.1f%%, %llu builds, %llu evictions, %llu bypassed, %d bytes used (peak %d of %d)\n",
+    stamp.lookups ? 100.0 * stamp.hits / stamp.lookups : 0.0,
+    (unsigned long long)stamp.builds,
+    (unsigned long long)stamp.evictions,
+    (unsigned long long)stamp.bypasses,
+    stamp.bytesUsed, stamp.peakBytesUsed, Screen::STAMP_CACHE_BYTES);
+#endif
+}
+
+template<typename PALETTE, int W, int H, int D>
+void printOutputStats(ScanlineService<PALETTE, W, H, D> &screen) {
+  const auto &scan = screen.scanStats;
+  const auto &hw = screen.halfWidths.stats;
+  double n = scan.frames ? scan.frames : 1;
+  printf("scanline: %.1f lines changed/frame (of %d), %.1f active circles/line, sent %.1f packed bytes/frame, "
+    "%llu dropped circles, %llu half-width builds (%llu flushes)\n",
+    scan.linesChanged / n, H,
+    scan.linesRendered ? (double)scan.activeItems / scan.linesRendered : 0.0,
+    scan.bytesSent / n,
+    (unsigned long long)scan.droppedItems,
+    (unsigned long long)hw.builds,
+    (unsigned long long)hw.flushes);
+}
+
+// 出力方式と色深度毎に特殊化して同じループを回す
+template<typename SCREEN>
+struct HostApp {
+  using Screen = SCREEN;
+  using PALETTE = typename Screen::PaletteType;
+  static Screen *screenPtr;
+  // --verify のとき、毎フレーム全体を描いた結果 (バックバッファと比べる)
+  static LGFX_Sprite *refPtr;
+  static bool painted;
+  static int numUnverifiedFrames;
+
+  static constexpr uint8_t PALETTE_INDEX[] = {
+    PALETTE::BLACK, PALETTE::RED, PALETTE::BLUE, PALETTE::WHITE,
+  };
+
+  static void clearScreen() {
+    screenPtr->clearBackBuffer(PALETTE_INDEX[Palette::WHITE]);
+    if (refPtr) refPtr->clear(PALETTE_INDEX[Palette::WHITE]);
+    painted = true;
+  }
+
+  static void drawCircle(VecI pos, int r, Palette col) {
+    screenPtr->fillCircle(pos.x, pos.y, r, PALETTE_INDEX[col]);
+    if (refPtr) refPtr->fillCircle(pos.x, pos.y, r, PALETTE_INDEX[col]);
+  }
+
+  // 描き終えたフレームを確定し、全体を描き直した場合と同じになっているか調べる
+  static bool commitAndVerify(PhaseTimer &tCommit) {
+    Screen &screen = *screenPtr;
+    auto t0 = clock::now();
+    screen.commitFrame();
+    tCommit.add(clock::now() - t0);
+    if (!refPtr || !painted) return true;
+    painted = false;
+    if (!backFrameComplete(screen)) {
+      numUnverifiedFrames++;
+      return true;
+    }
+    uint8_t line[Screen::stride];
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+      screen.readBackLine(y, line);
+      const uint8_t *ref = (const uint8_t*)refPtr->getBuffer() + Screen::stride * y;
+      for (int i = 0; i < Screen::stride; i++) {
+        if (line[i] != ref[i]) {
+          fprintf(stderr, "back buffer mismatch at (%d, %d)\n", i * Screen::PIXELS_PER_BYTE, y);
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // スキャンが終わった時点でパネルの内容がフロントバッファと一致しているか調べる
+  static bool verifyPanel() {
+    Screen &screen = *screenPtr;
+    uint8_t line[Screen::stride];
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+      screen.readFrontLine(y, line);
+      for (int x = 0; x < SCREEN_WIDTH; x++) {
+        int shift = 8 - Screen::BPP * (x % Screen::PIXELS_PER_BYTE + 1);
+        uint16_t expected = PALETTE::RGB565[(line[x / Screen::PIXELS_PER_BYTE] >> shift) & ((1 << Screen::BPP) - 1)];
+        if (screen.lcd.panel[y * SCREEN_WIDTH + x] != expected) {
+          fprintf(stderr, "panel mismatch at (%d, %d)\n", x, y);
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // scanDone[k]: k 番目に渡したフレームを送り終えた時刻
+  static void scanThreadMain(PhaseTimer *tScan, std::vector<clock::time_point> *scanDone, bool verify) {
+    Screen &screen = *screenPtr;
+#if PERF_TRACE
+    perfHostCore = 1;
+#endif
+    while (!scanThreadStop.load(std::memory_order_acquire)) {
+      auto t0 = clock::now();
+      bool busy = screen.serviceScanOut(getTimeMs());
+      noteFocusSent();
+      pollTouch();
+      if (!busy) {
+        std::this_thread::yield();
+        continue;
+      }
+      auto t1 = clock::now();
+      tScan->add(t1 - t0);
+      if (screen.idle()) {
+        pacer.noteScanTime(tScan->frameNs / 1000);
+        hud.noteScanTime(tScan->frameNs / 1000);
+        tScan->endFrame();
+        uint32_t k = screen.pipeline.numScannedFrames.load(std::memory_order_relaxed) - 1;
+        if (k < scanDone->size()) (*scanDone)[k] = t1;
+        // 送り終えたバッファは次のフレームを受け取るまでコア 1 が持っている
+        if (verify && !verifyPanel()) {
+          fprintf(stderr, "scanned frame %u: panel does not match the front buffer\n", k);
+          scanVerifyFailed.store(true, std::memory_order_release);
+        }
+      }
+    }
+  }
+
+  // 渡したフレームの、update() を始めてから送り終えるまでの時間とフレームレート
+  static void printPipelineStats(Screen &screen, const std::vector<clock::time_point> &frameStart,
+      const std::vector<clock::time_point> &scanDone, int n) {
+    const auto &st = screen.pipeline.stats;
+    printf("pipeline: depth %d, %llu stalls, queued %.2f avg / %d max",
+      Screen::PIPELINE_DEPTH, (unsigned long long)st.stalls,
+      st.submitted ? (double)st.queuedTotal / st.submitted : 0.0, st.maxQueued);
+    if (n < 2) {
+      printf("\n");
+      return;
+    }
+    // 最初のフレームは update() を経ていないので除く
+    double sumUs = 0, maxUs = 0;
+    for (int k = 1; k < n; k++) {
+      double us = std::chrono::duration<double, std::micro>(scanDone[k] - frameStart[k]).count();
+      sumUs += us;
+      if (us > maxUs) maxUs = us;
+    }
+    double spanUs = std::chrono::duration<double, std::micro>(scanDone[n - 1] - scanDone[0]).count();
+    printf(", latency %.2f ms avg / %.2f ms max, throughput %.1f fps\n",
+      sumUs / (n - 1) / 1000, maxUs / 1000, spanUs > 0 ? (n - 1) * 1e6 / spanUs : 0.0);
+  }
+
+  // 時刻はフレーム毎に進める simTimeUs で見るので、読むのは 1 フレームに 1 回まで
+  // --bus-wait では転送を実時間で待つので、読む間隔も実時間で決める
+  static bool touchRealTime;
+  static uint64_t touchNowUs() {
+    return touchRealTime ? getTimeUs() : simTimeUs.load();
+  }
+
+  static void pollTouch() {
+    Screen &screen = *screenPtr;
+    touchSampler.poll(touchNowUs(), screen.busFree(), screen.idle(), [&](int16_t *x, int16_t *y) {
+      return screen.lcd.getTouch(x, y);
+    });
+  }
+
+  static void latchTouch() {
+    TouchSample s = touchSampler.latest();
+    touchState.touched = s.touched;
+    touchState.pos = VecI{s.x, s.y};
+    touchState.timeUs = s.timeUs;
+  }
+
+  // main.cpp と同じく、ドラッグしているいのちの周りを先に送らせ、送り終えるまでの時間を測る
+  // focusLatencyUs はスキャンする側だけが書く
+  static std::vector<uint32_t> focusLatencyUs;
+  static void setScanFocus() {
+    VecI pos;
+    int r;
+    if (world.getDragFocus(&pos, &r)) screenPtr->setFocus(pos.y - r, pos.y + r + 1, touchState.timeUs);
+  }
+
+  static void noteFocusSent() {
+    uint64_t touchUs;
+    if (!screenPtr->takeFocusSent(&touchUs) || touchUs == 0) return;
+    uint64_t nowUs = touchNowUs();
+    uint32_t us = nowUs > touchUs ? nowUs - touchUs : 0;
+    focusLatencyUs.push_back(us);
+    hud.noteTouchLatency(us);
+  }
+
+  static void printFocusLatency(const Options &opt) {
+    std::vector<uint32_t> v = focusLatencyUs;
+    if (v.empty()) return;
+    printf("drag latency: priority scan %s, %zu frames", opt.priorityScan ? "on" : "off", v.size());
+    std::sort(v.begin(), v.end());
+    double sum = 0;
+    for (uint32_t us : v) sum += us;
+    printf(", touch to panel %.2f ms avg / %.2f ms p95 / %.2f ms max (%s clock)\n",
+      sum / v.size() / 1e3, v[(v.size() - 1) * 95 / 100] / 1e3, v.back() / 1e3,
+      touchRealTime ? "real" : "frame");
+  }
+
+  // いのちの大きさと中心からの距離の最大 (物理演算が発散していないかを見る)
+  static void worldExtent(float *maxSize, float *maxDist) {
+    const BallStore &b = world.ctx.balls;
+    for (int i = 0; i < b.size(); i++) {
+      float size = fabsf((float)b.bodySize[i]);
+      float dist = (float)b.bodyPos[i].abs();
+      if (size > *maxSize) *maxSize = size;
+      if (dist > *maxDist) *maxDist = dist;
+    }
+  }
+
+  // 実機では USB へ流す代わりに、フレーム毎にファイルへ書き出す
+  static uint64_t perfEvents;
+  static void drainPerfTrace() {
+#if PERF_TRACE
+    PERF_SCOPE(DRAIN);
+    perfEvents += perfTrace.drain(perfWrite);
+#endif
+  }
+
+  static void waitForBackBuffer(PhaseTimer &tStall) {
+    Screen &screen = *screenPtr;
+    auto t0 = clock::now();
+    while (!screen.acquireBackBuffer()) {
+      std::this_thread::yield();
+    }
+    tStall.add(clock::now() - t0);
+  }
+
+  static int run(const Options &opt) {
+    std::unique_ptr<Screen> screenOwner(new Screen(SCREEN_ROTATION));
+    screenPtr = screenOwner.get();
+    Screen &screen = *screenPtr;
+    int numFrames = opt.numFrames;
+    unsigned seed = opt.seed;
+    int numExtraBalls = opt.numExtraBalls;
+    // --replay では記録したときの条件で始め、記録した入力を HostAPI から返す
+    InputTrace trace;
+    bool replay = opt.replayPath != nullptr;
+    if (replay) {
+      if (!trace.load(opt.replayPath)) {
+        fprintf(stderr, "failed to read trace %s\n", opt.replayPath);
+        return 1;
+      }
+      numFrames = trace.frames.size();
+      seed = trace.seed;
+      numExtraBalls = trace.extraBalls;
+    }
+    else {
+      trace.seed = seed;
+      trace.extraBalls = numExtraBalls;
+    }
+    TouchScript touchScript(seed + 1);
+    TouchState panelTouch;
+    touchState = TouchState();
+    bool verify = opt.verify;
+    bool core1 = opt.core1;
+    screen.dirtyTracking = !opt.fullDiff;
+    screen.coalesceRects = !opt.noCoalesce;
+    screen.lcd.busHz = opt.busHz;
+    screen.lcd.cpuScale = opt.cpuScale;
+    screen.lcd.realTime = opt.busWait;
+    touchRealTime = opt.busWait;
+    screen.priorityScan = opt.priorityScan;
+    screen.numLineBuffs = opt.numLineBuffs;
+    configureOutput(screen, opt);
+    std::unique_ptr<LGFX_Sprite> ref;
+    if (verify) {
+      ref.reset(new LGFX_Sprite());
+      ref->setColorDepth(Screen::BPP);
+      ref->createSprite(SCREEN_WIDTH, SCREEN_HEIGHT);
+    }
+    refPtr = ref.get();
+    painted = false;
+#if PERF_TRACE
+    if (opt.perfTracePath) {
+      perfFile = fopen(opt.perfTracePath, "wb");
+      if (!perfFile) {
+        fprintf(stderr, "failed to open %s\n", opt.perfTracePath);
+        return 1;
+      }
+    }
+#endif
+
+    screen.init(getTimeMs());
+
+    HostAPI intf;
+    intf.getTimeMs = getTimeMs;
+    intf.getTimeUs = getTimeUs;
+    intf.getScreenSize = getScreenSize;
+    intf.clearScreen = clearScreen;
+    intf.drawCircle = drawCircle;
+    intf.getTouchState = getTouchState;
+    world.init(intf, seed);
+
+    for (int i = 0; i < numExtraBalls; i++) {
+      VecR pos(VIEW_RADIUS * (world.ctx.randR() - 0.5), VIEW_RADIUS * (world.ctx.randR() - 0.5));
+      Ball::spawn(world.ctx, pos);
+    }
+
+    PhaseTimer tUpdate{"update"};
+    PhaseTimer tPaint{"paint"};
+    PhaseTimer tCommit{"commit"};
+    PhaseTimer tScan{"scan"};
+    PhaseTimer tStall{"stall"};
+    PhaseTimer tHud{"hud"};
+    uint64_t numPaintCalls = 0;
+    hud.setMode(opt.hudMode);
+    clock::time_point lastFrameAt;
+    // 描き終えたフレームの時間を HUD に渡す
+    auto noteHudFrame = [&](int iFrame) {
+      auto now = clock::now();
+      uint32_t frameUs = iFrame > 0 ? std::chrono::duration_cast<std::chrono::microseconds>(now - lastFrameAt).count() : 0;
+      lastFrameAt = now;
+      // 記録した円は commitFrame() で描くので描画の時間に含める
+      hud.noteFrame(frameUs, tUpdate.frameNs / 1000, (tPaint.frameNs + tCommit.frameNs) / 1000);
+      if (opt.hudCycleFrames > 0 && (iFrame + 1) % opt.hudCycleFrames == 0) hud.cycleMode();
+    };
+    auto paintHud = [&]() {
+      auto t0 = clock::now();
+      screen.paintHud(hud);
+      tHud.add(clock::now() - t0);
+    };
+
+    // k 番目のループで update() したフレームを k 番目に渡す
+    std::vector<clock::time_point> frameStart(numFrames), scanDone(numFrames);
+    clock::time_point nextFrameAt = clock::now();
+
+    std::thread scanThread;
+    if (core1) {
+      scanThread = std::thread(scanThreadMain, &tScan, &scanDone, verify);
+    }
+
+    for (int iFrame = 0; iFrame < numFrames; iFrame++) {
+      // 物理演算は進めた時間の分だけ固定ステップを回す
+      uint64_t intervalUs = opt.pace ? pacer.nextInterval() : FRAME_INTERVAL_US;
+      if (replay) {
+        const TraceFrame &f = trace.frames[iFrame];
+        simTimeUs = f.timeMs * 1000;
+      }
+      else {
+        simTimeUs += intervalUs;
+        if (opt.autoTouch) touchScript.next(world.ctx, &panelTouch);
+        screen.lcd.setTouch(panelTouch.touched, panelTouch.pos.x, panelTouch.pos.y);
+      }
+      uint64_t nowMs = getTimeMs();
+      // --core1 ではスキャンアウトのスレッドが読む。ここでは前のフレームを送り終えていてバスが空いている
+      if (!core1) pollTouch();
+      // update() が受け取る値を記録する
+      if (replay) {
+        touchState = trace.frames[iFrame].touch;
+      }
+      else {
+        latchTouch();
+        trace.add(getTimeMs(), touchState);
+      }
+
+      if (core1) {
+        // main.cpp の SCAN_ON_CORE1 と同じ流れ
+        // update() はバッファ無しで進め、描き終えたらすぐに送る順番に並べる
+        if (opt.fpsLimit > 0) {
+          std::this_thread::sleep_until(nextFrameAt);
+          nextFrameAt += std::chrono::microseconds(opt.pace ? intervalUs : 1000000 / opt.fpsLimit);
+        }
+        auto t0 = clock::now();
+        frameStart[iFrame] = t0;
+        PERF_BEGIN(UPDATE);
+        world.update();
+        PERF_END(UPDATE);
+        tUpdate.add(clock::now() - t0);
+
+        while (!world.idle()) {
+          waitForBackBuffer(tStall);
+          auto t1 = clock::now();
+          PERF_BEGIN(PAINT);
+          world.servicePaint(opt.paintBudgetUs);
+          PERF_END(PAINT);
+          tPaint.add(clock::now() - t1);
+          numPaintCalls++;
+        }
+        waitForBackBuffer(tStall);
+        bool ok = commitAndVerify(tCommit);
+        noteHudFrame(iFrame);
+        paintHud();
+        setScanFocus();
+        screen.submitBackBuffer();
+        if (!ok) {
+          fprintf(stderr, "frame %d: back buffer differs from a full redraw\n", iFrame);
+          scanThreadStop.store(true, std::memory_order_release);
+          scanThread.join();
+          return 1;
+        }
+
+        if (scanVerifyFailed.load(std::memory_order_acquire)) {
+          scanThreadStop.store(true, std::memory_order_release);
+          scanThread.join();
+          return 1;
+        }
+
+        drainPerfTrace();
+        tUpdate.endFrame();
+        tPaint.endFrame();
+        tCommit.endFrame();
+        tStall.endFrame();
+        tHud.endFrame();
+        continue;
+      }
+
+      paintHud();
+      setScanFocus();
+      screen.flip();
+
+      auto t0 = clock::now();
+      PERF_BEGIN(UPDATE);
+      world.update();
+      PERF_END(UPDATE);
+      tUpdate.add(clock::now() - t0);
+
+      while (!world.idle() || !screen.idle()) {
+        auto t1 = clock::now();
+        screen.serviceStart(nowMs);
+        auto t2 = clock::now();
+        if (!world.idle()) {
+          PERF_BEGIN(PAINT);
+          world.servicePaint(opt.paintBudgetUs);
+          PERF_END(PAINT);
+        }
+        numPaintCalls++;
+        auto t3 = clock::now();
+        screen.serviceEnd(nowMs);
+        auto t4 = clock::now();
+        tScan.add((t2 - t1) + (t4 - t3));
+        tPaint.add(t3 - t2);
+        noteFocusSent();
+        pollTouch();
+      }
+      if (!commitAndVerify(tCommit)) {
+        fprintf(stderr, "frame %d: back buffer differs from a full redraw\n", iFrame);
+        return 1;
+      }
+
+      if (verify && !verifyPanel()) {
+        fprintf(stderr, "frame %d: panel does not match the front buffer\n", iFrame);
+        return 1;
+      }
+
+      // 同じスレッドでは描画の合間に送るので、描画も含めた時間で間隔を選ぶ
+      pacer.noteScanTime((tScan.frameNs + tPaint.frameNs) / 1000);
+      hud.noteScanTime(tScan.frameNs / 1000);
+      noteHudFrame(iFrame);
+      drainPerfTrace();
+      tUpdate.endFrame();
+      tPaint.endFrame();
+      tCommit.endFrame();
+      tScan.endFrame();
+      tHud.endFrame();
+    }
+
+    if (core1) {
+      while (!screen.scanOutDrained()) std::this_thread::yield();
+      scanThreadStop.store(true, std::memory_order_release);
+      scanThread.join();
+      if (scanVerifyFailed.load(std::memory_order_acquire)) return 1;
+      if (verify && !verifyPanel()) {
+        fprintf(stderr, "panel does not match the front buffer after drain\n");
+        return 1;
+      }
+    }
+#if PERF_TRACE
+    drainPerfTrace();
+    if (perfFile && fclose(perfFile) != 0) {
+      fprintf(stderr, "failed to write %s\n", opt.perfTracePath);
+      return 1;
+    }
+    perfFile = nullptr;
+#endif
+
+    // 同じ入力からは同じ状態になるはず (ビルドが違えば変わりうる)
+    uint32_t stateHash = hashWorldState(world.ctx);
+    if (opt.recordPath) {
+      trace.stateHash = stateHash;
+      if (!trace.save(opt.recordPath)) {
+        fprintf(stderr, "failed to write trace %s\n", opt.recordPath);
+        return 1;
+      }
+    }
+    bool stateMismatch = replay && trace.stateHash != 0 && trace.stateHash != stateHash;
+
+    const auto &bus = screen.lcd.stats;
+    printf("frames: %d, seed: %u, balls: %d, bpp: %d, output: %s, scan-out: %s\n",
+      numFrames, seed, (int)world.ctx.balls.size(), Screen::BPP,
+      opt.scanline ? "scanline" : "frame buffers", core1 ? "core 1" : "interleaved");
+    printf("%-8s %12s %14s %12s\n", "phase", "total[ms]", "avg[us/frame]", "max[us]");
+    tUpdate.print(numFrames);
+    tPaint.print(numFrames);
+    tCommit.print(numFrames);
+    tScan.print(numFrames);
+    if (core1) tStall.print(numFrames);
+    tHud.print(numFrames);
+    printf("paint budget: %u us, %.1f calls/frame\n", opt.paintBudgetUs, (double)numPaintCalls / numFrames);
+    printPipelineStats(screen, frameStart, scanDone, core1 ? numFrames : 0);
+    const auto &step = world.stepStats;
+    printf("physics: fixed step %lld us, %.2f steps/frame, max %d, dropped %.1f ms\n",
+      (long long)World::STEP_US, (double)step.steps / step.updates, step.maxSteps, step.droppedUs / 1e3);
+    float maxSize = 0, maxDist = 0;
+    worldExtent(&maxSize, &maxDist);
+    printf("world: %d balls, size up to %.2f, up to %.2f from the center\n", world.ctx.balls.size(), maxSize, maxDist);
+    if (opt.pace) {
+      const auto &ps = pacer.stats;
+      printf("pacing: scan %.2f ms avg, frames at", pacer.avgScanUs / 1e3);
+      for (int d = 1; d <= FramePacer::MAX_DIVIDER; d++) {
+        printf("%s %.0f Hz: %llu", d > 1 ? "," : "", 1e6 / (pacer.baseIntervalUs * d), (unsigned long long)ps.frames[d]);
+      }
+      printf(", %u changes\n", ps.changes);
+    }
+    printf("sent: %llu pixel bytes, %llu command bytes, %llu windows (%.1f bytes/frame)\n",
+      (unsigned long long)bus.pixelBytes,
+      (unsigned long long)bus.commandBytes,
+      (unsigned long long)bus.windows,
+      (double)(bus.pixelBytes + bus.commandBytes) / numFrames);
+    if (screen.lcd.busHz > 0) {
+      printf("bus: %.1f MHz, cpu x%.1f, %d line buffers, busy %.3f ms, cpu waited %.3f ms (%.1f%% of busy time overlapped)\n",
+        screen.lcd.busHz / 1e6, screen.lcd.cpuScale, screen.numLineBuffs,
+        bus.busyNs / 1e6, bus.waitNs / 1e6,
+        bus.busyNs ? 100.0 * (1.0 - (double)bus.waitNs / bus.busyNs) : 0.0);
+    }
+    const auto &scan = screen.scanStats;
+    printf("windows: %s, %.1f windows/frame, command %.1f bytes/frame, payload %.1f bytes/frame (command %.1f%%)\n",
+      screen.coalesceRects ? "coalesced" : "per span",
+      (double)scan.windows / scan.frames,
+      (double)scan.commandBytes / scan.frames,
+      (double)scan.pixelBytes / scan.frames,
+      100.0 * scan.commandBytes / (scan.commandBytes + scan.pixelBytes));
+    printOutputStats(screen);
+    printf("memory: %d bytes of frame state\n", screen.frameMemoryBytes());
+    printf("hud:");
+    if (!hud.enabled()) printf(" off");
+    for (int i = 0; hud.enabled() && i < hud.text.numLines; i++) printf("%s %s", i ? " |" : "", hud.text.lines[i]);
+    printf("\n");
+    const auto &ts = touchSampler.stats;
+    printf("touch: %u samples (%.2f/frame, %.1f ms of bus time), %u between lines, %u waited for a frame gap "
+      "(max %.2f ms late), %u presses, %u glitches filtered, %llu reads during a transfer\n",
+      ts.samples, (double)ts.samples / numFrames, bus.touchNs / 1e6, ts.midScanSamples, ts.deferredSamples,
+      ts.maxLateUs / 1e3, ts.presses, ts.glitches, (unsigned long long)bus.touchConflicts);
+    printFocusLatency(opt);
+    if (opt.recordPath || replay) {
+      std::vector<uint8_t> encoded;
+      trace.encode(encoded);
+      printf("trace: %s %s, %d frames, %zu bytes, state 0x%08x%s\n",
+        replay ? "replayed" : "recorded", replay ? opt.replayPath : opt.recordPath,
+        (int)trace.frames.size(), encoded.size(), stateHash,
+        !replay ? "" : stateMismatch ? " (differs from recording)" : " (matches recording)");
+    }
+#if PERF_TRACE
+    uint32_t perfDropped = perfTrace.rings[0].dropped + perfTrace.rings[1].dropped;
+    printf("perf trace: %llu events, %u dropped, %llu bytes (%.2f bytes/event)%s%s\n",
+      (unsigned long long)perfEvents, perfDropped, (unsigned long long)perfBytes,
+      perfEvents ? (double)perfBytes / perfEvents : 0.0,
+      opt.perfTracePath ? " -> " : "", opt.perfTracePath ? opt.perfTracePath : "");
+#endif
+    // タッチパネルは転送の合間にだけ読むはず
+    if (bus.touchConflicts > 0 || ts.busyRefusals > 0) {
+      fprintf(stderr, "touch panel polled while the display bus was busy\n");
+      return 1;
+    }
+    // 大きさの目標は 1.5 まで、いのちが生まれるのは中心から 2 * VIEW_RADIUS まで
+    if (maxSize > 3 || maxDist > 3 * (float)VIEW_RADIUS) {
+      fprintf(stderr, "physics diverged\n");
+      return 1;
+    }
+    if (stateMismatch && verify) {
+      fprintf(stderr, "replayed state differs from the recording\n");
+      return 1;
+    }
+    if (numUnverifiedFrames > 0) {
+      printf("verify: %d frames not compared with a full redraw (circles dropped)\n", numUnverifiedFrames);
+    }
+    return 0;
+  }
+};
+
+template<typename SCREEN>
+SCREEN *HostApp<SCREEN>::screenPtr = nullptr;
+template<typename SCREEN>
+LGFX_Sprite *HostApp<SCREEN>::refPtr = nullptr;
+template<typename SCREEN>
+bool HostApp<SCREEN>::painted = false;
+template<typename SCREEN>
+int HostApp<SCREEN>::numUnverifiedFrames = 0;
+template<typename SCREEN>
+uint64_t HostApp<SCREEN>::perfEvents = 0;
+template<typename SCREEN>
+bool HostApp<SCREEN>::touchRealTime = false;
+template<typename SCREEN>
+std::vector<uint32_t> HostApp<SCREEN>::focusLatencyUs;
+
+template<typename PALETTE, int DEPTH>
+int runWith(const Options &opt) {
+  if (opt.scanline) return HostApp<ScanlineService<PALETTE, SCREEN_WIDTH, SCREEN_HEIGHT, DEPTH>>::run(opt);
+  return HostApp<LcdService<PALETTE, SCREEN_WIDTH, SCREEN_HEIGHT, DEPTH>>::run(opt);
+}
+
+template<typename PALETTE>
+int runWith(const Options &opt) {
+  switch (opt.depth) {
+  case 2: return runWith<PALETTE, 2>(opt);
+  case 3: return runWith<PALETTE, 3>(opt);
+  default:
+    fprintf(stderr, "unsupported pipeline depth: %d\n", opt.depth);
+    return 1;
+  }
+}
+
+int main(int argc, char **argv) {
+  Options opt;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      opt.numFrames = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      opt.seed = strtoul(argv[++i], nullptr, 0);
+    }
+    else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      opt.numExtraBalls = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--bpp") == 0 && i + 1 < argc) {
+      opt.bpp = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--full-diff") == 0) {
+      opt.fullDiff = true;
+    }
+    else if (strcmp(argv[i], "--verify") == 0) {
+      opt.verify = true;
+    }
+    else if (strcmp(argv[i], "--no-coalesce") == 0) {
+      opt.noCoalesce = true;
+    }
+    else if (strcmp(argv[i], "--paint") == 0 && i + 1 < argc) {
+      opt.paintMode = argv[++i];
+    }
+    else if (strcmp(argv[i], "--shadow") == 0 && i + 1 < argc) {
+      opt.shadow = argv[++i];
+    }
+    else if (strcmp(argv[i], "--scanline") == 0) {
+      opt.scanline = true;
+    }
+    else if (strcmp(argv[i], "--core1") == 0) {
+      opt.core1 = true;
+    }
+    else if (strcmp(argv[i], "--bus-mhz") == 0 && i + 1 < argc) {
+      opt.busHz = (uint32_t)(atof(argv[++i]) * 1e6);
+    }
+    else if (strcmp(argv[i], "--cpu-scale") == 0 && i + 1 < argc) {
+      opt.cpuScale = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+      opt.depth = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--bus-wait") == 0) {
+      opt.busWait = true;
+    }
+    else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+      opt.fpsLimit = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--touch") == 0 && i + 1 < argc) {
+      opt.autoTouch = strcmp(argv[++i], "auto") == 0;
+    }
+    else if (strcmp(argv[i], "--no-priority") == 0) {
+      opt.priorityScan = false;
+    }
+    else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      opt.recordPath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      opt.replayPath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--perf-trace") == 0 && i + 1 < argc) {
+      opt.perfTracePath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--hud") == 0 && i + 1 < argc) {
+      const char *m = argv[++i];
+      opt.hudMode = strcmp(m, "off") == 0 ? HudMode::OFF : strcmp(m, "full") == 0 ? HudMode::FULL : HudMode::FPS;
+    }
+    else if (strcmp(argv[i], "--hud-cycle") == 0 && i + 1 < argc) {
+      opt.hudCycleFrames = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--pace") == 0) {
+      opt.pace = true;
+    }
+    else if (strcmp(argv[i], "--paint-budget") == 0 && i + 1 < argc) {
+      opt.paintBudgetUs = strtoul(argv[++i], nullptr, 0);
+    }
+    else if (strcmp(argv[i], "--line-buffs") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      int maxBuffs = LcdService<Palette2bpp, SCREEN_WIDTH, SCREEN_HEIGHT>::MAX_LINE_BUFFS;
+      opt.numLineBuffs = n < 1 ? 1 : n > maxBuffs ? maxBuffs : n;
+    }
+    else {
+      fprintf(stderr, "usage: %s [-n frames] [-s seed] [-b extra_balls] [--bpp 1|2|4|8] [--full-diff] [--no-coalesce]"
+        " [--paint immediate|damage|binned] [--shadow copy|hash] [--scanline] [--verify] [--core1] [--bus-mhz mhz] [--cpu-scale x] [--line-buffs n] [--paint-budget us]"
+        " [--depth 2|3] [--bus-wait] [--fps n] [--pace] [--touch none|auto] [--no-priority] [--record file] [--replay file] [--perf-trace file]"
+        " [--hud off|fps|full] [--hud-cycle n]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  switch (opt.bpp) {
+  case 1: return runWith<Palette1bpp>(opt);
+  case 2: return runWith<Palette2bpp>(opt);
+  case 4: return runWith<Palette4bpp>(opt);
+  case 8: return runWith<Palette8bpp>(opt);
+  default:
+    fprintf(stderr, "unsupported bpp: %d\n", opt.bpp);
+    return 1;
+  }
+}
+
+}
+
+int main(int argc, char **argv) {
+  return shapoco::main(argc, argv);
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "packed_raster.hpp"
+
+// 半径毎に円の各行のマスクを前もって求めておき、円の描画をマスク付きのコピーにする
+// 1 バイト内の画素位置 (PIXELS_PER_BYTE 通り) 毎にずらしたものを持つ
+// 色はマスクにかけるパターンで与えるので、1 つのスタンプを全ての色で使う
+// 容量を超えたら最も長く使われていない半径から捨てる
+
+namespace shapoco {
+
+template<int BPP, int CAPACITY>
+class CircleStampCache {
+public:
+  using Raster = PackedRaster<BPP>;
+  static constexpr int PIXELS_PER_BYTE = Raster::PIXELS_PER_BYTE;
+  static constexpr int MAX_RADIUS = Raster::MAX_RADIUS;
+  static constexpr int MAX_ENTRIES = 64;
+
+  // 円の左端の画素を含むバイトからの相対位置で [b0, b1] のバイトを塗る
+  // b0 > b1 なら何も塗らない行
+  struct Row {
+    uint16_t b0, b1;
+    uint8_t headMask, tailMask;
+  };
+
+  struct Entry {
+    int16_t radius;
+    uint16_t offset;
+    uint16_t numRows;
+    uint32_t lastUse;
+  };
+
+  // CAPACITY は管理情報も含めた大きさ
+  static constexpr int CAPACITY_ROWS = (CAPACITY - (int)sizeof(Entry) * MAX_ENTRIES) / (int)sizeof(Row);
+  static_assert(CAPACITY_ROWS > 0, "CAPACITY too small");
+  static_assert(CAPACITY_ROWS <= 0x10000, "offset is 16 bits");
+
+  struct Stats {
+    uint64_t lookups = 0;
+    uint64_t hits = 0;
+    uint64_t builds = 0;
+    uint64_t evictions = 0;
+    uint64_t bypasses = 0;  // 左右がはみ出すか大き過ぎてスタンプを使わなかった円
+    int bytesUsed = 0;  // 管理情報を含む
+    int peakBytesUsed = 0;
+  };
+
+  Row rows[CAPACITY_ROWS];
+  // offset の昇順に並べる
+  Entry entries[MAX_ENTRIES];
+  int numEntries = 0;
+  int rowsUsed = 0;
+  uint32_t useCount = 0;
+  Stats stats;
+
+  static constexpr int rowsFor(int r) { return (r + 1) * PIXELS_PER_BYTE; }
+
+  void clear() {
+    numEntries = 0;
+    rowsUsed = 0;
+    stats.bytesUsed = sizeof(entries);
+  }
+
+  // 半径 r のスタンプ。容量に入らなければ nullptr
+  // 行 [align * (r + 1) + dy] が左端の画素位置 align、中心から dy 行離れた行
+  const Row *lookup(int r) {
+    stats.lookups++;
+    useCount++;
+    for (int i = 0; i < numEntries; i++) {
+      if (entries[i].radius == r) {
+        stats.hits++;
+        entries[i].lastUse = useCount;
+        return rows + entries[i].offset;
+      }
+    }
+    int n = rowsFor(r);
+    if (n > CAPACITY_ROWS) return nullptr;
+    while (numEntries >= MAX_ENTRIES || rowsUsed + n > CAPACITY_ROWS) evictOldest();
+    Entry &e = entries[numEntries++];
+    e.radius = r;
+    e.offset = rowsUsed;
+    e.numRows = n;
+    e.lastUse = useCount;
+    build(r, rows + rowsUsed);
+    rowsUsed += n;
+    stats.builds++;
+    stats.bytesUsed = rowsUsed * sizeof(Row) + sizeof(entries);
+    if (stats.bytesUsed > stats.peakBytesUsed) stats.peakBytesUsed = stats.bytesUsed;
+    return rows + e.offset;
+  }
+
+  void fillCircle(uint8_t *buff, int stride, int width, int height, int cx, int cy, int r, uint8_t col) {
+    if (r < 0 || r > MAX_RADIUS) return;
+    int y0 = cy - r < 0 ? 0 : cy - r;
+    int y1 = cy + r + 1 > height ? height : cy + r + 1;
+    if (y0 >= y1) return;
+    const Row *stamp = nullptr;
+    if (cx - r >= 0 && cx + r < width) stamp = lookup(r);
+    if (!stamp) {
+      stats.bypasses++;
+      Raster::fillCircle(buff, stride, width, height, cx, cy, r, col);
+      return;
+    }
+    int left = cx - r;
+    stamp += (left % PIXELS_PER_BYTE) * (r + 1);
+    uint8_t *base = buff + left / PIXELS_PER_BYTE;
+    uint8_t pat = Raster::pattern(col);
+    for (int y = y0; y < y1; y++) {
+      const Row &row = stamp[y < cy ? cy - y : y - cy];
+      if (row.b0 > row.b1) continue;
+      uint8_t *line = base + stride * y;
+      if (row.b0 == row.b1) {
+        uint8_t mask = row.headMask & row.tailMask;
+        line[row.b0] = (line[row.b0] & ~mask) | (pat & mask);
+        continue;
+      }
+      line[row.b0] = (line[row.b0] & ~row.headMask) | (pat & row.headMask);
+      line[row.b1] = (line[row.b1] & ~row.tailMask) | (pat & row.tailMask);
+      if (row.b1 - row.b0 > 1) memset(line + row.b0 + 1, pat, row.b1 - row.b0 - 1);
+    }
+  }
+
+private:
+  static void build(int r, Row *dst) {
+    int16_t halfWidth[MAX_RADIUS + 1];
+    Raster::circleHalfWidths(r, halfWidth);
+    for (int align = 0; align < PIXELS_PER_BYTE; align++) {
+      for (int dy = 0; dy <= r; dy++) {
+        Row &row = dst[align * (r + 1) + dy];
+        int hw = halfWidth[dy];
+        if (hw < 0) {
+          row.b0 = 1;
+          row.b1 = 0;
+          row.headMask = row.tailMask = 0;
+          continue;
+        }
+        int x0 = align + r - hw;
+        int x1 = align + r + hw + 1;
+        row.b0 = x0 / PIXELS_PER_BYTE;
+        row.b1 = (x1 - 1) / PIXELS_PER_BYTE;
+        row.headMask = 0xff >> (BPP * (x0 % PIXELS_PER_BYTE));
+        row.tailMask = 0xff << (8 - BPP * ((x1 - 1) % PIXELS_PER_BYTE + 1));
+      }
+    }
+  }
+
+  // 最も長く使われていないスタンプを捨てて、後ろのスタンプを詰める
+  void evictOldest() {
+    int victim = 0;
+    for (int i = 1; i < numEntries; i++) {
+      if ((int32_t)(entries[i].lastUse - entries[victim].lastUse) < 0) victim = i;
+    }
+    int offset = entries[victim].offset;
+    int n = entries[victim].numRows;
+    memmove(rows + offset, rows + offset + n, (rowsUsed - offset - n) * sizeof(Row));
+    rowsUsed -= n;
+    for (int i = victim + 1; i < numEntries; i++) {
+      entries[i - 1] = entries[i];
+      entries[i - 1].offset -= n;
+    }
+    numEntries--;
+    stats.evictions++;
+    stats.bytesUsed = rowsUsed * sizeof(Row) + sizeof(entries);
+  }
+};
+
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+namespace shapoco {
+
+// 行毎に 1 つのバイト範囲 [x0, x1) を持つ更新領域
+// 同じ行に複数の矩形が重なった場合は両方を含む範囲に広げる
+class DirtyRegion {
+public:
+  const int height;
+  const int stride;
+
+  DirtyRegion(int height, int stride) :
+    height(height),
+    stride(stride),
+    x0(new int16_t[height]),
+    x1(new int16_t[height])
+  {
+    clear();
+  }
+
+  ~DirtyRegion() {
+    delete[] x0;
+    delete[] x1;
+  }
+
+  DirtyRegion(const DirtyRegion &) = delete;
+  DirtyRegion &operator=(const DirtyRegion &) = delete;
+
+  void clear() {
+    for (int y = 0; y < height; y++) {
+      x0[y] = stride;
+      x1[y] = 0;
+    }
+    yMin = height;
+    yMax = 0;
+  }
+
+  void markAll() {
+    for (int y = 0; y < height; y++) {
+      x0[y] = 0;
+      x1[y] = stride;
+    }
+    yMin = 0;
+    yMax = height;
+  }
+
+  // バイト単位の矩形 [bx0, bx1) x [y0, y1) を追加する
+  void mark(int bx0, int y0, int bx1, int y1) {
+    if (bx0 < 0) bx0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (bx1 > stride) bx1 = stride;
+    if (y1 > height) y1 = height;
+    if (bx0 >= bx1 || y0 >= y1) return;
+    for (int y = y0; y < y1; y++) {
+      if (bx0 < x0[y]) x0[y] = bx0;
+      if (bx1 > x1[y]) x1[y] = bx1;
+    }
+    if (y0 < yMin) yMin = y0;
+    if (y1 > yMax) yMax = y1;
+  }
+
+  void merge(const DirtyRegion &r) {
+    for (int y = r.yMin; y < r.yMax; y++) {
+      if (r.x0[y] >= r.x1[y]) continue;
+      if (r.x0[y] < x0[y]) x0[y] = r.x0[y];
+      if (r.x1[y] > x1[y]) x1[y] = r.x1[y];
+    }
+    if (r.yMin < yMin) yMin = r.yMin;
+    if (r.yMax > yMax) yMax = r.yMax;
+  }
+
+  void copyFrom(const DirtyRegion &r) {
+    memcpy(x0, r.x0, sizeof(int16_t) * height);
+    memcpy(x1, r.x1, sizeof(int16_t) * height);
+    yMin = r.yMin;
+    yMax = r.yMax;
+  }
+
+  bool rowDirty(int y) const { return x0[y] < x1[y]; }
+  int rowStart(int y) const { return x0[y]; }
+  int rowEnd(int y) const { return x1[y]; }
+
+  void clearRow(int y) {
+    x0[y] = stride;
+    x1[y] = 0;
+  }
+
+  int countRows() const {
+    int n = 0;
+    for (int y = yMin; y < yMax; y++) {
+      if (rowDirty(y)) n++;
+    }
+    return n;
+  }
+
+  int countBytes() const {
+    int n = 0;
+    for (int y = yMin; y < yMax; y++) {
+      if (rowDirty(y)) n += x1[y] - x0[y];
+    }
+    return n;
+  }
+
+private:
+  int16_t *x0;
+  int16_t *x1;
+  int yMin;
+  int yMax;
+};
+
+}
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "packed_raster.hpp"
+
+// 描画バッファ毎に、前回そのバッファに描いた円のリストを覚えておき、
+// 次に同じバッファに描くときは変わった円の跡と新しい位置のタイルだけを描き直す
+// 描き直すタイルの中では全ての円を記録順に塗り直すので、重なり順は全体を描いた場合と同じ
+
+namespace shapoco {
+
+template<int BPP, int WIDTH, int HEIGHT, int NUM_SLOTS, int CAPACITY>
+class DisplayList {
+public:
+  using Raster = PackedRaster<BPP>;
+  using Circle = typename Raster::Circle;
+  static constexpr int TILE_SIZE = 16;
+  static constexpr int TILES_X = (WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+  static constexpr int TILES_Y = (HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+  static_assert(TILES_X <= 64, "tile row mask is 64 bits");
+  static_assert(TILE_SIZE % Raster::PIXELS_PER_BYTE == 0, "tiles must be byte aligned");
+
+  struct List {
+    Circle *items = nullptr;
+    int count = 0;
+    // false ならバッファの内容はリストと対応しておらず、全体を描き直す
+    bool valid = false;
+  };
+
+  struct Stats {
+    uint64_t frames = 0;
+    uint64_t fullRedraws = 0;
+    uint64_t overflows = 0;
+    uint64_t items = 0;
+    uint64_t changedItems = 0;
+    uint64_t damagedTiles = 0;
+    uint64_t fullDraws = 0;  // タイルに収まっていて切り取らずに描いた円
+    uint64_t clippedDraws = 0;
+  };
+
+  // 記録中のリストと、スロット (描画バッファ) 毎の内容のリスト
+  List lists[NUM_SLOTS + 1];
+  int contentOf[NUM_SLOTS];
+  int recording = NUM_SLOTS;
+  bool overflowed = false;
+  uint64_t damage[TILES_Y];
+  Stats stats;
+
+  DisplayList() {
+    for (int i = 0; i <= NUM_SLOTS; i++) {
+      lists[i].items = new Circle[CAPACITY];
+    }
+    for (int i = 0; i < NUM_SLOTS; i++) contentOf[i] = i;
+  }
+
+  ~DisplayList() {
+    for (int i = 0; i <= NUM_SLOTS; i++) delete[] lists[i].items;
+  }
+
+  DisplayList(const DisplayList &) = delete;
+  DisplayList &operator=(const DisplayList &) = delete;
+
+  // 全てのバッファを次回は全体描き直しにする (初期化、回転、サイズ変更)
+  void invalidate() {
+    for (int i = 0; i <= NUM_SLOTS; i++) {
+      lists[i].count = 0;
+      lists[i].valid = false;
+    }
+    overflowed = false;
+  }
+
+  void invalidate(int slot) {
+    lists[contentOf[slot]].valid = false;
+  }
+
+  void begin() {
+    lists[recording].count = 0;
+    overflowed = false;
+  }
+
+  // 記録できなければ false
+  bool add(const Circle &c) {
+    List &l = lists[recording];
+    if (l.count >= CAPACITY) {
+      if (!overflowed) stats.overflows++;
+      overflowed = true;
+      return false;
+    }
+    l.items[l.count++] = c;
+    return true;
+  }
+
+  const List &current() const { return lists[recording]; }
+
+  // 記録したリストを slot の内容にして、前の内容のリストを次の記録に使う
+  // render() を使わずに描いた場合はこれを呼ぶ
+  void finish(int slot, bool valid) {
+    int prev = contentOf[slot];
+    contentOf[slot] = recording;
+    lists[recording].valid = valid;
+    recording = prev;
+    lists[recording].count = 0;
+    overflowed = false;
+  }
+
+  // 記録したリストで slot のバッファを更新する
+  // extraX0..extraY1 はリスト以外で描いたもの (文字など) の跡で、これも描き直す
+  // drawFull(c) は切り取りの要らない円を描く
+  template<typename DRAW_FULL>
+  void render(int slot, uint8_t *buff, int stride, uint8_t bg,
+      int extraX0, int extraY0, int extraX1, int extraY1, DRAW_FULL drawFull) {
+    List &old = lists[contentOf[slot]];
+    List &cur = lists[recording];
+    stats.frames++;
+    stats.items += cur.count;
+
+    if (overflowed) {
+      // 溢れた時点で LcdService が直接描いている
+      old.valid = false;
+      finish(slot, false);
+      return;
+    }
+
+    if (!old.valid) {
+      stats.fullRedraws++;
+      Raster::fillRect(buff, stride, 0, 0, WIDTH, HEIGHT, bg);
+      for (int i = 0; i < cur.count; i++) drawFull(cur.items[i]);
+      stats.fullDraws += cur.count;
+      finish(slot, true);
+      return;
+    }
+
+    for (int ty = 0; ty < TILES_Y; ty++) damage[ty] = 0;
+    int n = old.count > cur.count ? old.count : cur.count;
+    for (int i = 0; i < n; i++) {
+      if (i < old.count && i < cur.count && same(old.items[i], cur.items[i])) continue;
+      stats.changedItems++;
+      if (i < old.count) markCircle(old.items[i]);
+      if (i < cur.count) markCircle(cur.items[i]);
+    }
+    markRect(extraX0, extraY0, extraX1, extraY1);
+
+    // 傷んだタイルを背景色で塗り直す
+    bool any = false;
+    for (int ty = 0; ty < TILES_Y; ty++) {
+      uint64_t m = damage[ty];
+      if (!m) continue;
+      any = true;
+      stats.damagedTiles += __builtin_popcountll(m);
+      int y0 = ty * TILE_SIZE;
+      int y1 = y0 + TILE_SIZE > HEIGHT ? HEIGHT : y0 + TILE_SIZE;
+      while (m) {
+        int tx0, tx1;
+        nextRun(&m, &tx0, &tx1);
+        int x1 = tx1 * TILE_SIZE > WIDTH ? WIDTH : tx1 * TILE_SIZE;
+        Raster::fillRect(buff, stride, tx0 * TILE_SIZE, y0, x1, y1, bg);
+      }
+    }
+    if (!any) {
+      finish(slot, true);
+      return;
+    }
+
+    // 傷んだタイルに掛かる円を記録順に塗る
+    for (int i = 0; i < cur.count; i++) {
+      const Circle &c = cur.items[i];
+      int tx0, ty0, tx1, ty1;
+      if (!tileRange(c.x - c.r, c.y - c.r, c.x + c.r + 1, c.y + c.r + 1, &tx0, &ty0, &tx1, &ty1)) continue;
+      uint64_t rangeMask = spanMask(tx0, tx1);
+      bool touched = false;
+      bool covered = true;
+      for (int ty = ty0; ty < ty1; ty++) {
+        uint64_t m = damage[ty] & rangeMask;
+        if (m) touched = true;
+        if (m != rangeMask) covered = false;
+      }
+      if (!touched) continue;
+      if (covered) {
+        drawFull(c);
+        stats.fullDraws++;
+        continue;
+      }
+      if (c.r < 0 || c.r > Raster::MAX_RADIUS) continue;
+      int16_t halfWidth[Raster::MAX_RADIUS + 1];
+      Raster::circleHalfWidths(c.r, halfWidth);
+      uint8_t pat = Raster::pattern(c.col);
+      for (int ty = ty0; ty < ty1; ty++) {
+        uint64_t m = damage[ty] & rangeMask;
+        int y0 = ty * TILE_SIZE;
+        int y1 = y0 + TILE_SIZE > HEIGHT ? HEIGHT : y0 + TILE_SIZE;
+        while (m) {
+          int rx0, rx1;
+          nextRun(&m, &rx0, &rx1);
+          int x1 = rx1 * TILE_SIZE > WIDTH ? WIDTH : rx1 * TILE_SIZE;
+          Raster::fillCircleRows(buff, stride, rx0 * TILE_SIZE, y0, x1, y1, c.x, c.y, c.r, halfWidth, pat);
+          stats.clippedDraws++;
+        }
+      }
+    }
+    finish(slot, true);
+  }
+
+private:
+  static bool same(const Circle &a, const Circle &b) {
+    return a.x == b.x && a.y == b.y && a.r == b.r && a.col == b.col;
+  }
+
+  static uint64_t spanMask(int tx0, int tx1) {
+    uint64_t hi = tx1 >= 64 ? ~(uint64_t)0 : (((uint64_t)1 << tx1) - 1);
+    return hi & ~(((uint64_t)1 << tx0) - 1);
+  }
+
+  // m の最下位から続く 1 の並びを [tx0, tx1) として取り出す
+  static void nextRun(uint64_t *m, int *tx0, int *tx1) {
+    int start = __builtin_ctzll(*m);
+    uint64_t rest = ~(*m >> start);
+    int len = rest ? __builtin_ctzll(rest) : 64 - start;
+    *tx0 = start;
+    *tx1 = start + len;
+    *m &= ~spanMask(start, start + len);
+  }
+
+  static bool tileRange(int x0, int y0, int x1, int y1, int *tx0, int *ty0, int *tx1, int *ty1) {
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > WIDTH) x1 = WIDTH;
+    if (y1 > HEIGHT) y1 = HEIGHT;
+    if (x0 >= x1 || y0 >= y1) return false;
+    *tx0 = x0 / TILE_SIZE;
+    *ty0 = y0 / TILE_SIZE;
+    *tx1 = (x1 + TILE_SIZE - 1) / TILE_SIZE;
+    *ty1 = (y1 + TILE_SIZE - 1) / TILE_SIZE;
+    return true;
+  }
+
+  void markRect(int x0, int y0, int x1, int y1) {
+    int tx0, ty0, tx1, ty1;
+    if (!tileRange(x0, y0, x1, y1, &tx0, &ty0, &tx1, &ty1)) return;
+    uint64_t m = spanMask(tx0, tx1);
+    for (int ty = ty0; ty < ty1; ty++) damage[ty] |= m;
+  }
+
+  void markCircle(const Circle &c) {
+    markRect(c.x - c.r, c.y - c.r, c.x + c.r + 1, c.y + c.r + 1);
+  }
+};
+
+}
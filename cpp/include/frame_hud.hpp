@@ -0,0 +1,336 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+#include "spsc_queue.hpp"
+
+// 画面左上に出すフレーム時間の表示
+//   FPS  : "FPS 59.9"
+//   FULL : "FPS 59.9 P50 16.7 P95 17.0 P99 18.2"  (フレーム時間の分位点 [ms])
+//          "UPD 0.12 PNT 1.03 SCN 4.21 KB 12.3"   (update / 描画 / スキャンアウト [ms] と送った画素 [KB/frame])
+//          "T2P P50 21.3 P95 28.0 P99 30.1"        (ドラッグ中のタッチから表示までの時間の分位点 [ms]、測ったときだけ)
+// 書式は整数演算だけで作り、文字は色深度毎にパック済みの字形をバイト単位で写す
+// 0: 表示しない、1: FPS、2: FULL (実行中に FrameHud::cycleMode() で切り替える)
+#ifndef HUD_DEFAULT_MODE
+#define HUD_DEFAULT_MODE (1)
+#endif
+
+namespace shapoco {
+
+enum class HudMode : uint8_t {
+  OFF,
+  FPS,
+  FULL,
+  NUM_MODES,
+};
+
+// 直近 WINDOW フレームのフレーム時間のヒストグラム
+class FrameTimeHistogram {
+public:
+  static constexpr uint32_t BIN_US = 100;
+  static constexpr int NUM_BINS = 512;
+  static constexpr int WINDOW = 256;
+
+  int count = 0;
+
+  void clear() {
+    memset(bins, 0, sizeof(bins));
+    count = 0;
+    next = 0;
+  }
+
+  void add(uint32_t us) {
+    uint32_t b = us / BIN_US;
+    if (b >= NUM_BINS) b = NUM_BINS - 1;
+    if (count == WINDOW) {
+      bins[window[next]]--;
+    }
+    else {
+      count++;
+    }
+    window[next] = b;
+    bins[b]++;
+    next = (next + 1) % WINDOW;
+  }
+
+  // pcts (昇順、%) の分位点をビンの上端 [us] で返す。1 回の走査で全て求める
+  void percentiles(const uint8_t *pcts, int n, uint32_t *out) const {
+    int k = 0;
+    int cum = 0;
+    for (int b = 0; b < NUM_BINS && k < n; b++) {
+      cum += bins[b];
+      while (k < n && cum * 100 >= pcts[k] * count && count > 0) {
+        out[k++] = (b + 1) * BIN_US;
+      }
+    }
+    while (k < n) out[k++] = count > 0 ? NUM_BINS * BIN_US : 0;
+  }
+
+private:
+  uint16_t bins[NUM_BINS] = {};
+  uint16_t window[WINDOW] = {};
+  int next = 0;
+};
+
+struct HudText {
+  static constexpr int MAX_LINES = 3;
+  static constexpr int MAX_COLS = 40;
+
+  char lines[MAX_LINES][MAX_COLS + 1] = {};
+  int numLines = 0;
+  // 最も長い行の文字数 (短い行は空白で埋めて描く)
+  int numCols = 0;
+};
+
+class FrameHud {
+public:
+  // 分位点と内訳を書き直す間隔 [フレーム]
+  static constexpr int REFRESH_FRAMES = 15;
+
+  HudMode mode = (HudMode)HUD_DEFAULT_MODE;
+  FrameTimeHistogram frameTimes;
+  // タッチを読んでからドラッグしているいのちの周りを送り終えるまでの時間
+  FrameTimeHistogram touchLatency;
+  HudText text;
+
+  bool enabled() const { return mode != HudMode::OFF; }
+
+  void setMode(HudMode m) {
+    if (m == mode) return;
+    // 表示していない間は記録しないので、古いフレームが混ざらないよう捨てる
+    if (mode == HudMode::OFF) {
+      frameTimes.clear();
+      touchLatency.clear();
+      uint32_t us;
+      while (touchLatencies.pop(&us)) { }
+      resetSums();
+    }
+    mode = m;
+    stale = true;
+  }
+
+  void cycleMode() {
+    setMode((HudMode)(((int)mode + 1) % (int)HudMode::NUM_MODES));
+  }
+
+  // フレームを始める側: 前のフレームからの時間と、update() と描画に掛かった時間
+  void noteFrame(uint32_t frameUs, uint32_t updateUs, uint32_t paintUs) {
+    if (!enabled()) return;
+    frameTimes.add(frameUs);
+    updateSumUs += updateUs;
+    paintSumUs += paintUs;
+    uint32_t us;
+    while (touchLatencies.pop(&us)) touchLatency.add(us);
+    numFrames++;
+    if (numFrames >= REFRESH_FRAMES) stale = true;
+  }
+
+  // スキャンする側だけが書く: 1 フレームを送るのに掛かった時間
+  void noteScanTime(uint32_t us) {
+    scanSumUs.store(scanSumUs.load(std::memory_order_relaxed) + us, std::memory_order_relaxed);
+    numScans.store(numScans.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // スキャンする側だけが書く: ドラッグしているいのちの周りを送り終えたときの、タッチを読んでからの時間
+  // 溢れた分は捨てる
+  void noteTouchLatency(uint32_t us) {
+    touchLatencies.push(us);
+  }
+
+  // 書き直す時期なら文字列を作り直す
+  // fpsX10: 送ったフレームレートの 10 倍、frameBytes: 直前のフレームで送った画素のバイト数
+  const HudText &refresh(uint32_t fpsX10, uint32_t frameBytes) {
+    if (!stale) return text;
+    stale = false;
+    text.numLines = 0;
+    text.numCols = 0;
+    if (!enabled()) return text;
+
+    Line l(text.lines[0]);
+    l.str("FPS ");
+    l.fixed(fpsX10, 1);
+    if (mode == HudMode::FULL) {
+      static constexpr uint8_t PCTS[] = {50, 95, 99};
+      uint32_t us[3];
+      frameTimes.percentiles(PCTS, 3, us);
+      for (int i = 0; i < 3; i++) {
+        l.str(" P");
+        l.fixed(PCTS[i], 0);
+        l.chr(' ');
+        l.fixed(us[i] / 100, 1);
+      }
+    }
+    finishLine(l);
+    if (mode != HudMode::FULL) {
+      resetSums();
+      return text;
+    }
+
+    uint32_t scans = numScans.load(std::memory_order_acquire);
+    uint32_t scanSum = scanSumUs.load(std::memory_order_relaxed);
+    uint32_t n = numFrames ? numFrames : 1;
+    uint32_t ns = scans - lastNumScans ? scans - lastNumScans : 1;
+    Line m(text.lines[1]);
+    m.str("UPD ");
+    m.fixed(updateSumUs / n / 10, 2);
+    m.str(" PNT ");
+    m.fixed(paintSumUs / n / 10, 2);
+    m.str(" SCN ");
+    m.fixed((scanSum - lastScanSumUs) / ns / 10, 2);
+    m.str(" KB ");
+    m.fixed(frameBytes * 10 / 1024, 1);
+    finishLine(m);
+    if (touchLatency.count > 0) {
+      static constexpr uint8_t PCTS[] = {50, 95, 99};
+      uint32_t us[3];
+      touchLatency.percentiles(PCTS, 3, us);
+      Line t(text.lines[2]);
+      t.str("T2P");
+      for (int i = 0; i < 3; i++) {
+        t.str(" P");
+        t.fixed(PCTS[i], 0);
+        t.chr(' ');
+        t.fixed(us[i] / 100, 1);
+      }
+      finishLine(t);
+    }
+    resetSums();
+    return text;
+  }
+
+private:
+  bool stale = true;
+  uint32_t numFrames = 0;
+  uint32_t updateSumUs = 0;
+  uint32_t paintSumUs = 0;
+  SpscQueue<uint32_t, 8> touchLatencies;
+  std::atomic<uint32_t> scanSumUs{0};
+  std::atomic<uint32_t> numScans{0};
+  uint32_t lastScanSumUs = 0;
+  uint32_t lastNumScans = 0;
+
+  void resetSums() {
+    numFrames = 0;
+    updateSumUs = 0;
+    paintSumUs = 0;
+    lastScanSumUs = scanSumUs.load(std::memory_order_relaxed);
+    lastNumScans = numScans.load(std::memory_order_acquire);
+  }
+
+  // 整数だけで書式を作る
+  struct Line {
+    char *buf;
+    int len = 0;
+
+    Line(char *buf) : buf(buf) { }
+
+    void chr(char c) {
+      if (len < HudText::MAX_COLS) buf[len++] = c;
+    }
+
+    void str(const char *s) {
+      while (*s) chr(*s++);
+    }
+
+    // v を 10^decimals で割った値を小数点以下 decimals 桁で書く
+    void fixed(uint32_t v, int decimals) {
+      char digits[12];
+      int n = 0;
+      do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+      } while (v > 0 || n <= decimals);
+      while (n > 0) {
+        if (n == decimals) chr('.');
+        chr(digits[--n]);
+      }
+    }
+  };
+
+  void finishLine(Line &l) {
+    l.buf[l.len] = '\0';
+    if (l.len > text.numCols) text.numCols = l.len;
+    text.numLines++;
+  }
+};
+
+// 5x7 の字形を 8x8 のセルに置き、色深度毎にパックした行を用意しておく
+// セルの幅はどの色深度でもバイト境界に揃う (8 ピクセル = BPP バイト)
+template<int BPP>
+struct HudAtlas {
+  static constexpr int PIXELS_PER_BYTE = 8 / BPP;
+  static constexpr int CELL_WIDTH = 8;
+  static constexpr int CELL_HEIGHT = 8;
+  static constexpr int CELL_BYTES = CELL_WIDTH * BPP / 8;
+  static constexpr const char *CHARS = " .0123456789BCDFKNPSTU";
+  static constexpr int NUM_GLYPHS = 22;
+
+  uint8_t glyphIndex[128];
+  uint8_t rows[NUM_GLYPHS][CELL_HEIGHT][CELL_BYTES];
+
+  constexpr HudAtlas(uint8_t fg, uint8_t bg) : glyphIndex(), rows() {
+    // 各行の下位 5 ビットが字形 (bit4 が左端)
+    constexpr uint8_t FONT[NUM_GLYPHS][7] = {
+      {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},  // ' '
+      {0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c},  // '.'
+      {0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e},  // '0'
+      {0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e},  // '1'
+      {0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f},  // '2'
+      {0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e},  // '3'
+      {0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02},  // '4'
+      {0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e},  // '5'
+      {0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e},  // '6'
+      {0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08},  // '7'
+      {0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e},  // '8'
+      {0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c},  // '9'
+      {0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e},  // 'B'
+      {0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e},  // 'C'
+      {0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c},  // 'D'
+      {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10},  // 'F'
+      {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11},  // 'K'
+      {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11},  // 'N'
+      {0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10},  // 'P'
+      {0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e},  // 'S'
+      {0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04},  // 'T'
+      {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e},  // 'U'
+    };
+    for (int g = 0; g < NUM_GLYPHS; g++) {
+      glyphIndex[(int)CHARS[g]] = g;
+      for (int y = 0; y < CELL_HEIGHT; y++) {
+        uint8_t bits = y < 7 ? FONT[g][y] : 0;
+        for (int x = 0; x < CELL_WIDTH; x++) {
+          // セルの 1 列目から 5 列分に置く
+          bool on = 1 <= x && x <= 5 && ((bits >> (5 - x)) & 1);
+          int shift = 8 - BPP * (x % PIXELS_PER_BYTE + 1);
+          rows[g][y][x / PIXELS_PER_BYTE] |= (on ? fg : bg) << shift;
+        }
+      }
+    }
+  }
+
+  // パックされたバッファの (x, y) に text を描く。x はバイト境界に揃っていること
+  // 描いた幅 [ピクセル] を返す
+  int draw(uint8_t *buff, int stride, int width, int x, int y, const HudText &text) const {
+    int numCols = text.numCols;
+    if (x + numCols * CELL_WIDTH > width) numCols = (width - x) / CELL_WIDTH;
+    for (int l = 0; l < text.numLines; l++) {
+      const char *s = text.lines[l];
+      uint8_t *line = buff + stride * (y + l * CELL_HEIGHT) + x / PIXELS_PER_BYTE;
+      bool ended = false;
+      for (int c = 0; c < numCols; c++) {
+        if (!ended && !s[c]) ended = true;
+        uint8_t ch = ended ? ' ' : (uint8_t)s[c];
+        const uint8_t (*glyph)[CELL_BYTES] = rows[ch < 128 ? glyphIndex[ch] : 0];
+        uint8_t *dst = line + c * CELL_BYTES;
+        for (int r = 0; r < CELL_HEIGHT; r++) {
+          memcpy(dst + stride * r, glyph[r], CELL_BYTES);
+        }
+      }
+    }
+    return numCols * CELL_WIDTH;
+  }
+};
+
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+// フレームを始める間隔を、スキャンアウトに掛かった時間から選ぶ
+// 間隔は基準の周期の整数倍にして、1 フレームで進める物理演算のステップ数を揃える
+// 送るのが間に合わない間隔でフレームを始めても、バッファを待つ間に遅延が積み上がるだけになる
+
+namespace shapoco {
+
+class FramePacer {
+public:
+  static constexpr int MAX_DIVIDER = 4;
+
+  // 間に合うとみなすための余裕 (間隔に対するスキャン時間の上限 [1/16])
+  static constexpr uint32_t SLOWER_THRESH = 15;
+  // 速い間隔に戻すときの余裕。上げ下げを繰り返さないよう低めにする
+  static constexpr uint32_t FASTER_THRESH = 12;
+
+  struct Stats {
+    uint64_t frames[MAX_DIVIDER + 1] = {};  // 間隔 (倍率) 毎のフレーム数
+    uint32_t changes = 0;
+  };
+
+  uint32_t baseIntervalUs;
+  int divider = 1;
+  uint32_t avgScanUs = 0;
+  // スキャンする側だけが書く
+  std::atomic<uint32_t> lastScanUs{0};
+  std::atomic<uint32_t> numScans{0};
+  // フレームを始める側だけが書く
+  Stats stats;
+
+  FramePacer(uint32_t baseIntervalUs = 1000 * 1000 / 60) : baseIntervalUs(baseIntervalUs) { }
+
+  // スキャンする側: 1 フレームを送るのに掛かった時間
+  void noteScanTime(uint32_t us) {
+    lastScanUs.store(us, std::memory_order_relaxed);
+    numScans.store(numScans.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // フレームを始める側: フレーム毎に 1 回呼び、次のフレームまでの間隔を返す
+  uint32_t nextInterval() {
+    uint32_t n = numScans.load(std::memory_order_acquire);
+    if (n != lastNumScans) {
+      lastNumScans = n;
+      uint32_t us = lastScanUs.load(std::memory_order_relaxed);
+      // 指数移動平均 (1/8)
+      avgScanUs = avgScanUs ? avgScanUs - avgScanUs / 8 + us / 8 : us;
+      choose();
+    }
+    stats.frames[divider]++;
+    return intervalUs();
+  }
+
+  uint32_t intervalUs() const { return baseIntervalUs * divider; }
+
+private:
+  uint32_t lastNumScans = 0;
+
+  void choose() {
+    int d = divider;
+    while (d < MAX_DIVIDER && avgScanUs * 16 > baseIntervalUs * d * SLOWER_THRESH) d++;
+    while (d > 1 && avgScanUs * 16 < baseIntervalUs * (d - 1) * FASTER_THRESH) d--;
+    if (d != divider) {
+      divider = d;
+      stats.changes++;
+    }
+  }
+};
+
+}
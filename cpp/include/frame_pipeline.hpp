@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+#include "spsc_queue.hpp"
+
+// 描画 (コア 0) とスキャンアウト (コア 1) の間でフレームバッファを回す
+// DEPTH 枚のバッファのうち 1 枚を描き、1 枚を送り、残りは送る順番を待つ
+// 空きが無ければ描く側は待たされる
+#ifndef LCD_PIPELINE_DEPTH
+#define LCD_PIPELINE_DEPTH (2)
+#endif
+
+namespace shapoco {
+
+enum class FrameState : uint8_t {
+  FREE,      // 使っていない (描く側に返してある)
+  DRAWING,   // コア 0 が描いている
+  QUEUED,    // 描き終えて送られるのを待っている
+  SCANNING,  // コア 1 が送っている
+};
+
+template<int DEPTH>
+class FramePipeline {
+public:
+  static_assert(DEPTH >= 2 && DEPTH <= 4, "DEPTH must be 2 to 4");
+
+  struct Stats {
+    uint64_t submitted = 0;
+    uint64_t stalls = 0;      // 空きバッファが無く描き始められなかった回数
+    uint64_t queuedTotal = 0; // 渡した時点で待っていたフレーム数の合計
+    int maxQueued = 0;
+  };
+
+  SpscQueue<uint8_t, 4> submittedFrames;
+  SpscQueue<uint8_t, 4> releasedBuffers;
+  uint32_t numSubmittedFrames = 0;
+  std::atomic<uint32_t> numScannedFrames{0};
+  std::atomic<uint8_t> states[DEPTH];
+  bool stalled = false;
+  // コア 0 だけが書く
+  Stats stats;
+
+  FramePipeline() { reset(0, 1); }
+
+  // 両側とも止まっているときにだけ呼ぶこと
+  // drawIndex を描き始め、scanIndex はスキャン側が持つ。残りは空きにする
+  void reset(int drawIndex, int scanIndex) {
+    submittedFrames.reset();
+    releasedBuffers.reset();
+    numSubmittedFrames = 0;
+    numScannedFrames.store(0, std::memory_order_relaxed);
+    stalled = false;
+    stats = Stats();
+    for (int i = 0; i < DEPTH; i++) {
+      setState(i, FrameState::FREE);
+      if (i != drawIndex && i != scanIndex) releasedBuffers.push(i);
+    }
+    setState(drawIndex, FrameState::DRAWING);
+  }
+
+  FrameState stateOf(int i) const {
+    return (FrameState)states[i].load(std::memory_order_relaxed);
+  }
+
+  // 同じコアでスキャンアウトする場合の入れ替え
+  void flipped(int scanIndex, int drawIndex) {
+    setState(scanIndex, FrameState::SCANNING);
+    setState(drawIndex, FrameState::DRAWING);
+  }
+
+  // 以下はスキャンアウトを別のコアで行う場合に使う
+
+  // コア 0: 空いているバッファの番号。無ければ -1
+  int acquire() {
+    uint8_t i;
+    if (!releasedBuffers.pop(&i)) {
+      if (!stalled) stats.stalls++;
+      stalled = true;
+      return -1;
+    }
+    stalled = false;
+    setState(i, FrameState::DRAWING);
+    return i;
+  }
+
+  // コア 0: 描き終えたバッファを送る順番に並べる
+  // 空きバッファの数だけしか描けないので、キューが溢れることはない
+  void submit(int drawIndex) {
+    int queued = (int)(numSubmittedFrames - numScannedFrames.load(std::memory_order_acquire));
+    stats.queuedTotal += queued;
+    if (queued > stats.maxQueued) stats.maxQueued = queued;
+    setState(drawIndex, FrameState::QUEUED);
+    while (!submittedFrames.push(drawIndex)) { }
+    numSubmittedFrames++;
+    stats.submitted++;
+  }
+
+  // コア 1: 次に送るフレームを受け取り、送り終えたバッファ (scanIndex) を返す。無ければ -1
+  int takeNext(int scanIndex) {
+    uint8_t i;
+    if (!submittedFrames.pop(&i)) return -1;
+    if (scanIndex >= 0) {
+      setState(scanIndex, FrameState::FREE);
+      while (!releasedBuffers.push(scanIndex)) { }
+    }
+    setState(i, FrameState::SCANNING);
+    return i;
+  }
+
+  // コア 1: 受け取ったフレームを送り終えた
+  void scanned() {
+    // 書き込みはコア 1 だけなので load/store で足りる
+    uint32_t n = numScannedFrames.load(std::memory_order_relaxed);
+    numScannedFrames.store(n + 1, std::memory_order_release);
+  }
+
+  // コア 0: 渡したフレームを全てパネルに送り終えたか
+  bool drained() const {
+    return numScannedFrames.load(std::memory_order_acquire) == numSubmittedFrames;
+  }
+
+private:
+  void setState(int i, FrameState s) {
+    states[i].store((uint8_t)s, std::memory_order_relaxed);
+  }
+};
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "packed_raster.hpp"
+
+// 半径毎の円の半幅のテーブル (PackedRaster::circleHalfWidths() の結果) を覚えておく
+// 使った半径の分だけ POOL から切り出し、溢れたら全て捨てて作り直す
+
+namespace shapoco {
+
+template<int POOL>
+class HalfWidthCache {
+public:
+  static constexpr int MAX_RADIUS = PackedRaster<8>::MAX_RADIUS;
+  static_assert(POOL >= MAX_RADIUS + 1, "POOL must hold the largest radius");
+  static_assert(POOL <= 0x8000, "offset is 15 bits");
+
+  struct Stats {
+    uint64_t builds = 0;
+    uint64_t flushes = 0;
+  };
+
+  int16_t pool[POOL];
+  // 半径毎の pool 内の位置。無ければ -1
+  int16_t offset[MAX_RADIUS + 1];
+  int used = 0;
+  Stats stats;
+
+  HalfWidthCache() { clear(); }
+
+  void clear() {
+    for (int r = 0; r <= MAX_RADIUS; r++) offset[r] = -1;
+    used = 0;
+  }
+
+  // 0 <= r <= MAX_RADIUS であること。次の lookup() までの間だけ有効
+  const int16_t *lookup(int r) {
+    if (offset[r] >= 0) return pool + offset[r];
+    if (used + r + 1 > POOL) {
+      clear();
+      stats.flushes++;
+    }
+    offset[r] = used;
+    PackedRaster<8>::circleHalfWidths(r, pool + used);
+    used += r + 1;
+    stats.builds++;
+    return pool + offset[r];
+  }
+};
+
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "inochi/real.hpp"
+
+// FPU の無いマイコン向けの近似関数 (float 版)
+// 誤差の上限は bench_fast_math で libm と比べて確かめる
+//   fastLog2  : 正規化数に対し絶対誤差 4.0e-6 (多項式は 2.1e-6、残りは整数部との和の丸め)
+//   fastExp2  : 相対誤差 3.0e-7 (-126 <= x < 128)
+//   fastPow   : |b * log2(a)| <= 32 で相対誤差 1.0e-5
+//   fastRsqrt : 相対誤差 4.8e-6 (Newton 法 2 回)
+//   sinTurn   : 絶対誤差 7.6e-5 (256 分割の表を線形補間)
+// INOCHI_FAST_MATH を 0 にすると libm を使う
+#ifndef INOCHI_FAST_MATH
+#define INOCHI_FAST_MATH (1)
+#endif
+
+namespace shapoco::inochi {
+
+static inline uint32_t floatBits(float x) {
+  uint32_t u;
+  memcpy(&u, &x, sizeof(u));
+  return u;
+}
+
+static inline float bitsToFloat(uint32_t u) {
+  float x;
+  memcpy(&x, &u, sizeof(x));
+  return x;
+}
+
+// 仮数部 m (1 <= m < 2) の log2(m) を (m - 1) の 6 次の多項式で近似する
+// 正でない数と非正規化数は扱わない
+static inline float fastLog2(float x) {
+  uint32_t u = floatBits(x);
+  int e = (int)((u >> 23) & 0xff) - 127;
+  float t = bitsToFloat((u & 0x7fffff) | 0x3f800000) - 1.0f;
+  float p = -0.02645583f;
+  p = 0.12344671f + p * t;
+  p = -0.27953290f + p * t;
+  p = 0.45826819f + p * t;
+  p = -0.71828135f + p * t;
+  p = 1.44255310f + p * t;
+  return (float)e + p * t;
+}
+
+// 小数部は 5 次の多項式近似 (固定小数点版の exp2 と同じ係数)
+static inline float fastExp2(float x) {
+  if (x < -126.0f) return 0.0f;
+  if (x >= 128.0f) return INFINITY;
+  float fi = floorf(x);
+  float f = x - fi;
+  float p = 0.0018775696f;
+  p = 0.0089893397f + p * f;
+  p = 0.0558263101f + p * f;
+  p = 0.2401536098f + p * f;
+  p = 0.6931530796f + p * f;
+  p = 1.0f + p * f;
+  int32_t e = (int32_t)fi;
+  return bitsToFloat(floatBits(p) + ((uint32_t)e << 23));
+}
+
+// 底が正でない場合は 0 を返す (固定小数点版の pow と同じ)
+static inline float fastPow(float a, float b) {
+  if (b == 0.0f) return 1.0f;
+  if (a <= 0.0f) return 0.0f;
+  return fastExp2(b * fastLog2(a));
+}
+
+static inline float fastRsqrt(float x) {
+  float y = bitsToFloat(0x5f375a86 - (floatBits(x) >> 1));
+  float hx = 0.5f * x;
+  y = y * (1.5f - hx * y * y);
+  y = y * (1.5f - hx * y * y);
+  return y;
+}
+
+static inline float fastSqrt(float x) {
+  return x > 0.0f ? x * fastRsqrt(x) : 0.0f;
+}
+
+// 1 周を SIN_TABLE_SIZE 分割した sin の表
+static constexpr int SIN_TABLE_SIZE = 256;
+
+struct SinTable {
+  float v[SIN_TABLE_SIZE + 1];
+
+  constexpr SinTable() : v() {
+    // constexpr で評価できるよう Taylor 展開で求める
+    for (int i = 0; i <= SIN_TABLE_SIZE; i++) {
+      double a = 2 * 3.14159265358979323846 * i / SIN_TABLE_SIZE;
+      int q = 0;
+      while (a > 3.14159265358979323846 / 2) { a -= 3.14159265358979323846; q ^= 1; }
+      double term = a, sum = a;
+      for (int k = 1; k < 12; k++) {
+        term *= -a * a / ((2 * k) * (2 * k + 1));
+        sum += term;
+      }
+      v[i] = (float)(q ? -sum : sum);
+    }
+  }
+};
+
+static constexpr SinTable SIN_TABLE;
+
+// t: 回転数 (1 で 1 周)。負の値も扱う
+static inline float sinTurn(float t) {
+  float x = (t - floorf(t)) * SIN_TABLE_SIZE;
+  int i = (int)x;
+  if (i >= SIN_TABLE_SIZE) i = SIN_TABLE_SIZE - 1;
+  float f = x - i;
+  return SIN_TABLE.v[i] + (SIN_TABLE.v[i + 1] - SIN_TABLE.v[i]) * f;
+}
+
+static inline float cosTurn(float t) {
+  return sinTurn(t + 0.25f);
+}
+
+// 物理演算から使う。固定小数点版は Fixed の近似をそのまま使う
+#if INOCHI_FAST_MATH && !INOCHI_FIXED_POINT
+static inline real powR(real a, real b) { return fastPow(a, b); }
+static inline real exp2R(real x) { return fastExp2(x); }
+static inline real sqrtR(real x) { return fastSqrt(x); }
+#else
+static inline real powR(real a, real b) { return pow(a, b); }
+static inline real exp2R(real x) { return exp2(x); }
+static inline real sqrtR(real x) { return sqrt(x); }
+#endif
+
+#if INOCHI_FAST_MATH
+static inline real sinTurnR(real t) { return sinTurn((float)t); }
+static inline real cosTurnR(real t) { return cosTurn((float)t); }
+#else
+static inline real sinTurnR(real t) { return sinf(2 * (float)M_PI * (float)t); }
+static inline real cosTurnR(real t) { return cosf(2 * (float)M_PI * (float)t); }
+#endif
+
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <type_traits>
+
+namespace shapoco::inochi {
+
+// 符号付き 32bit 固定小数点数 (小数部 FRAC_BITS ビット)
+// 四則演算は int32_t の範囲で飽和する
+template<int FRAC_BITS>
+class Fixed {
+  static_assert(0 < FRAC_BITS && FRAC_BITS < 30, "FRAC_BITS out of range");
+
+public:
+  using raw_t = int32_t;
+  using wide_t = int64_t;
+
+  static constexpr raw_t RAW_MAX = INT32_MAX;
+  static constexpr raw_t RAW_MIN = -INT32_MAX;
+  static constexpr raw_t RAW_ONE = (raw_t)1 << FRAC_BITS;
+
+  raw_t raw = 0;
+
+  constexpr Fixed() {}
+
+  template<typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+  constexpr Fixed(T v) : raw(fromArith(v)) {}
+
+  static constexpr Fixed fromRaw(raw_t r) {
+    Fixed f;
+    f.raw = r;
+    return f;
+  }
+
+  static constexpr raw_t saturate(wide_t v) {
+    return v > RAW_MAX ? RAW_MAX : v < RAW_MIN ? RAW_MIN : (raw_t)v;
+  }
+
+  template<typename T>
+  static constexpr raw_t fromArith(T v) {
+    if constexpr (std::is_floating_point_v<T>) {
+      double d = (double)v * RAW_ONE;
+      if (d >= (double)RAW_MAX) return RAW_MAX;
+      if (d <= (double)RAW_MIN) return RAW_MIN;
+      return (raw_t)(d < 0 ? d - 0.5 : d + 0.5);
+    }
+    else if constexpr (std::is_unsigned_v<T>) {
+      return v > (T)(RAW_MAX >> FRAC_BITS) ? RAW_MAX : (raw_t)v << FRAC_BITS;
+    }
+    else {
+      return saturate((wide_t)v * RAW_ONE);
+    }
+  }
+
+  template<typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+  explicit constexpr operator T() const {
+    if constexpr (std::is_floating_point_v<T>) {
+      return (T)raw / RAW_ONE;
+    }
+    else {
+      // float からのキャストと同じく 0 方向に丸める
+      return (T)(raw / RAW_ONE);
+    }
+  }
+
+  constexpr Fixed operator-() const { return fromRaw(-raw); }
+
+  friend constexpr Fixed operator+(Fixed a, Fixed b) {
+    return fromRaw(saturate((wide_t)a.raw + b.raw));
+  }
+
+  friend constexpr Fixed operator-(Fixed a, Fixed b) {
+    return fromRaw(saturate((wide_t)a.raw - b.raw));
+  }
+
+  friend constexpr Fixed operator*(Fixed a, Fixed b) {
+    wide_t p = (wide_t)a.raw * b.raw + ((wide_t)1 << (FRAC_BITS - 1));
+    return fromRaw(saturate(p >> FRAC_BITS));
+  }
+
+  friend constexpr Fixed operator/(Fixed a, Fixed b) {
+    if (b.raw == 0) return fromRaw(a.raw >= 0 ? RAW_MAX : RAW_MIN);
+    return fromRaw(saturate(((wide_t)a.raw * RAW_ONE) / b.raw));
+  }
+
+  Fixed &operator+=(Fixed b) { return *this = *this + b; }
+  Fixed &operator-=(Fixed b) { return *this = *this - b; }
+  Fixed &operator*=(Fixed b) { return *this = *this * b; }
+  Fixed &operator/=(Fixed b) { return *this = *this / b; }
+
+  friend constexpr bool operator==(Fixed a, Fixed b) { return a.raw == b.raw; }
+  friend constexpr bool operator!=(Fixed a, Fixed b) { return a.raw != b.raw; }
+  friend constexpr bool operator<(Fixed a, Fixed b) { return a.raw < b.raw; }
+  friend constexpr bool operator>(Fixed a, Fixed b) { return a.raw > b.raw; }
+  friend constexpr bool operator<=(Fixed a, Fixed b) { return a.raw <= b.raw; }
+  friend constexpr bool operator>=(Fixed a, Fixed b) { return a.raw >= b.raw; }
+
+  friend constexpr Fixed abs(Fixed a) { return fromRaw(a.raw < 0 ? -a.raw : a.raw); }
+
+  friend constexpr Fixed floor(Fixed a) {
+    return fromRaw(a.raw & ~(RAW_ONE - 1));
+  }
+
+  friend constexpr Fixed round(Fixed a) {
+    // 0.5 は 0 から遠い方へ丸める (libm の round と同じ)
+    raw_t half = RAW_ONE / 2;
+    raw_t mag = a.raw < 0 ? -a.raw : a.raw;
+    mag = (raw_t)(((wide_t)mag + half) & ~(wide_t)(RAW_ONE - 1));
+    return fromRaw(a.raw < 0 ? -mag : saturate(mag));
+  }
+
+  // 1 ビットずつ平方根を求める (乗算なし)
+  friend constexpr Fixed sqrt(Fixed a) {
+    if (a.raw <= 0) return Fixed();
+    uint64_t v = (uint64_t)a.raw << FRAC_BITS;
+    uint64_t res = 0;
+    uint64_t bit = (uint64_t)1 << 62;
+    while (bit > v) bit >>= 2;
+    while (bit) {
+      if (v >= res + bit) {
+        v -= res + bit;
+        res = (res >> 1) + bit;
+      }
+      else {
+        res >>= 1;
+      }
+      bit >>= 2;
+    }
+    return fromRaw((raw_t)res);
+  }
+
+  // Newton-Raphson 法による逆数 (誤差は 1 LSB 程度)
+  friend constexpr Fixed reciprocal(Fixed a) {
+    if (a.raw == 0) return fromRaw(RAW_MAX);
+    bool neg = a.raw < 0;
+    uint32_t x = neg ? -a.raw : a.raw;
+    int s = 0;
+    while (!(x & 0x40000000u)) {
+      x <<= 1;
+      s++;
+    }
+    // d = x / 2^31 は [0.5, 1)、y は 1/d の Q30 表現
+    wide_t d = x;
+    wide_t y = 3031741621ll - ((2021161080ll * d) >> 31);
+    for (int i = 0; i < 3; i++) {
+      wide_t e = (d * y) >> 31;
+      y = (y * (((wide_t)2 << 30) - e)) >> 30;
+    }
+    int shift = 2 * FRAC_BITS + s - 61;
+    wide_t r = shift >= 0 ? (shift > 31 ? (wide_t)RAW_MAX : y << shift) : (y >> -shift);
+    r = saturate(r);
+    return fromRaw(neg ? -(raw_t)r : (raw_t)r);
+  }
+
+  // 正の数のみ
+  friend constexpr Fixed log2(Fixed a) {
+    if (a.raw <= 0) return fromRaw(RAW_MIN);
+    int msb = 31;
+    while (!((uint32_t)a.raw >> msb)) msb--;
+    wide_t m = (wide_t)a.raw << (30 - msb);
+    raw_t frac = 0;
+    for (int i = 1; i <= FRAC_BITS; i++) {
+      m = (m * m) >> 30;
+      if (m >= ((wide_t)2 << 30)) {
+        m >>= 1;
+        frac |= (raw_t)1 << (FRAC_BITS - i);
+      }
+    }
+    return fromRaw((raw_t)(msb - FRAC_BITS) * RAW_ONE + frac);
+  }
+
+  // 小数部は 5 次の多項式近似 (相対誤差 2.1e-7)
+  friend constexpr Fixed exp2(Fixed a) {
+    raw_t ip = a.raw >> FRAC_BITS;
+    wide_t f = (wide_t)(a.raw & (RAW_ONE - 1)) << (30 - FRAC_BITS);
+    wide_t p = 2016025;
+    p = 9652230 + ((p * f) >> 30);
+    p = 59943044 + ((p * f) >> 30);
+    p = 257862975 + ((p * f) >> 30);
+    p = 744267452 + ((p * f) >> 30);
+    p = 1073741824 + ((p * f) >> 30);
+    int shift = 30 - FRAC_BITS - ip;
+    if (shift < 0) return fromRaw(shift < -31 ? RAW_MAX : saturate(p << -shift));
+    if (shift > 62) return Fixed();
+    return fromRaw((raw_t)((p + (((wide_t)1 << shift) >> 1)) >> shift));
+  }
+
+  // 底が正でない場合は 0 を返す
+  friend constexpr Fixed pow(Fixed a, Fixed b) {
+    if (b.raw == 0) return Fixed(1);
+    if (a.raw <= 0) return Fixed();
+    return exp2(b * log2(a));
+  }
+
+  // 初期配置でしか使わないので float で計算する
+  friend Fixed sin(Fixed a) { return Fixed(sinf((float)a)); }
+  friend Fixed cos(Fixed a) { return Fixed(cosf((float)a)); }
+};
+
+}
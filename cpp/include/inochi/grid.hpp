@@ -0,0 +1,170 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "inochi/real.hpp"
+#include "inochi/vec.hpp"
+
+namespace shapoco::inochi {
+
+// n 以上で最小の 2 の冪 (minValue 以上)
+constexpr int ceilPow2(int n, int minValue) {
+  int b = minValue;
+  while (b < n) b <<= 1;
+  return b;
+}
+
+// ワールド座標上の一様グリッド (空間ハッシュ)
+// rebuild() で登録した要素をインデックスで返す。rebuild 後に要素が動いた場合は
+// noteMoved() で移動量を伝えておけば、検索はその分だけ範囲を広げて取りこぼさない
+// 要素は CAPACITY 個まで。配列は最初に確保しておき、rebuild() でヒープを使わない
+template<int CAPACITY>
+class SpatialGrid {
+public:
+  static constexpr int MIN_BUCKETS = 16;
+  static constexpr int MAX_BUCKETS = ceilPow2(CAPACITY, MIN_BUCKETS);
+  // セル境界での丸め誤差を見込んで距離の下限を少し小さめに見積もる
+  static constexpr float EDGE_SLACK = 1.0f / 64;
+
+  real minCellSize = 0.5;
+
+  int size() const { return count; }
+  real getCellSize() const { return cellSize; }
+
+  template<typename PosFunc, typename RadiusFunc>
+  void rebuild(int n, PosFunc posOf, RadiusFunc radiusOf) {
+    count = n;
+    maxDisp = 0;
+    maxRadius = 0;
+    if (n == 0) return;
+
+    VecR lo = posOf(0), hi = lo;
+    for (int i = 0; i < n; i++) {
+      VecR p = posOf(i);
+      origin[i] = p;
+      if (p.x < lo.x) lo.x = p.x;
+      if (p.y < lo.y) lo.y = p.y;
+      if (p.x > hi.x) hi.x = p.x;
+      if (p.y > hi.y) hi.y = p.y;
+      real r = abs(radiusOf(i));
+      if (r > maxRadius) maxRadius = r;
+    }
+
+    // 1 セルあたり 1 個程度になるようにセルの大きさを決める
+    real area = (hi.x - lo.x) * (hi.y - lo.y);
+    cellSize = sqrt(area / n);
+    if (cellSize < minCellSize) cellSize = minCellSize;
+
+    int numBuckets = ceilPow2(n, MIN_BUCKETS);
+    bucketMask = numBuckets - 1;
+    for (int b = 0; b <= numBuckets; b++) bucketStart[b] = 0;
+
+    for (int i = 0; i < n; i++) {
+      cellX[i] = toCell(origin[i].x);
+      cellY[i] = toCell(origin[i].y);
+      bucketStart[bucketOf(cellX[i], cellY[i]) + 1]++;
+    }
+    minCx = toCell(lo.x);
+    minCy = toCell(lo.y);
+    maxCx = toCell(hi.x);
+    maxCy = toCell(hi.y);
+
+    for (int b = 0; b < numBuckets; b++) {
+      bucketStart[b + 1] += bucketStart[b];
+    }
+    for (int b = 0; b < numBuckets; b++) fill[b] = bucketStart[b];
+    for (int i = 0; i < n; i++) {
+      items[fill[bucketOf(cellX[i], cellY[i])]++] = i;
+    }
+  }
+
+  void noteMoved(int i, VecR pos, real radius) {
+    VecR d = pos - origin[i];
+    real disp = abs(d.x) > abs(d.y) ? abs(d.x) : abs(d.y);
+    if (disp > maxDisp) maxDisp = disp;
+    if (abs(radius) > maxRadius) maxRadius = abs(radius);
+  }
+
+  // pos に近いセルから順に要素を visit(index) する。
+  // リングを 1 周する毎に、未訪問の要素までの距離の下限を done(minDist) に渡し、
+  // true が返れば打ち切る
+  template<typename VisitFunc, typename DoneFunc>
+  void search(VecR pos, VisitFunc visit, DoneFunc done) const {
+    if (count == 0) return;
+    int cx = toCell(pos.x);
+    int cy = toCell(pos.y);
+    int rStart = 0;
+    if (minCx - cx > rStart) rStart = minCx - cx;
+    if (cx - maxCx > rStart) rStart = cx - maxCx;
+    if (minCy - cy > rStart) rStart = minCy - cy;
+    if (cy - maxCy > rStart) rStart = cy - maxCy;
+    for (int r = rStart; ; r++) {
+      for (int y = cy - r; y <= cy + r; y++) {
+        if (y < minCy || y > maxCy) continue;
+        if (y == cy - r || y == cy + r) {
+          int x0 = cx - r > minCx ? cx - r : minCx;
+          int x1 = cx + r < maxCx ? cx + r : maxCx;
+          for (int x = x0; x <= x1; x++) visitCell(x, y, visit);
+        }
+        else {
+          if (cx - r >= minCx && cx - r <= maxCx) visitCell(cx - r, y, visit);
+          if (cx + r >= minCx && cx + r <= maxCx) visitCell(cx + r, y, visit);
+        }
+      }
+      bool covered =
+        cx - r <= minCx && cx + r >= maxCx &&
+        cy - r <= minCy && cy + r >= maxCy;
+      if (covered) break;
+      if (done(cellSize * (r - EDGE_SLACK) - maxDisp)) break;
+    }
+  }
+
+  // 半径を含めて pos に重なりうる要素を visit(index) する
+  template<typename VisitFunc>
+  void queryPoint(VecR pos, VisitFunc visit) const {
+    if (count == 0) return;
+    real margin = maxRadius + maxDisp;
+    int x0 = toCell(pos.x - margin), x1 = toCell(pos.x + margin);
+    int y0 = toCell(pos.y - margin), y1 = toCell(pos.y + margin);
+    if (x0 < minCx) x0 = minCx;
+    if (y0 < minCy) y0 = minCy;
+    if (x1 > maxCx) x1 = maxCx;
+    if (y1 > maxCy) y1 = maxCy;
+    for (int y = y0; y <= y1; y++) {
+      for (int x = x0; x <= x1; x++) {
+        visitCell(x, y, visit);
+      }
+    }
+  }
+
+private:
+  real cellSize = 1;
+  real maxDisp = 0;
+  real maxRadius = 0;
+  int minCx = 0, minCy = 0, maxCx = -1, maxCy = -1;
+  uint32_t bucketMask = 0;
+  int count = 0;
+  int cellX[CAPACITY];
+  int cellY[CAPACITY];
+  VecR origin[CAPACITY];
+  int bucketStart[MAX_BUCKETS + 1];
+  int fill[MAX_BUCKETS];
+  int items[CAPACITY];
+
+  int toCell(real v) const { return (int)floor(v / cellSize); }
+
+  int bucketOf(int cx, int cy) const {
+    return ((uint32_t)cx * 73856093u ^ (uint32_t)cy * 19349663u) & bucketMask;
+  }
+
+  template<typename VisitFunc>
+  void visitCell(int cx, int cy, VisitFunc &visit) const {
+    int b = bucketOf(cx, cy);
+    for (int k = bucketStart[b]; k < bucketStart[b + 1]; k++) {
+      int i = items[k];
+      if (cellX[i] == cx && cellY[i] == cy) visit(i);
+    }
+  }
+};
+
+}
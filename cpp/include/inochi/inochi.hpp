@@ -5,17 +5,47 @@
 #include <vector>
 
 #include "inochi/real.hpp"
+#include "inochi/fast_math.hpp"
+#include "inochi/random.hpp"
 #include "inochi/vec.hpp"
+#include "inochi/grid.hpp"
+#include "inochi/slot_map.hpp"
+
+#ifndef INOCHI_MAX_BALLS
+#define INOCHI_MAX_BALLS (128)
+#endif
+
+#ifndef INOCHI_MAX_FRAGMENTS
+#define INOCHI_MAX_FRAGMENTS (512)
+#endif
+
+// 物理演算の固定ステップ [us]
+#ifndef INOCHI_STEP_US
+#define INOCHI_STEP_US (16667)
+#endif
+
+// 1 回の World::update() で進める最大のステップ数。追いつけない分の時間は捨てる
+#ifndef INOCHI_MAX_STEPS_PER_UPDATE
+#define INOCHI_MAX_STEPS_PER_UPDATE (4)
+#endif
+
+// World::servicePaint() の 1 回の呼び出しで描く時間の目安 [us]。0 ならフレームの最後まで描く
+#ifndef INOCHI_PAINT_BUDGET_US
+#define INOCHI_PAINT_BUDGET_US (200)
+#endif
 
 namespace shapoco::inochi {
 
 static constexpr int NUM_INITIAL_BALLS = 15;
+static constexpr int NUM_FRAGMENTS_PER_KILL = 8;
 static const real VIEW_RADIUS = 8;
 static const real CIRCLE_RADIUS = 4;
 
 struct TouchState {
   VecI pos;
   bool touched = false;
+  // タッチパネルを読んだ時刻 [us]。分からなければ 0
+  uint64_t timeUs = 0;
 };
 
 enum Palette {
@@ -27,6 +57,8 @@ enum Palette {
 
 struct HostAPI {
   uint64_t (*getTimeMs)();
+  // 描画の時間配分に使う単調増加の時刻
+  uint64_t (*getTimeUs)();
   VecI (*getScreenSize)();
   void (*clearScreen)();
   void (*drawCircle)(VecI pos, int r, Palette col);
@@ -45,29 +77,166 @@ static inline real sign(real x) {
   return x < 0 ? -1 : 1;
 }
 
-static real randR() {
-  return (real)rand() / RAND_MAX;
-}
+// いのちの状態 (SoA)。インデックスは削除の度に詰め直されるので、
+// フレームをまたいで参照するときは Handle を使う
+class BallStore {
+public:
+  static constexpr int CAPACITY = INOCHI_MAX_BALLS;
+
+  SlotMap<CAPACITY> slots;
+  VecR bodyPos[CAPACITY];
+  real bodySize[CAPACITY];
+  // 直前のステップの値 (描画の補間に使う)
+  VecR prevBodyPos[CAPACITY];
+  real prevBodySize[CAPACITY];
+  VecR bodyPosVel[CAPACITY];
+  real bodySizeVel[CAPACITY];
+  real orbitGoal[CAPACITY];
+  real bodySizeGoal[CAPACITY];
+  bool eyeOpened[CAPACITY];
+  VecR eyePos[CAPACITY];
+  VecR eyePosGoal[CAPACITY];
+  VecR irisPos[CAPACITY];
+  VecR irisPosGoal[CAPACITY];
+  bool alive[CAPACITY];
+
+  int size() const { return slots.size(); }
+  bool full() const { return slots.full(); }
+  Handle handleAt(int i) const { return slots.handleAt(i); }
+  int indexOf(Handle h) const { return slots.indexOf(h); }
+
+  void savePrevious() {
+    int n = size();
+    for (int i = 0; i < n; i++) {
+      prevBodyPos[i] = bodyPos[i];
+      prevBodySize[i] = bodySize[i];
+    }
+  }
 
-class Ball;
-class InochiNoKakera;
+  int add(VecR pos) {
+    Handle h = slots.insert();
+    if (!h.valid()) return -1;
+    int i = slots.indexOf(h);
+    bodyPos[i] = pos;
+    bodySize[i] = 0;
+    prevBodyPos[i] = pos;
+    prevBodySize[i] = 0;
+    bodyPosVel[i] = VecR();
+    bodySizeVel[i] = 0;
+    orbitGoal[i] = CIRCLE_RADIUS;
+    bodySizeGoal[i] = 1;
+    eyeOpened[i] = false;
+    eyePos[i] = VecR();
+    eyePosGoal[i] = VecR();
+    irisPos[i] = VecR();
+    irisPosGoal[i] = VecR();
+    alive[i] = true;
+    return i;
+  }
+
+  void removeAt(int i) {
+    int last = size() - 1;
+    if (i != last) {
+      bodyPos[i] = bodyPos[last];
+      bodySize[i] = bodySize[last];
+      prevBodyPos[i] = prevBodyPos[last];
+      prevBodySize[i] = prevBodySize[last];
+      bodyPosVel[i] = bodyPosVel[last];
+      bodySizeVel[i] = bodySizeVel[last];
+      orbitGoal[i] = orbitGoal[last];
+      bodySizeGoal[i] = bodySizeGoal[last];
+      eyeOpened[i] = eyeOpened[last];
+      eyePos[i] = eyePos[last];
+      eyePosGoal[i] = eyePosGoal[last];
+      irisPos[i] = irisPos[last];
+      irisPosGoal[i] = irisPosGoal[last];
+      alive[i] = alive[last];
+    }
+    slots.removeAt(i);
+  }
+};
+
+// いのちのかけらの状態 (SoA)
+class KakeraStore {
+public:
+  static constexpr int CAPACITY = INOCHI_MAX_FRAGMENTS;
+
+  int count = 0;
+  VecR pos[CAPACITY];
+  VecR vec[CAPACITY];
+  real r[CAPACITY];
+  VecR prevPos[CAPACITY];
+  real prevR[CAPACITY];
+
+  int size() const { return count; }
+  bool full() const { return count >= CAPACITY; }
+
+  // r は呼び出し側で設定する
+  int add(VecR p) {
+    if (full()) return -1;
+    int i = count++;
+    pos[i] = p;
+    prevPos[i] = p;
+    return i;
+  }
+
+  void removeAt(int i) {
+    int last = --count;
+    if (i != last) {
+      pos[i] = pos[last];
+      vec[i] = vec[last];
+      r[i] = r[last];
+      prevPos[i] = prevPos[last];
+      prevR[i] = prevR[last];
+    }
+  }
+
+  void savePrevious() {
+    for (int i = 0; i < count; i++) {
+      prevPos[i] = pos[i];
+      prevR[i] = r[i];
+    }
+  }
+};
+
+// 減衰の底の log2。固定小数点では底 (特に 0.0000015) が 0 に丸まるので、指数の側で計算する
+static const real LOG2_POS_DAMP = -9.117787;    // log2(0.0018)
+static const real LOG2_SIZE_DAMP = -19.346606;  // log2(0.0000015)
+
+// deltaMs だけで決まる係数。ステップ毎に全オブジェクトで共有する
+struct StepCoeffs {
+  real deltaMs = -1;     // 計算に使った deltaMs
+  real posDamp;          // 速度の減衰 pow(0.0018, deltaMs)
+  real sizeDamp;         // 大きさの変化の減衰 pow(0.0000015, deltaMs)
+  real frameScale;       // 60fps の 1 フレームに対する割合 60 * deltaMs
+  real fragmentShrink;   // かけらの半径の減少 3 * deltaMs
+};
 
 class Context {
 public:
-  int nextId = 1;
-  uint64_t nowMs;
+  uint64_t nowMs = 0;
   real deltaMs;
+  StepCoeffs coeffs;
+  // 描画する位置の、直前のステップから最新のステップまでの割合
+  real renderAlpha = 1;
   VecI screenSize;
-  
-  std::vector<Ball*> balls;
-  std::vector<InochiNoKakera*> fragments;
+
+  BallStore balls;
+  KakeraStore fragments;
   VecR touchDownPos;
   VecR touchMovePos;
   VecR touchMoveVel;
   bool touching = false;
   bool fragging = false;
-  int dragTargetBallId = -1;
+  Handle dragTarget;
+  int dragTargetIndex = -1;
+  bool useSpatialGrid = true;
+  SpatialGrid<INOCHI_MAX_BALLS> grid;
   HostAPI intf;
+  Random random;
+
+  real randR() { return random.nextFloat(); }
+  int randIndex(int n) { return random.nextIndex(n); }
 
   void getViewPort(VecR *origin, real *radius) {
     origin->x = (real)screenSize.x / 2;
@@ -81,228 +250,336 @@ public:
     getViewPort(&viewOrigin, &viewRadius);
     return (((VecR)pos) - viewOrigin) * VIEW_RADIUS / viewRadius;
   }
-    
+
+  VecI worldToScreen(VecR pos) {
+    VecR viewOrigin;
+    real viewRadius;
+    getViewPort(&viewOrigin, &viewRadius);
+    return (pos * viewRadius / VIEW_RADIUS + viewOrigin).roundToInt();
+  }
+
+  // deltaMs が変わったときだけ計算し直す
+  void updateCoeffs() {
+    if (coeffs.deltaMs == deltaMs) return;
+    coeffs.deltaMs = deltaMs;
+    coeffs.posDamp = exp2R(deltaMs * LOG2_POS_DAMP);
+    coeffs.sizeDamp = exp2R(deltaMs * LOG2_SIZE_DAMP);
+    coeffs.frameScale = 60 * deltaMs;
+    coeffs.fragmentShrink = 3 * deltaMs;
+  }
+
+  static VecR lerp(VecR a, VecR b, real t) { return a + (b - a) * t; }
+  static real lerp(real a, real b, real t) { return a + (b - a) * t; }
+
   void fillCircle(VecR pos, real r, Palette col) {
     VecR viewOrigin;
     real viewRadius;
     getViewPort(&viewOrigin, &viewRadius);
-    VecI posInt = (pos * viewRadius / VIEW_RADIUS + viewOrigin).roundToInt();
-    int rInt = min(viewRadius / 2, max(1, r * viewRadius / VIEW_RADIUS));
+    VecI posInt = worldToScreen(pos);
+    int rInt = (int)min(viewRadius / 2, max(1, r * viewRadius / VIEW_RADIUS));
     intf.drawCircle(posInt, rInt, col);
   }
 
 };
 
+// ctx.fragments に対する処理
 class InochiNoKakera {
 public:
-  VecR pos;
-  VecR vec;
-  real r;
-
-  InochiNoKakera(VecR pos) : pos(pos) {
-    vec.x = 1.0 * (randR() - 0.5);
-    vec.y = 1.0 * (randR() - 0.5);
-    r = 1.0;
+  static void spawn(Context &ctx, VecR pos) {
+    KakeraStore &k = ctx.fragments;
+    int i = k.add(pos);
+    if (i < 0) return;
+    k.vec[i].x = 1.0 * (ctx.randR() - 0.5);
+    k.vec[i].y = 1.0 * (ctx.randR() - 0.5);
+    k.r[i] = 1.0;
+    k.prevR[i] = 1.0;
   }
 
-  void move(Context &ctx) {
-    real aCoeff = pow(0.0018, ctx.deltaMs);
-    real vCoeff = 60 * ctx.deltaMs;
-    vec *= aCoeff;
-    pos += vec * vCoeff;
-    r -= 3 * ctx.deltaMs;
+  static void moveAll(Context &ctx) {
+    KakeraStore &k = ctx.fragments;
+    real aCoeff = ctx.coeffs.posDamp;
+    real vCoeff = ctx.coeffs.frameScale;
+    real rDecr = ctx.coeffs.fragmentShrink;
+    int n = k.size();
+    for (int i = 0; i < n; i++) {
+      k.vec[i] *= aCoeff;
+      k.pos[i] += k.vec[i] * vCoeff;
+      k.r[i] -= rDecr;
+    }
   }
 
-  void kagayaku(Context &ctx) {
+  static void kagayaku(Context &ctx, int i) {
+    KakeraStore &k = ctx.fragments;
+    real r = Context::lerp(k.prevR[i], k.r[i], ctx.renderAlpha);
     if (r > 0.0) {
-      ctx.fillCircle(pos, r, Palette::RED);
+      ctx.fillCircle(Context::lerp(k.prevPos[i], k.pos[i], ctx.renderAlpha), r, Palette::RED);
     }
   }
 };
-  
+
+// ctx.balls に対する処理
 class Ball {
 public:
-  const int id;
-  VecR bodyPos;
-  real bodySize = 0;
-  VecR bodyPosVel;
-  real bodySizeVel = 0;
-  real orbitGoal = CIRCLE_RADIUS;
-  real bodySizeGoal = 1;
-  bool eyeOpened = false;
-  VecR eyePos;
-  VecR eyePosGoal;
-  VecR irisPos;
-  VecR irisPosGoal;
-  bool alive = true;
-
+  // 探索中は距離の 2 乗で比べ、平方根は見つかったものにだけ求める
   struct Nearest {
-    Ball *ball = nullptr;
+    int index = -1;
     VecR vec;
+    real dist2 = 1e10;
     real dist = 1e10;
   };
 
-  Ball(Context &ctx, VecR pos) : id(ctx.nextId++), bodyPos(pos) {
-    bounce();
+  static void finishNearest(Nearest *nearest, int nearCount) {
+    for (int k = 0; k < nearCount; k++) {
+      nearest[k].dist = sqrtR(nearest[k].dist2);
+    }
+  }
+
+  static int spawn(Context &ctx, VecR pos) {
+    int i = ctx.balls.add(pos);
+    if (i >= 0) bounce(ctx, i);
+    return i;
   }
 
-  void interact(Context &ctx) {
-    if (!alive) return;
-    if (ctx.dragTargetBallId == id) return;
-    
+  static void interact(Context &ctx, int i) {
+    BallStore &b = ctx.balls;
+    if (!b.alive[i]) return;
+    if (ctx.dragTargetIndex == i) return;
+
     Nearest nearest[2];
+    int nearCount = ctx.useSpatialGrid ?
+      findNearestByGrid(ctx, i, nearest) :
+      findNearestBruteForce(ctx, i, nearest);
+
+    for (int k = 0; k < nearCount; k++) {
+      Nearest &near = nearest[k];
+      real d = near.dist;
+      if (d < 0.3) {
+        kill(ctx, i);
+        if (near.index != ctx.dragTargetIndex) {
+          kill(ctx, near.index);
+        }
+        continue;
+      }
+      real dd = d * d;
+      real ddd = dd * d;
+      real vCoeff = ctx.coeffs.frameScale;
+      b.bodyPosVel[i] += (near.vec * 0.08 / dd - near.vec * 0.15 / ddd) * vCoeff;
+    }
+  }
+
+  static int findNearestBruteForce(Context &ctx, int i, Nearest *nearest) {
+    BallStore &b = ctx.balls;
+    VecR bodyPos = b.bodyPos[i];
     int nearCount = 0;
+    int n = b.size();
 
-    for (Ball *ball : ctx.balls) {
-      if (ball->id == id) continue;
-      if (!ball->alive) continue;
+    for (int j = 0; j < n; j++) {
+      if (j == i) continue;
+      if (!b.alive[j]) continue;
 
-      VecR vec = ball->bodyPos - bodyPos;
-      real dist = vec.abs();
+      VecR vec = b.bodyPos[j] - bodyPos;
+      real dist2 = vec.absPow2();
 
-      if (dist < nearest[0].dist) {
+      if (dist2 < nearest[0].dist2) {
         nearest[1] = nearest[0];
-        nearest[0].ball = ball;
+        nearest[0].index = j;
         nearest[0].vec = vec;
-        nearest[0].dist = dist;
+        nearest[0].dist2 = dist2;
         nearCount += 1;
         if (nearCount > 2) nearCount = 2;
       }
-      else if (dist < nearest[1].dist) {
-        nearest[1].ball = ball;
+      else if (dist2 < nearest[1].dist2) {
+        nearest[1].index = j;
         nearest[1].vec = vec;
-        nearest[1].dist = dist;
+        nearest[1].dist2 = dist2;
         nearCount += 1;
         if (nearCount > 2) nearCount = 2;
       }
     }
-    
-    for (int i = 0; i < nearCount; i++) {
-      Nearest &near = nearest[i];
-      real d = nearest[i].dist;
-      if (d < 0.3) {
-        kill(ctx);
-        if (near.ball->id != ctx.dragTargetBallId) {
-          near.ball->kill(ctx);
-        }
-        continue;
+    finishNearest(nearest, nearCount);
+    return nearCount;
+  }
+
+  // 総当たりと同じ結果になるよう、距離が同じ場合はインデックスが小さいものを優先する
+  static int findNearestByGrid(Context &ctx, int i, Nearest *nearest) {
+    BallStore &b = ctx.balls;
+    VecR bodyPos = b.bodyPos[i];
+    int nearCount = 0;
+
+    auto visit = [&](int j) {
+      if (j == i) return;
+      if (!b.alive[j]) return;
+
+      VecR vec = b.bodyPos[j] - bodyPos;
+      real dist2 = vec.absPow2();
+
+      auto before = [&](const Nearest &near) {
+        return dist2 < near.dist2 || (dist2 == near.dist2 && j < near.index);
+      };
+      if (before(nearest[0])) {
+        nearest[1] = nearest[0];
+        nearest[0].index = j;
+        nearest[0].vec = vec;
+        nearest[0].dist2 = dist2;
       }
-      real dd = d * d;
-      real ddd = dd * d;
-      real vCoeff = 60 * ctx.deltaMs;
-      this->bodyPosVel += (near.vec * 0.08 / dd - near.vec * 0.15 / ddd) * vCoeff;
-    }
+      else if (before(nearest[1])) {
+        nearest[1].index = j;
+        nearest[1].vec = vec;
+        nearest[1].dist2 = dist2;
+      }
+      if (nearCount < 2) nearCount++;
+    };
+    auto done = [&](real minDist) {
+      return nearCount >= 2 && minDist > 0 && nearest[1].dist2 < minDist * minDist;
+    };
+    ctx.grid.search(bodyPos, visit, done);
+    finishNearest(nearest, nearCount);
+    return nearCount;
   }
-  
-  void move(Context &ctx) {
-    if (!alive) return;
-    if (ctx.dragTargetBallId == id) {
+
+  static void move(Context &ctx, int i) {
+    BallStore &b = ctx.balls;
+    if (!b.alive[i]) return;
+    VecR &bodyPos = b.bodyPos[i];
+    VecR &bodyPosVel = b.bodyPosVel[i];
+    real &bodySize = b.bodySize[i];
+    real &bodySizeVel = b.bodySizeVel[i];
+    if (ctx.dragTargetIndex == i) {
       bodyPos = ctx.touchMovePos;
       bodyPosVel = ctx.touchMoveVel;
       return;
     }
     else {
       {
-        real posAcc = pow(0.0018, ctx.deltaMs);
-        real sizeAcc = pow(0.0000015, ctx.deltaMs);
-        bodyPosVel *= posAcc;
-        bodySizeVel *= sizeAcc;
+        bodyPosVel *= ctx.coeffs.posDamp;
+        bodySizeVel *= ctx.coeffs.sizeDamp;
       }
       {
         real orbit = max(0.001, bodyPos.abs());
-        real orbitErr = orbitGoal - orbit;
+        real orbitErr = b.orbitGoal[i] - orbit;
         real orbitAcc = 0.3 * sign(orbitErr) * orbitErr * orbitErr;
         VecR bodyAcc = bodyPos * orbitAcc / orbit;
-        real sizeAcc = (bodySizeGoal - bodySize) * 0.2;
-        real accCoeff = 60 * ctx.deltaMs;
+        real sizeAcc = (b.bodySizeGoal[i] - bodySize) * 0.2;
+        real accCoeff = ctx.coeffs.frameScale;
         bodyPosVel += bodyAcc * accCoeff;
         bodySizeVel += sizeAcc * accCoeff;
       }
     }
-    
+
     const real MAX_VEL = 0.5;
     real absVel = bodyPosVel.abs();
     if (absVel > MAX_VEL) {
-      real velCoeff = pow(MAX_VEL / absVel, 60 * ctx.deltaMs);
+      real velCoeff = powR(MAX_VEL / absVel, ctx.coeffs.frameScale);
       bodyPosVel *= velCoeff;
     }
-    
+
     {
-      real velCoeff = 60 * ctx.deltaMs;
+      real velCoeff = ctx.coeffs.frameScale;
       bodyPos += bodyPosVel * velCoeff;
       bodySize += bodySizeVel * velCoeff;
     }
-    
+
     {
       real a = 0.1;
-      eyePos = (eyePos * (1.0 - a)) + ((eyePosGoal - eyePos) * a);
-      irisPos = (irisPos * (1.0 - a)) + ((irisPosGoal - irisPos) * a);
-    }
-  }
-  
-  void bounce(real eyeRatio = 0.5) {
-    if (!alive) return;
-    bodyPosVel.x = 0.5 * (randR() - 0.5);
-    bodyPosVel.y = 0.5 * (randR() - 0.5);
-    bodySizeVel = 0.5 * randR();
-    bodySizeGoal = 1.0 + 0.5 * randR();
-    orbitGoal = CIRCLE_RADIUS + 1.2 * (randR() - 0.5);
-    eyeOpened = randR() < eyeRatio;
-    eyePosGoal.x = 0.8 * (randR() - 0.5);
-    eyePosGoal.y = 0.8 * (randR() - 0.5);
-  }
-  
-  void startSaccade() {
-    if (!alive) return;
-    irisPosGoal.x = 0.8 * (randR() - 0.5);
-    irisPosGoal.y = 0.8 * (randR() - 0.5);
-  }
-  
-  void paintBody(Context &ctx) {
-    if (!alive) return;
+      VecR &eyePos = b.eyePos[i];
+      VecR &irisPos = b.irisPos[i];
+      eyePos = (eyePos * (1.0 - a)) + ((b.eyePosGoal[i] - eyePos) * a);
+      irisPos = (irisPos * (1.0 - a)) + ((b.irisPosGoal[i] - irisPos) * a);
+    }
+  }
+
+  static void bounce(Context &ctx, int i, real eyeRatio = 0.5) {
+    BallStore &b = ctx.balls;
+    if (!b.alive[i]) return;
+    b.bodyPosVel[i].x = 0.5 * (ctx.randR() - 0.5);
+    b.bodyPosVel[i].y = 0.5 * (ctx.randR() - 0.5);
+    b.bodySizeVel[i] = 0.5 * ctx.randR();
+    b.bodySizeGoal[i] = 1.0 + 0.5 * ctx.randR();
+    b.orbitGoal[i] = CIRCLE_RADIUS + 1.2 * (ctx.randR() - 0.5);
+    b.eyeOpened[i] = ctx.randR() < eyeRatio;
+    b.eyePosGoal[i].x = 0.8 * (ctx.randR() - 0.5);
+    b.eyePosGoal[i].y = 0.8 * (ctx.randR() - 0.5);
+  }
+
+  static void startSaccade(Context &ctx, int i) {
+    BallStore &b = ctx.balls;
+    if (!b.alive[i]) return;
+    b.irisPosGoal[i].x = 0.8 * (ctx.randR() - 0.5);
+    b.irisPosGoal[i].y = 0.8 * (ctx.randR() - 0.5);
+  }
+
+  static void paintBody(Context &ctx, int i) {
+    BallStore &b = ctx.balls;
+    if (!b.alive[i]) return;
+    real bodySize = Context::lerp(b.prevBodySize[i], b.bodySize[i], ctx.renderAlpha);
     if (bodySize <= 0.0) return;
-    ctx.fillCircle(bodyPos, bodySize, Palette::RED);
+    ctx.fillCircle(Context::lerp(b.prevBodyPos[i], b.bodyPos[i], ctx.renderAlpha), bodySize, Palette::RED);
   }
-  
-  void paintEye(Context &ctx) {
-    if (!alive) return;
+
+  static void paintEye(Context &ctx, int i) {
+    BallStore &b = ctx.balls;
+    if (!b.alive[i]) return;
+    real bodySize = Context::lerp(b.prevBodySize[i], b.bodySize[i], ctx.renderAlpha);
     if (bodySize <= 0.0) return;
-    if (!eyeOpened) return;
-    VecR pos = this->bodyPos;
-    pos += eyePos * bodySize;
+    if (!b.eyeOpened[i]) return;
+    VecR pos = Context::lerp(b.prevBodyPos[i], b.bodyPos[i], ctx.renderAlpha);
+    pos += b.eyePos[i] * bodySize;
     ctx.fillCircle(pos, bodySize * 0.5, Palette::WHITE);
-    pos += irisPos * bodySize * 1.25;
+    pos += b.irisPos[i] * bodySize * 1.25;
     ctx.fillCircle(pos, bodySize * 0.2, Palette::BLUE);
   }
-  
-  void kill(Context &ctx) {
-    alive = false;
-    for (int i = 0; i < 8; i++) {
-      ctx.fragments.push_back(new InochiNoKakera(bodyPos));
+
+  static void kill(Context &ctx, int i) {
+    ctx.balls.alive[i] = false;
+    for (int k = 0; k < NUM_FRAGMENTS_PER_KILL; k++) {
+      InochiNoKakera::spawn(ctx, ctx.balls.bodyPos[i]);
     }
   }
 };
 
 class World {
 public:
+  static constexpr int64_t STEP_US = INOCHI_STEP_US;
+  static constexpr int MAX_STEPS_PER_UPDATE = INOCHI_MAX_STEPS_PER_UPDATE;
+  // 時刻はミリ秒単位なので、ステップの周期に 1ms 足りなくてもステップを進める
+  static constexpr int64_t STEP_SNAP_US = 1000;
+  // 1 ステップの秒数。固定小数点では 1000000 を表せないので、double で割ってから real にする
+  static inline const real STEP_SEC = (real)(STEP_US / 1e6);
+
+  struct StepStats {
+    uint64_t updates = 0;
+    uint64_t steps = 0;
+    int maxSteps = 0;
+    uint64_t droppedUs = 0;  // 追いつけずに捨てた時間
+  };
+
   int paintIndex = 0;
   Context ctx;
+  StepStats stepStats;
 
-  void init(HostAPI &intf) {
+  // 同じ seed と同じ入力 (時刻とタッチ) からは同じ結果になる
+  void init(HostAPI &intf, uint32_t seed = 1) {
     ctx.intf = intf;
+    ctx.random.seed(seed);
     ctx.screenSize = ctx.intf.getScreenSize();
 
     for (int i = 0; i < NUM_INITIAL_BALLS; i++) {
-      real a = 2 * M_PI * i / NUM_INITIAL_BALLS;
-      ctx.balls.push_back(new Ball(ctx, VecR(CIRCLE_RADIUS * cos(a), CIRCLE_RADIUS * sin(a))));
+      real t = (real)i / NUM_INITIAL_BALLS;
+      Ball::spawn(ctx, VecR(CIRCLE_RADIUS * cosTurnR(t), CIRCLE_RADIUS * sinTurnR(t)));
     }
   }
 
+  // 経過時間を固定ステップで進める。描画はステップ間を補間する
   void update() {
     uint64_t lastMs = ctx.nowMs;
     ctx.nowMs = ctx.intf.getTimeMs();
-    ctx.deltaMs = (real)(ctx.nowMs - lastMs) / 1000;
-    
+    int64_t elapsedUs = clockStarted ? (int64_t)(ctx.nowMs - lastMs) * 1000 : STEP_US;
+    clockStarted = true;
+
+    if (ctx.useSpatialGrid) {
+      rebuildGrid();
+    }
+
     bool lastTouched = ctx.touching;
     VecR lastMovePos = ctx.touchMovePos;
     TouchState touch;
@@ -312,118 +589,213 @@ public:
     ctx.touching = touch.touched;
     if (ctx.touching && !lastTouched) {
       ctx.touchDownPos = ctx.touchMovePos;
-      ctx.dragTargetBallId = findByWorldPos(ctx.touchDownPos);
+      ctx.dragTarget = findByWorldPos(ctx.touchDownPos);
     }
     else if (!ctx.touching && lastTouched) {
       VecR d = ctx.touchMovePos - ctx.touchDownPos;
       real dManhattan = abs(d.x) + abs(d.y);
       if (dManhattan < VIEW_RADIUS / 10) {
-        if (ctx.dragTargetBallId >= 0) {
-          Ball *ball = findById(ctx.dragTargetBallId);
-          if (ball) ball->kill(ctx);
+        if (ctx.dragTarget.valid()) {
+          int i = ctx.balls.indexOf(ctx.dragTarget);
+          if (i >= 0) Ball::kill(ctx, i);
         }
         else {
-          ctx.balls.push_back(new Ball(ctx, ctx.touchMovePos));
+          Ball::spawn(ctx, ctx.touchMovePos);
         }
       }
-      ctx.dragTargetBallId = -1;
+      ctx.dragTarget = Handle();
+    }
+
+    stepAccumUs += elapsedUs;
+    int numSteps = 0;
+    while (stepAccumUs + STEP_SNAP_US >= STEP_US) {
+      if (numSteps >= MAX_STEPS_PER_UPDATE) {
+        stepStats.droppedUs += stepAccumUs;
+        stepAccumUs = 0;
+        break;
+      }
+      step();
+      stepAccumUs -= STEP_US;
+      numSteps++;
     }
+    real alpha = (real)(stepAccumUs > 0 ? stepAccumUs : 0) / STEP_US;
+    ctx.renderAlpha = alpha < 1 ? alpha : 1;
+
+    stepStats.updates++;
+    stepStats.steps += numSteps;
+    if (numSteps > stepStats.maxSteps) stepStats.maxSteps = numSteps;
+
+    paintIndex = 0;
+  }
+
+  // 固定ステップ 1 回分。乱数で起きる出来事もステップ毎に決める
+  void step() {
+    ctx.deltaMs = STEP_SEC;
+    ctx.balls.savePrevious();
+    ctx.fragments.savePrevious();
 
     if (ctx.balls.size() < NUM_INITIAL_BALLS) {
-      if (randR() < 0.01) {
-        real a = 2 * M_PI * randR();
-        ctx.balls.push_back(new Ball(ctx, VecR(2 * VIEW_RADIUS * cos(a), 2 * VIEW_RADIUS * sin(a))));
+      if (ctx.randR() < 0.01) {
+        real t = ctx.randR();
+        Ball::spawn(ctx, VecR(2 * VIEW_RADIUS * cosTurnR(t), 2 * VIEW_RADIUS * sinTurnR(t)));
       }
     }
-      
+
     int numInochis = ctx.balls.size();
     if (numInochis > 0) {
       int numOpenEye = 0;
-      for(auto ball : ctx.balls) {
-        if (ball->eyeOpened) numOpenEye++;
+      for (int i = 0; i < numInochis; i++) {
+        if (ctx.balls.eyeOpened[i]) numOpenEye++;
       }
-      if (randR() < 0.005 * numInochis) {
-        int i = floor(randR() * (int)ctx.balls.size());
-        ctx.balls[i]->bounce(numOpenEye < 0.3 * numInochis ? 0.8 : 0.2);
+      if (ctx.randR() < 0.005 * numInochis) {
+        int i = ctx.randIndex(numInochis);
+        Ball::bounce(ctx, i, numOpenEye < 0.3 * numInochis ? 0.8 : 0.2);
       }
-      if (randR() < 0.01 * numInochis) {
-        int i = floor(randR() * numInochis);
-        ctx.balls[i]->startSaccade();
+      if (ctx.randR() < 0.01 * numInochis) {
+        int i = ctx.randIndex(numInochis);
+        Ball::startSaccade(ctx, i);
       }
     }
-    
-    for(auto ball : ctx.balls) {
-      ball->interact(ctx);
-      ball->move(ctx);
+
+    simulate();
+  }
+
+  void simulate() {
+    if (ctx.useSpatialGrid && ctx.grid.size() != ctx.balls.size()) {
+      rebuildGrid();
     }
-    
-    for(auto kakera : ctx.fragments) {
-      kakera->move(ctx);
+    ctx.dragTargetIndex = ctx.balls.indexOf(ctx.dragTarget);
+    ctx.updateCoeffs();
+
+    BallStore &b = ctx.balls;
+    int n = b.size();
+    for (int i = 0; i < n; i++) {
+      Ball::interact(ctx, i);
+      Ball::move(ctx, i);
+      if (ctx.useSpatialGrid) {
+        ctx.grid.noteMoved(i, b.bodyPos[i], b.bodySize[i]);
+      }
     }
-    
-    paintIndex = 0;
+
+    InochiNoKakera::moveAll(ctx);
   }
 
-  void servicePaint() {
+  // 時刻を見る間隔 (描くオブジェクト数)
+  static constexpr int PAINT_CHECK_INTERVAL = 16;
+
+  // budgetUs の間にできるだけ多くのオブジェクトを描く。
+  // 描き終わるまでインデックスは動かさず、死んだオブジェクトは描き終えてからまとめて取り除く
+  void servicePaint(uint32_t budgetUs = INOCHI_PAINT_BUDGET_US) {
     if (idle()) return;
-    
+
     if (paintIndex == 0) {
       ctx.intf.clearScreen();
     }
 
-    int n = ctx.balls.size();
+    int end = paintEnd();
+    uint64_t deadlineUs = budgetUs ? ctx.intf.getTimeUs() + budgetUs : 0;
+    while (paintIndex < end) {
+      int stop = end;
+      if (budgetUs && end - paintIndex > PAINT_CHECK_INTERVAL) {
+        stop = paintIndex + PAINT_CHECK_INTERVAL;
+      }
+      paintRange(paintIndex, stop);
+      paintIndex = stop;
+      if (budgetUs && ctx.intf.getTimeUs() >= deadlineUs) break;
+    }
+
+    if (paintIndex >= end) {
+      removeDeadObjects();
+      paintIndex = paintEnd();
+    }
+  }
 
-    if (paintIndex < n) {
-      ctx.balls[paintIndex]->paintBody(ctx);
+  // 描画順の [from, to) を描く (体、目、かけらの順)
+  void paintRange(int from, int to) {
+    int n = ctx.balls.size();
+    int i = from;
+    for (; i < to && i < n; i++) {
+      Ball::paintBody(ctx, i);
     }
-    else if (paintIndex < 2 * n) {
-      ctx.balls[paintIndex - n]->paintEye(ctx);
+    for (; i < to && i < 2 * n; i++) {
+      Ball::paintEye(ctx, i - n);
     }
-    else {
-      ctx.fragments[paintIndex - 2 * n]->kagayaku(ctx);
+    for (; i < to; i++) {
+      InochiNoKakera::kagayaku(ctx, i - 2 * n);
     }
+  }
 
-    for (int i = 0; i < (int)ctx.balls.size(); ) {
-      if (ctx.balls[i]->alive) i++;
-      else {
-        delete ctx.balls[i];
-        ctx.balls.erase(ctx.balls.begin() + i);
-      }
+  int paintEnd() const {
+    return ctx.balls.size() * 2 + ctx.fragments.size();
+  }
+
+  // 末尾との入れ替えで詰める
+  void removeDeadObjects() {
+    for (int i = 0; i < ctx.balls.size(); ) {
+      if (ctx.balls.alive[i]) i++;
+      else ctx.balls.removeAt(i);
     }
-    
-    for (int i = 0; i < (int)ctx.fragments.size(); ) {
-      if (ctx.fragments[i]->r > 0.0) i++;
-      else {
-        delete ctx.fragments[i];
-        ctx.fragments.erase(ctx.fragments.begin() + i);
-      }
+
+    for (int i = 0; i < ctx.fragments.size(); ) {
+      if (ctx.fragments.r[i] > 0.0) i++;
+      else ctx.fragments.removeAt(i);
     }
-    
-    paintIndex += 1;
   }
 
-  int findByWorldPos(VecR pos) {
-    for (Ball *ball : ctx.balls) {
-      real dd = (ball->bodyPos - pos).absPow2();
-      if (dd < ball->bodySize * ball->bodySize) {
-        return ball->id;
+  void rebuildGrid() {
+    ctx.grid.rebuild(
+      ctx.balls.size(),
+      [&](int i) { return ctx.balls.bodyPos[i]; },
+      [&](int i) { return ctx.balls.bodySize[i]; });
+  }
+
+  // ドラッグしているいのちを描く画面上の範囲 (目も含む外接円)。ドラッグしていなければ false
+  bool getDragFocus(VecI *pos, int *r) {
+    BallStore &b = ctx.balls;
+    int i = b.indexOf(ctx.dragTarget);
+    if (i < 0 || !b.alive[i]) return false;
+    real bodySize = Context::lerp(b.prevBodySize[i], b.bodySize[i], ctx.renderAlpha);
+    VecR viewOrigin;
+    real viewRadius;
+    ctx.getViewPort(&viewOrigin, &viewRadius);
+    // 目と瞳は体の中心から体の大きさの 1.5 倍以内に収まる
+    *pos = ctx.worldToScreen(Context::lerp(b.prevBodyPos[i], b.bodyPos[i], ctx.renderAlpha));
+    *r = bodySize > 0 ? (int)(bodySize * 1.5 * viewRadius / VIEW_RADIUS) + 2 : 0;
+    return true;
+  }
+
+  Handle findByWorldPos(VecR pos) {
+    if (!ctx.useSpatialGrid) return findByWorldPosBruteForce(pos);
+    BallStore &b = ctx.balls;
+    int found = -1;
+    ctx.grid.queryPoint(pos, [&](int i) {
+      if (found >= 0 && found < i) return;
+      real dd = (b.bodyPos[i] - pos).absPow2();
+      if (dd < b.bodySize[i] * b.bodySize[i]) {
+        found = i;
       }
-    }
-    return -1;
+    });
+    return found >= 0 ? b.handleAt(found) : Handle();
   }
-  
-  Ball *findById(int id) {
-    for (Ball *ball : ctx.balls) {
-      if (ball->id == id) return ball;
+
+  Handle findByWorldPosBruteForce(VecR pos) {
+    BallStore &b = ctx.balls;
+    for (int i = 0; i < b.size(); i++) {
+      real dd = (b.bodyPos[i] - pos).absPow2();
+      if (dd < b.bodySize[i] * b.bodySize[i]) {
+        return b.handleAt(i);
+      }
     }
-    return nullptr;
+    return Handle();
   }
-  
+
   bool idle() {
-    int n = (int)(ctx.balls.size()) * 2 + (int)(ctx.fragments.size());
-    return paintIndex >= n;
+    return paintIndex >= paintEnd();
   }
 
+private:
+  bool clockStarted = false;
+  int64_t stepAccumUs = 0;
 };
 
 }
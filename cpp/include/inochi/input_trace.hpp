@@ -0,0 +1,172 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "inochi/inochi.hpp"
+
+namespace shapoco::inochi {
+
+// World::update() 毎の入力 (getTimeMs() の値とタッチの状態) と乱数のシードの記録
+// 同じビルドで再生すれば同じ状態になるので、ビルド間で処理時間を比べられる
+//
+// ファイルの形式 (整数はリトルエンディアン、varint は 7 ビットずつ下位から)
+//   "INTR" version:u8 seed:u32 extraBalls:u32 numFrames:u32
+//   フレーム毎に
+//     varint 前のフレームからの時刻の差 [ms]
+//     flags:u8 (bit0: タッチ中、bit1: 位置が変わった)
+//     bit1 のとき zigzag varint で位置の差 (x, y)
+//   stateHash:u32 (再生の終わりに比べる World の状態。0 なら比べない)
+struct TraceFrame {
+  uint64_t timeMs;
+  TouchState touch;
+};
+
+class InputTrace {
+public:
+  static constexpr uint8_t VERSION = 1;
+
+  uint32_t seed = 1;
+  // init() の後に追加したいのちの数 (乱数で置くので再生でも同じ数を置く)
+  uint32_t extraBalls = 0;
+  std::vector<TraceFrame> frames;
+  uint32_t stateHash = 0;
+
+  void add(uint64_t timeMs, const TouchState &touch) {
+    frames.push_back(TraceFrame{timeMs, touch});
+  }
+
+  void encode(std::vector<uint8_t> &buff) const {
+    buff.insert(buff.end(), {'I', 'N', 'T', 'R', VERSION});
+    putU32(buff, seed);
+    putU32(buff, extraBalls);
+    putU32(buff, frames.size());
+    uint64_t lastTimeMs = 0;
+    VecI lastPos{0, 0};
+    for (const TraceFrame &f : frames) {
+      putVarint(buff, f.timeMs - lastTimeMs);
+      bool moved = f.touch.pos.x != lastPos.x || f.touch.pos.y != lastPos.y;
+      buff.push_back((f.touch.touched ? 1 : 0) | (moved ? 2 : 0));
+      if (moved) {
+        putVarint(buff, zigzag(f.touch.pos.x - lastPos.x));
+        putVarint(buff, zigzag(f.touch.pos.y - lastPos.y));
+      }
+      lastTimeMs = f.timeMs;
+      lastPos = f.touch.pos;
+    }
+    putU32(buff, stateHash);
+  }
+
+  bool save(const char *path) const {
+    std::vector<uint8_t> buff;
+    encode(buff);
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return false;
+    bool ok = fwrite(buff.data(), 1, buff.size(), fp) == buff.size();
+    return fclose(fp) == 0 && ok;
+  }
+
+  bool load(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return false;
+    std::vector<uint8_t> buff;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) buff.insert(buff.end(), chunk, chunk + n);
+    fclose(fp);
+
+    Reader r{buff.data(), buff.data() + buff.size()};
+    uint8_t magic[5];
+    for (uint8_t &b : magic) b = r.u8();
+    if (magic[0] != 'I' || magic[1] != 'N' || magic[2] != 'T' || magic[3] != 'R' || magic[4] != VERSION) return false;
+    seed = r.u32();
+    extraBalls = r.u32();
+    uint32_t numFrames = r.u32();
+    frames.clear();
+    uint64_t timeMs = 0;
+    VecI pos{0, 0};
+    for (uint32_t i = 0; i < numFrames && r.ok; i++) {
+      timeMs += r.varint();
+      uint8_t flags = r.u8();
+      if (flags & 2) {
+        pos.x += unzigzag(r.varint());
+        pos.y += unzigzag(r.varint());
+      }
+      TouchState touch;
+      touch.pos = pos;
+      touch.touched = (flags & 1) != 0;
+      add(timeMs, touch);
+    }
+    stateHash = r.u32();
+    return r.ok;
+  }
+
+private:
+  struct Reader {
+    const uint8_t *p;
+    const uint8_t *end;
+    bool ok = true;
+
+    uint8_t u8() {
+      if (p >= end) { ok = false; return 0; }
+      return *p++;
+    }
+    uint32_t u32() {
+      uint32_t v = 0;
+      for (int i = 0; i < 4; i++) v |= (uint32_t)u8() << (8 * i);
+      return v;
+    }
+    uint64_t varint() {
+      uint64_t v = 0;
+      for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b = u8();
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return v;
+      }
+      ok = false;
+      return v;
+    }
+  };
+
+  static uint32_t zigzag(int32_t v) { return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+  static int32_t unzigzag(uint64_t v) { return (int32_t)(v >> 1) ^ -(int32_t)(v & 1); }
+
+  static void putU32(std::vector<uint8_t> &buff, uint32_t v) {
+    for (int i = 0; i < 4; i++) buff.push_back(v >> (8 * i));
+  }
+
+  static void putVarint(std::vector<uint8_t> &buff, uint64_t v) {
+    while (v >= 0x80) {
+      buff.push_back((v & 0x7f) | 0x80);
+      v >>= 7;
+    }
+    buff.push_back(v);
+  }
+};
+
+// 再生の結果を比べるための World の状態のハッシュ (FNV-1a)
+// いのちとかけらの位置と大きさ、乱数の状態を含める
+static inline uint32_t hashWorldState(const Context &ctx) {
+  uint32_t h = 2166136261u;
+  auto mix = [&](const void *p, size_t n) {
+    const uint8_t *b = (const uint8_t *)p;
+    for (size_t i = 0; i < n; i++) h = (h ^ b[i]) * 16777619u;
+  };
+  const BallStore &b = ctx.balls;
+  for (int i = 0; i < b.size(); i++) {
+    uint32_t key = b.handleAt(i).key();
+    mix(&key, sizeof(key));
+    mix(&b.bodyPos[i], sizeof(VecR));
+    mix(&b.bodySize[i], sizeof(real));
+  }
+  const KakeraStore &k = ctx.fragments;
+  for (int i = 0; i < k.size(); i++) {
+    mix(&k.pos[i], sizeof(VecR));
+    mix(&k.r[i], sizeof(real));
+  }
+  mix(&ctx.random.state, sizeof(ctx.random.state));
+  return h;
+}
+
+}
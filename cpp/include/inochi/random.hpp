@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace shapoco::inochi {
+
+// xorshift32。乗算を使わないので Cortex-M0+ でも速い
+// 同じシードからは同じ系列になり、実行を記録して再生できる
+class Random {
+public:
+  uint32_t state = 1;
+
+  Random(uint32_t s = 1) { seed(s); }
+
+  // 近いシード同士の系列が似ないよう、シードを混ぜてから使う (状態は 0 以外)
+  void seed(uint32_t s) {
+    s ^= s >> 16;
+    s *= 0x7feb352d;
+    s ^= s >> 15;
+    s *= 0x846ca68b;
+    s ^= s >> 16;
+    state = s ? s : 0x9e3779b9;
+  }
+
+  uint32_t next() {
+    uint32_t x = state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    state = x;
+    return x;
+  }
+
+  // 0 以上 1 未満
+  float nextFloat() {
+    return (float)(next() >> 8) * (1.0f / 16777216);
+  }
+
+  // 0 以上 n 未満の整数 (n は 2^24 以下)。配列の添字にそのまま使える
+  int nextIndex(int n) {
+    return (int)(((uint64_t)(next() >> 8) * (uint32_t)n) >> 24);
+  }
+};
+
+}
@@ -1,8 +1,24 @@
-#pragma
+#pragma once
+
+// INOCHI_FIXED_POINT を 1 にすると real が固定小数点数になる
+#ifndef INOCHI_FIXED_POINT
+#define INOCHI_FIXED_POINT (0)
+#endif
+
+#ifndef INOCHI_FIXED_FRAC_BITS
+#define INOCHI_FIXED_FRAC_BITS (16)
+#endif
+
+#if INOCHI_FIXED_POINT
+#include "inochi/fixed.hpp"
+#endif
 
 namespace shapoco::inochi {
 
-// todo: 固定小数点化を試す
+#if INOCHI_FIXED_POINT
+using real = Fixed<INOCHI_FIXED_FRAC_BITS>;
+#else
 using real = float;
+#endif
 
 }
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace shapoco::inochi {
+
+// 世代付きハンドル。要素が削除されるとスロットの世代が進み、古いハンドルは無効になる
+struct Handle {
+  static constexpr uint16_t INVALID_SLOT = 0xffff;
+
+  uint16_t slot = INVALID_SLOT;
+  uint16_t gen = 0;
+
+  bool valid() const { return slot != INVALID_SLOT; }
+  uint32_t key() const { return (uint32_t)gen << 16 | slot; }
+  bool operator==(const Handle &h) const { return slot == h.slot && gen == h.gen; }
+  bool operator!=(const Handle &h) const { return !(*this == h); }
+};
+
+// 固定容量のスロットマップ
+// 要素は 0..size()-1 の密なインデックスに詰めて置き、削除は末尾との入れ替えで行う。
+// データ本体は呼び出し側が同じインデックスの配列 (SoA) で持つ
+template<int CAPACITY>
+class SlotMap {
+  static_assert(CAPACITY < Handle::INVALID_SLOT, "CAPACITY too large");
+
+  uint16_t denseOfSlot[CAPACITY] = {};
+  uint16_t slotOfDense[CAPACITY] = {};
+  uint16_t genOfSlot[CAPACITY] = {};
+  uint16_t freeSlots[CAPACITY] = {};
+  int numFree = 0;
+  int numSlotsUsed = 0;
+  int count = 0;
+
+public:
+  int size() const { return count; }
+  bool full() const { return count >= CAPACITY; }
+
+  // 末尾 (インデックス size()-1) に要素を追加する。満杯なら無効なハンドルを返す
+  Handle insert() {
+    if (full()) return Handle();
+    uint16_t slot = numFree > 0 ? freeSlots[--numFree] : numSlotsUsed++;
+    denseOfSlot[slot] = count;
+    slotOfDense[count] = slot;
+    count++;
+    return Handle{slot, genOfSlot[slot]};
+  }
+
+  int indexOf(Handle h) const {
+    if (!h.valid() || h.slot >= numSlotsUsed) return -1;
+    if (genOfSlot[h.slot] != h.gen) return -1;
+    return denseOfSlot[h.slot];
+  }
+
+  Handle handleAt(int i) const {
+    uint16_t slot = slotOfDense[i];
+    return Handle{slot, genOfSlot[slot]};
+  }
+
+  // インデックス i の要素を削除し、末尾の要素を i に移す。
+  // 呼び出し側もデータ配列に同じ移動を行うこと
+  void removeAt(int i) {
+    uint16_t slot = slotOfDense[i];
+    genOfSlot[slot]++;
+    freeSlots[numFree++] = slot;
+    int last = --count;
+    if (i != last) {
+      uint16_t lastSlot = slotOfDense[last];
+      slotOfDense[i] = lastSlot;
+      denseOfSlot[lastSlot] = i;
+    }
+  }
+};
+
+}
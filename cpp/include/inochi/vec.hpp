@@ -2,6 +2,7 @@
 
 #include <math.h>
 #include "real.hpp"
+#include "fast_math.hpp"
 
 namespace shapoco::inochi {
 
@@ -25,7 +26,7 @@ struct VecR {
   VecR& operator-=(const VecR &v) { x -= v.x; y -= v.y; return *this; }
   VecR& operator*=(real s) { x *= s; y *= s; return *this; }
   real absPow2() const { return  x * x + y * y; }
-  real abs() const { return sqrt(absPow2()); }
+  real abs() const { return sqrtR(absPow2()); }
   VecI roundToInt() const { return VecI{(int)round(x), (int)round(y)}; }
 };
 
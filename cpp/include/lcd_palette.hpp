@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdint.h>
+
+// LcdService のフレームバッファの色深度とパレット
+// BPP: 1 画素のビット数 (1/2/4/8)
+// RGB565: パレット番号毎の色 (LCD にそのまま送れるようにバイトスワップ済み)
+// BLACK/RED/BLUE/WHITE: アプリが使う色のパレット番号
+// BACKGROUND/FOREGROUND: 背景と文字の色
+
+namespace shapoco {
+
+static constexpr uint16_t rgb565(uint8_t r, uint8_t g, uint8_t b) {
+  uint16_t c = ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+  return (uint16_t)((c >> 8) | (c << 8));
+}
+
+// 白黒。赤と青も黒で描く
+struct Palette1bpp {
+  static constexpr int BPP = 1;
+  static constexpr uint8_t BLACK = 0;
+  static constexpr uint8_t WHITE = 1;
+  static constexpr uint8_t RED = BLACK;
+  static constexpr uint8_t BLUE = BLACK;
+  static constexpr uint8_t BACKGROUND = WHITE;
+  static constexpr uint8_t FOREGROUND = BLACK;
+  static constexpr uint16_t RGB565[1 << BPP] = {
+    rgb565(0, 0, 0),
+    rgb565(255, 255, 255),
+  };
+};
+
+struct Palette2bpp {
+  static constexpr int BPP = 2;
+  static constexpr uint8_t BLACK = 0;
+  static constexpr uint8_t RED = 1;
+  static constexpr uint8_t BLUE = 2;
+  static constexpr uint8_t WHITE = 3;
+  static constexpr uint8_t BACKGROUND = WHITE;
+  static constexpr uint8_t FOREGROUND = BLACK;
+  static constexpr uint16_t RGB565[1 << BPP] = {
+    rgb565(0, 0, 0),
+    rgb565(255, 0, 0),
+    rgb565(0, 0, 255),
+    rgb565(255, 255, 255),
+  };
+};
+
+// 先頭 4 色は Palette2bpp と同じ、残りはグレースケール
+struct Palette4bpp {
+  static constexpr int BPP = 4;
+  static constexpr uint8_t BLACK = 0;
+  static constexpr uint8_t RED = 1;
+  static constexpr uint8_t BLUE = 2;
+  static constexpr uint8_t WHITE = 3;
+  static constexpr uint8_t BACKGROUND = WHITE;
+  static constexpr uint8_t FOREGROUND = BLACK;
+  static constexpr uint16_t RGB565[1 << BPP] = {
+    rgb565(0, 0, 0),
+    rgb565(255, 0, 0),
+    rgb565(0, 0, 255),
+    rgb565(255, 255, 255),
+    rgb565(23, 23, 23),
+    rgb565(46, 46, 46),
+    rgb565(70, 70, 70),
+    rgb565(93, 93, 93),
+    rgb565(116, 116, 116),
+    rgb565(139, 139, 139),
+    rgb565(162, 162, 162),
+    rgb565(185, 185, 185),
+    rgb565(209, 209, 209),
+    rgb565(232, 232, 232),
+    rgb565(255, 128, 128),
+    rgb565(128, 128, 255),
+  };
+};
+
+// RGB332 (LovyanGFX の 8bpp スプライトと同じ)
+struct Rgb332Table {
+  uint16_t colors[256];
+  constexpr Rgb332Table() : colors() {
+    for (int i = 0; i < 256; i++) {
+      colors[i] = rgb565(
+        ((i >> 5) & 7) * 255 / 7,
+        ((i >> 2) & 7) * 255 / 7,
+        (i & 3) * 255 / 3);
+    }
+  }
+};
+static constexpr Rgb332Table RGB332_TABLE{};
+
+struct Palette8bpp {
+  static constexpr int BPP = 8;
+  static constexpr uint8_t BLACK = 0x00;
+  static constexpr uint8_t RED = 0xe0;
+  static constexpr uint8_t BLUE = 0x03;
+  static constexpr uint8_t WHITE = 0xff;
+  static constexpr uint8_t BACKGROUND = WHITE;
+  static constexpr uint8_t FOREGROUND = BLACK;
+  static constexpr const uint16_t *RGB565 = RGB332_TABLE.colors;
+};
+
+}
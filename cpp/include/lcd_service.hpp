@@ -1,188 +1,803 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <utility>
 
+#ifdef SHAPOPAD_HOST
+#include "lgfx_host.hpp"
+#else
 #include "lgfx_ili9488.hpp"
+#endif
+
+#include "dirty_region.hpp"
+#include "frame_pipeline.hpp"
+#include "circle_stamp.hpp"
+#include "display_list.hpp"
+#include "frame_hud.hpp"
+#include "lcd_palette.hpp"
+#include "packed_raster.hpp"
+#include "perf_trace.hpp"
+#include "scan_focus.hpp"
+#include "scan_kernel.hpp"
+#include "tile_binner.hpp"
+
+// 円の描画に LGFX_Sprite を使わず、パックされた形式に直接描く
+#ifndef LCD_NATIVE_RASTER
+#define LCD_NATIVE_RASTER (1)
+#endif
+
+// 半径毎に前もって求めた行マスクで円を描く (LCD_NATIVE_RASTER のときのみ)
+#ifndef LCD_STAMP_CACHE
+#define LCD_STAMP_CACHE (1)
+#endif
+
+// 前回そのバッファに描いた内容を覚えておき、変わった所だけを描き直す
+#ifndef LCD_RETAINED
+#define LCD_RETAINED (1)
+#endif
+
+// パネルの内容を写したバッファ (buffers[SHADOW_INDEX]) の代わりに区間毎のハッシュを持つ
+#ifndef LCD_HASH_SHADOW
+#define LCD_HASH_SHADOW (0)
+#endif
+
+#ifndef LCD_DISPLAY_LIST_CAPACITY
+#define LCD_DISPLAY_LIST_CAPACITY (2048)
+#endif
+
+#if LCD_RETAINED && !LCD_NATIVE_RASTER
+#error "LCD_RETAINED requires LCD_NATIVE_RASTER"
+#endif
 
 namespace shapoco {
 
-static constexpr int BPP = 2;
-static constexpr int PIXELS_PER_BYTE = (8 + BPP - 1) / BPP;
-
-static constexpr uint8_t PALETTE_BLACK = 0;
-static constexpr uint8_t PALETTE_RED = 1;
-static constexpr uint8_t PALETTE_BLUE = 2;
-static constexpr uint8_t PALETTE_WHITE = 3;
-static constexpr uint8_t PALETTE_MASK = (1 << BPP) - 1;
-
 using namespace lgfx;
 
+// PALETTE: lcd_palette.hpp のパレット型。色深度と色はコンパイル時に決まる
+// DEPTH: 描画に使うバッファの数 (FramePipeline)
+template<typename PALETTE, int WIDTH, int HEIGHT, int DEPTH = LCD_PIPELINE_DEPTH>
 class LcdService {
 public:
-  static constexpr int NUM_BUFFERS = 3;
+  using PaletteType = PALETTE;
+  static constexpr int BPP = PALETTE::BPP;
+  static_assert(BPP == 1 || BPP == 2 || BPP == 4 || BPP == 8, "BPP must be 1, 2, 4 or 8");
+  static constexpr int PIXELS_PER_BYTE = 8 / BPP;
+  static constexpr uint8_t PALETTE_MASK = (1 << BPP) - 1;
+  static constexpr uint8_t PALETTE_BACKGROUND = PALETTE::BACKGROUND;
+  static constexpr uint8_t PALETTE_FOREGROUND = PALETTE::FOREGROUND;
+  static constexpr ExpandTable<BPP> EXPAND_TABLE{PALETTE::RGB565};
+  static constexpr HudAtlas<BPP> HUD_ATLAS{PALETTE_FOREGROUND, PALETTE_BACKGROUND};
+  using Raster = PackedRaster<BPP>;
+  using Circle = typename Raster::Circle;
+
+  static constexpr int width = WIDTH;
+  static constexpr int height = HEIGHT;
+  static constexpr int stride = (WIDTH * BPP + 7) / 8;
+  static_assert(WIDTH % PIXELS_PER_BYTE == 0, "WIDTH must be a multiple of pixels per byte");
+
+  static constexpr int PIPELINE_DEPTH = DEPTH;
+  // 描画用の DEPTH 枚と、パネルの内容を写したバッファ
+  static constexpr int NUM_BUFFERS = DEPTH + 1;
+  static constexpr int SHADOW_INDEX = DEPTH;
+  // HUD の左上 (x はどの色深度でもバイト境界に揃える)
+  static constexpr int HUD_X = 8;
+  static constexpr int HUD_Y = 4;
+  // 変換済みのラインを置くリングバッファの最大段数
+  static constexpr int MAX_LINE_BUFFS = 4;
+  // 1 回の serviceStart() で送る最大の行数
+  static constexpr int SCAN_LINES_PER_SERVICE = 8;
+
+  // 上下に隣接する変更区間を矩形にまとめて 1 回のウィンドウ設定で送る
+  // ウィンドウ設定 1 回分のコマンド (CASET + RASET + RAMWR、dlen_16bit なので 2 倍) と
+  // 余分に送る画素のバイト数を比べて、得になるときだけまとめる
+  static constexpr int WINDOW_COMMAND_BYTES = (3 + 8) * 2;
+  static constexpr int BYTES_PER_PACKED_BYTE = PIXELS_PER_BYTE * sizeof(uint16_t);
+  static constexpr int RECT_MAX_LINES = 4;
+  static constexpr int MAX_OPEN_RECTS = 16;
+
+  // パネルの内容を区間毎のハッシュで覚える場合の 1 ラインの区間数
+  static constexpr int NUM_SEGMENTS = (stride + HASH_SEGMENT_BYTES - 1) / HASH_SEGMENT_BYTES;
+
+  // 円のスタンプに使うメモリの上限 (2bpp でシーンの半径がほぼ全て入る)
+  static constexpr int STAMP_CACHE_BYTES = 16 * 1024;
+  using StampCache = CircleStampCache<BPP, STAMP_CACHE_BYTES>;
+
+  // 描画に使うバッファ (buffers[0] .. buffers[DEPTH - 1]) 毎の表示リスト
+  using Retained = DisplayList<BPP, WIDTH, HEIGHT, DEPTH, LCD_DISPLAY_LIST_CAPACITY>;
+  using Binner = TileBinner<BPP, WIDTH, HEIGHT, DEPTH, LCD_DISPLAY_LIST_CAPACITY>;
+
+  enum class PaintMode : uint8_t {
+    IMMEDIATE,  // 毎フレーム全体を消して直接描く
+    DAMAGE,     // 変わった円の跡のタイルだけを描き直す
+    BINNED,     // 円をタイルに振り分け、リストのハッシュが変わったタイルだけを描き直す
+  };
+
+  // バイト単位の [x0, x1) x [y0, y1)
+  struct Rect {
+    int16_t x0, x1, y0, y1;
+  };
+
+  struct ScanStats {
+    uint64_t frames = 0;
+    uint64_t dirtyRows = 0;
+    uint64_t dirtyBytes = 0;
+    uint64_t bytesCompared = 0;
+    uint64_t bytesSkipped = 0;
+    uint64_t windows = 0;
+    uint64_t commandBytes = 0;
+    uint64_t pixelBytes = 0;
+  };
 
-  const int width;
-  const int height;
-  const int stride;
   const int rotation;
   LGFX_ILI9488 lcd;
   LGFX_Sprite buffers[NUM_BUFFERS];
-  uint16_t *lineBuff;
+  // 次のスパンを変換している間に前のスパンを DMA で送る
+  // 転送中のバッファは DMA の完了を待ってから再利用する
+  // 1 つのバッファには RECT_MAX_LINES 行分の矩形が入る
+  int numLineBuffs = 2;
+  uint16_t *lineBuffs[MAX_LINE_BUFFS] = {nullptr};
+  int nextLineBuff = 0;
+  int lineBuffInFlight = -1;
+
+#if LCD_NATIVE_RASTER && LCD_STAMP_CACHE
+  StampCache stampCache;
+#endif
+
+#if LCD_RETAINED
+  Retained retained;
+  Binner binner;
+  PaintMode paintMode = PaintMode::BINNED;
+  // clearBackBuffer() から始めたフレームを記録中
+  bool retainedFrame = false;
+  // バッファ毎の HUD の大きさ (次にそのバッファを描くときに消す) と、直前のフレームの大きさ
+  int hudWidth[DEPTH] = {};
+  int hudHeight[DEPTH] = {};
+  int lastHudWidth = 0;
+  int lastHudHeight = 0;
+  // BINNED で描いたフレームの、直前のフレームから変わった領域
+  // スキャンアウトではこれだけを比較する
+  DirtyRegion frameChanges[DEPTH];
+  bool frameChangesValid[DEPTH] = {};
+#endif
+
+  // パネルの内容を buffers[SHADOW_INDEX] に写す代わりに区間毎のハッシュで覚える (init() の前に設定する)
+  // ハッシュが変わった区間だけを送る
+  bool hashShadow = LCD_HASH_SHADOW;
+  uint32_t *segmentHashes = nullptr;
+
+  bool coalesceRects = true;
+  Rect openRects[MAX_OPEN_RECTS];
+  int numOpenRects = 0;
+
+  // 描画バッファ毎の背景色以外の領域と、パネルに未反映の領域
+  DirtyRegion drawDirty[DEPTH];
+  DirtyRegion shownDirty;
+  DirtyRegion pendingDirty;
+  bool dirtyTracking = true;
+  ScanStats scanStats;
+  int lastDirtyRows = 0;
+  int lastDirtyBytes = 0;
+
+  // 描画中 (コア 0) とスキャン中 (コア 1) のバッファ番号
+  // スキャンアウトを別コアで行う場合は pipeline で所有権を受け渡す
+  int drawIndex = 0;
+  int scanIndex = 1;
+  FramePipeline<DEPTH> pipeline;
 
-  int phase = 0;
   int scanY = 0;
   int scanRemaining = 0;
   bool dmaStarted = false;
   bool firstTrans = true;
+  // ドラッグしているいのちの周りから送り始める。false でもフォーカスを送り終えた時刻は知らせる
+  bool priorityScan = LCD_PRIORITY_SCAN;
+  ScanFocus<DEPTH> focus;
 
   uint64_t fpsStartTimeMs = 0;
   int fpsFrameCount = 0;
-  float fps = 0;
+  // 送ったフレームレートの 10 倍
+  std::atomic<uint32_t> fpsX10{0};
+  // 最後に送り終えたフレームで送った画素のバイト数
+  std::atomic<uint32_t> lastFrameBytes{0};
+  uint64_t frameStartPixelBytes = 0;
 
-  LcdService(int width, int height, int rotation) :
-    width(width),
-    height(height),
-    stride((width * BPP + 7) / 8),
+  LcdService(int rotation) : LcdService(rotation, std::make_index_sequence<DEPTH>()) { }
+
+  template<size_t... I>
+  LcdService(int rotation, std::index_sequence<I...>) :
     rotation(rotation),
-    lcd(width, height, rotation),
-    lineBuff(new uint16_t[width])
+    lcd(WIDTH, HEIGHT, rotation),
+#if LCD_RETAINED
+    frameChanges{((void)I, DirtyRegion(height, stride))...},
+#endif
+    drawDirty{((void)I, DirtyRegion(height, stride))...},
+    shownDirty(height, stride),
+    pendingDirty(height, stride)
   { }
 
   ~LcdService() {
-    delete[] lineBuff;
+    delete[] lineBuffs[0];
+    delete[] segmentHashes;
   }
 
   void init(uint64_t nowMs) {
+    delete[] lineBuffs[0];
+    lineBuffs[0] = new uint16_t[width * RECT_MAX_LINES * numLineBuffs];
+    for (int i = 1; i < numLineBuffs; i++) {
+      lineBuffs[i] = lineBuffs[0] + width * RECT_MAX_LINES * i;
+    }
+
     lcd.init();
     lcd.setRotation(rotation);
     lcd.setColorDepth(16);
-    for (int i = 0; i < NUM_BUFFERS; i++) {
+    int numSprites = hashShadow ? DEPTH : NUM_BUFFERS;
+    for (int i = 0; i < numSprites; i++) {
       buffers[i].setColorDepth(BPP);
       buffers[i].createSprite(width, height);
-      buffers[i].clear(PALETTE_WHITE);
+      buffers[i].clear(PALETTE_BACKGROUND);
+    }
+    delete[] segmentHashes;
+    segmentHashes = nullptr;
+    if (hashShadow) {
+      // 最初のフレームは全体を送るので初期値は何でもよい
+      segmentHashes = new uint32_t[NUM_SEGMENTS * height];
+      memset(segmentHashes, 0, sizeof(uint32_t) * NUM_SEGMENTS * height);
     }
+#if LCD_RETAINED
+    retained.invalidate();
+    binner.invalidate();
+    retainedFrame = false;
+    for (int i = 0; i < DEPTH; i++) {
+      hudWidth[i] = 0;
+      hudHeight[i] = 0;
+      frameChangesValid[i] = false;
+    }
+    lastHudWidth = 0;
+    lastHudHeight = 0;
+#endif
+    for (int i = 0; i < DEPTH; i++) drawDirty[i].clear();
+    shownDirty.clear();
+    pendingDirty.markAll();
+    drawIndex = 0;
+    scanIndex = 1;
+    pipeline.reset(drawIndex, scanIndex);
+    scanY = 0;
+    scanRemaining = 0;
+    nextLineBuff = 0;
+    lineBuffInFlight = -1;
+    numOpenRects = 0;
     firstTrans = true;
     fpsStartTimeMs = nowMs;
     fpsFrameCount = 0;
-    fps = 0;
+    fpsX10.store(0, std::memory_order_relaxed);
+    lastFrameBytes.store(0, std::memory_order_relaxed);
+    frameStartPixelBytes = scanStats.pixelBytes;
   }
 
   LGFX_Sprite &getBackBuffer() {
-    return buffers[phase & 1];
+    return buffers[drawIndex];
   }
 
   LGFX_Sprite &getFrontBuffer() {
-    return buffers[(phase + 1) & 1];
+    return buffers[scanIndex];
+  }
+
+  // 描画中 / スキャン中のフレームの y ラインをパックされた形式で dst に写す (検証用)
+  void readBackLine(int y, uint8_t *dst) {
+    memcpy(dst, (const uint8_t*)getBackBuffer().getBuffer() + stride * y, stride);
+  }
+
+  void readFrontLine(int y, uint8_t *dst) {
+    memcpy(dst, (const uint8_t*)getFrontBuffer().getBuffer() + stride * y, stride);
+  }
+
+  // フレームの状態に使うメモリのバイト数 (フレームバッファ、更新領域、表示リストなど)
+  int frameMemoryBytes() const {
+    int bytes = sizeof(*this)
+      + (hashShadow ? NUM_BUFFERS - 1 : NUM_BUFFERS) * stride * height
+      + (hashShadow ? NUM_SEGMENTS * height * sizeof(uint32_t) : 0)
+      + (DEPTH + 2) * height * 2 * sizeof(int16_t)
+      + width * RECT_MAX_LINES * numLineBuffs * sizeof(uint16_t);
+#if LCD_RETAINED
+    bytes += (DEPTH + 1) * LCD_DISPLAY_LIST_CAPACITY * sizeof(Circle) + Binner::MAX_REFS * sizeof(uint16_t);
+    bytes += DEPTH * height * 2 * sizeof(int16_t);
+#endif
+    return bytes;
+  }
+
+  // バックバッファへの描画は以下を通して更新領域を記録する
+
+  // 表示リストを使う場合はここから次の commitFrame() までの円を記録する
+  void clearBackBuffer(uint8_t col = PALETTE_BACKGROUND) {
+#if LCD_RETAINED
+    frameChangesValid[drawIndex] = false;
+    if (paintMode != PaintMode::IMMEDIATE && col == PALETTE_BACKGROUND) {
+      retained.begin();
+      retainedFrame = true;
+      return;
+    }
+    retainedFrame = false;
+    retained.invalidate(drawIndex);
+    binner.invalidate(drawIndex);
+#endif
+    getBackBuffer().clear(col);
+    DirtyRegion &dirty = drawDirty[drawIndex];
+    if (col == PALETTE_BACKGROUND) {
+      dirty.clear();
+    }
+    else {
+      dirty.markAll();
+    }
+  }
+
+  void fillCircle(int x, int y, int r, uint8_t col) {
+#if LCD_RETAINED
+    if (retainedFrame && !retained.overflowed) {
+      if (retained.add(Circle{(int16_t)x, (int16_t)y, (int16_t)r, col})) return;
+      spillRetained();
+    }
+#endif
+    rasterCircle(x, y, r, col);
+    markDirty(x - r, y - r, 2 * r + 1, 2 * r + 1);
+  }
+
+  // 記録した円でバックバッファを更新する。flip() / submitBackBuffer() / paintHud() からも呼ぶ
+  void commitFrame() {
+#if LCD_RETAINED
+    if (!retainedFrame) return;
+    retainedFrame = false;
+    uint8_t *buff = (uint8_t*)getBackBuffer().getBuffer();
+    int textWidth = hudWidth[drawIndex];
+    int textHeight = hudHeight[drawIndex];
+    hudWidth[drawIndex] = 0;
+    hudHeight[drawIndex] = 0;
+
+    if (retained.overflowed) {
+      // spillRetained() で直接描いてある
+      binner.invalidate(drawIndex);
+      retained.finish(drawIndex, false);
+      return;
+    }
+
+    const auto &list = retained.current();
+    bool drawn = false;
+    if (paintMode == PaintMode::BINNED) {
+      DirtyRegion &changes = frameChanges[drawIndex];
+      changes.clear();
+      drawn = binner.render(drawIndex, buff, stride, PALETTE_BACKGROUND, list.items, list.count,
+        HUD_X, HUD_Y, HUD_X + textWidth, HUD_Y + textHeight,
+        [&changes](int x0, int y0, int x1, int y1) {
+          changes.mark(x0 / PIXELS_PER_BYTE, y0, (x1 + PIXELS_PER_BYTE - 1) / PIXELS_PER_BYTE, y1);
+        },
+        [this](const Circle &c) { rasterCircle(c.x, c.y, c.r, c.col); });
+      if (drawn) {
+        frameChangesValid[drawIndex] = true;
+        retained.finish(drawIndex, true);
+      }
+    }
+    if (!drawn) {
+      // DAMAGE か、BINNED で振り分けが溢れた場合
+      binner.invalidate(drawIndex);
+      retained.render(drawIndex, buff, stride, PALETTE_BACKGROUND,
+        HUD_X, HUD_Y, HUD_X + textWidth, HUD_Y + textHeight,
+        [this](const Circle &c) { rasterCircle(c.x, c.y, c.r, c.col); });
+    }
+
+    const auto &content = retained.lists[retained.contentOf[drawIndex]];
+    drawDirty[drawIndex].clear();
+    for (int i = 0; i < content.count; i++) {
+      const Circle &c = content.items[i];
+      markDirty(c.x - c.r, c.y - c.r, 2 * c.r + 1, 2 * c.r + 1);
+    }
+#endif
   }
 
+  // 複数の円をまとめて描く。結果は fillCircle() を順に呼んだ場合と同じ
+  void fillCircles(const Circle *circles, int n) {
+#if LCD_RETAINED
+    if (retainedFrame) {
+      for (int i = 0; i < n; i++) fillCircle(circles[i].x, circles[i].y, circles[i].r, circles[i].col);
+      return;
+    }
+#endif
+#if LCD_NATIVE_RASTER && LCD_STAMP_CACHE
+    uint8_t *buff = (uint8_t*)getBackBuffer().getBuffer();
+    for (int i = 0; i < n; i++) {
+      stampCache.fillCircle(buff, stride, width, height, circles[i].x, circles[i].y, circles[i].r, circles[i].col);
+    }
+#elif LCD_NATIVE_RASTER
+    Raster::fillCircles((uint8_t*)getBackBuffer().getBuffer(), stride, width, height, circles, n);
+#else
+    for (int i = 0; i < n; i++) {
+      getBackBuffer().fillCircle(circles[i].x, circles[i].y, circles[i].r, circles[i].col);
+    }
+#endif
+    for (int i = 0; i < n; i++) {
+      const Circle &c = circles[i];
+      markDirty(c.x - c.r, c.y - c.r, 2 * c.r + 1, 2 * c.r + 1);
+    }
+  }
+
+  // 記録せずにバックバッファに描く
+  void rasterCircle(int x, int y, int r, uint8_t col) {
+#if LCD_NATIVE_RASTER && LCD_STAMP_CACHE
+    stampCache.fillCircle((uint8_t*)getBackBuffer().getBuffer(), stride, width, height, x, y, r, col);
+#elif LCD_NATIVE_RASTER
+    Raster::fillCircle((uint8_t*)getBackBuffer().getBuffer(), stride, width, height, x, y, r, col);
+#else
+    getBackBuffer().fillCircle(x, y, r, col);
+#endif
+  }
+
+#if LCD_RETAINED
+  // 表示リストが溢れたら、そのフレームは全体を消してから直接描く
+  void spillRetained() {
+    getBackBuffer().clear(PALETTE_BACKGROUND);
+    drawDirty[drawIndex].clear();
+    const auto &list = retained.current();
+    for (int i = 0; i < list.count; i++) {
+      const Circle &c = list.items[i];
+      rasterCircle(c.x, c.y, c.r, c.col);
+      markDirty(c.x - c.r, c.y - c.r, 2 * c.r + 1, 2 * c.r + 1);
+    }
+  }
+#endif
+
+  void markDirty(int x, int y, int w, int h) {
+    int bx0 = x < 0 ? 0 : x / PIXELS_PER_BYTE;
+    int bx1 = (x + w + PIXELS_PER_BYTE - 1) / PIXELS_PER_BYTE;
+    drawDirty[drawIndex].mark(bx0, y, bx1, y + h);
+  }
+
+  // 送るフレームの変化が分からなければ、次のフレームでは全てのタイルを変化ありにする
+  void handOffFrame() {
+#if LCD_RETAINED
+    if (!frameChangesValid[drawIndex]) binner.forgetPrevious();
+#endif
+  }
+
+  // 同じコアでスキャンアウトする場合のバッファの入れ替え
   void flip() {
-    phase = (phase + 1) & 1;
+    PERF_INSTANT(SUBMIT);
+    commitFrame();
+    handOffFrame();
+    int frameIndex = drawIndex;
+    drawIndex = scanIndex;
+#if LCD_RETAINED
+    frameChangesValid[drawIndex] = false;
+#endif
+    pipeline.flipped(frameIndex, drawIndex);
+    startScan(frameIndex);
+  }
+
+  // 以下はスキャンアウトを別のコアで行う場合に使う
+
+  // コア 0: 描画できるバッファを確保する。空きが無ければ false
+  bool acquireBackBuffer() {
+    if (drawIndex >= 0) return true;
+    int i = pipeline.acquire();
+    if (i < 0) return false;
+    drawIndex = i;
+#if LCD_RETAINED
+    frameChangesValid[drawIndex] = false;
+#endif
+    return true;
+  }
+
+  // コア 0: 描き終えたバッファを送る順番に並べる
+  void submitBackBuffer() {
+    PERF_INSTANT(SUBMIT);
+    commitFrame();
+    handOffFrame();
+    pipeline.submit(drawIndex);
+    drawIndex = -1;
+  }
+
+  // コア 1: 1 ライン分スキャンアウトする
+  // 前のフレームを送り終えていたら次のフレームを受け取り、前のバッファをコア 0 に返す
+  // 送るものが無ければ false
+  bool serviceScanOut(uint64_t nowMs) {
     if (idle()) {
-      scanY = 0;
+      int frameIndex = pipeline.takeNext(scanIndex);
+      if (frameIndex < 0) return false;
+      startScan(frameIndex);
+    }
+    serviceStart(nowMs);
+    serviceEnd(nowMs);
+    if (idle()) pipeline.scanned();
+    return true;
+  }
+
+  // コア 0: 渡したフレームを全てパネルに送り終えたか
+  bool scanOutDrained() const {
+    return pipeline.drained();
+  }
+
+  void startScan(int frameIndex) {
+    scanIndex = frameIndex;
+    int focusY = focus.begin(frameIndex);
+    if (idle()) {
+      // フォーカスから送り始め、下端で折り返して残りを送る (最初のフレームは全体を先頭から)
+      scanY = priorityScan && focusY >= 0 && !firstTrans ? focusY : 0;
     }
     scanRemaining = height;
+
+    // 新しいフレームの描画領域と、パネル上に残っている前のフレームの領域を走査する
+    // 直前のフレームから変わった領域が分かっていればそこだけを走査する
+    const DirtyRegion &frontDirty = drawDirty[frameIndex];
+#if LCD_RETAINED
+    if (dirtyTracking && frameChangesValid[frameIndex]) {
+      pendingDirty.merge(frameChanges[frameIndex]);
+    }
+    else
+#endif
+    if (dirtyTracking) {
+      pendingDirty.merge(frontDirty);
+      pendingDirty.merge(shownDirty);
+    }
+    else {
+      pendingDirty.markAll();
+    }
+    shownDirty.copyFrom(frontDirty);
+
+    lastDirtyRows = pendingDirty.countRows();
+    lastDirtyBytes = pendingDirty.countBytes();
+    scanStats.frames++;
+    scanStats.dirtyRows += lastDirtyRows;
+    scanStats.dirtyBytes += lastDirtyBytes;
   }
 
   void serviceStart(uint64_t nowMs) {
     if (idle()) return;
+    PERF_SCOPE(SCAN);
 
-    LGFX_Sprite &spOld = buffers[2];
+    LGFX_Sprite &spOld = buffers[SHADOW_INDEX];
     LGFX_Sprite &spNew = getFrontBuffer();
 
-    while (true) {
-      uint8_t* oldLine = ((uint8_t*)spOld.getBuffer()) + stride * scanY;
+    int numLines = 0;
+    while (scanRemaining > 0 && numLines < SCAN_LINES_PER_SERVICE) {
+      if (!pendingDirty.rowDirty(scanY)) {
+        scanStats.bytesSkipped += stride;
+        closeRects(scanY);
+        stepScanLine(nowMs);
+        continue;
+      }
+
       const uint8_t* newLine = ((const uint8_t*)spNew.getBuffer()) + stride * scanY;
-      uint16_t* wrPtr = nullptr;
-      int startByte = -1;
-      for(int ix = 0; ix < stride; ix++) {
-        uint8_t oldByte = oldLine[ix];
-        uint8_t newByte = newLine[ix];
-
-        bool change = (oldByte != newByte || firstTrans);
-        if (change) {
-          if (!dmaStarted) {
-            lcd.startWrite();   
-            dmaStarted = true;     
-          }
-
-          if (startByte < 0) {
-            startByte = ix;
-            wrPtr = lineBuff;
-          }
-
-          uint8_t sreg = newByte;
-          for (int ipix = 0; ipix < PIXELS_PER_BYTE; ipix++) {
-            uint8_t colIndex = (sreg >> (8 - BPP)) & PALETTE_MASK;
-            switch (colIndex) {
-            case PALETTE_RED: *wrPtr = 0x00f8; break;
-            case PALETTE_BLACK: *wrPtr = 0x0000; break;
-            case PALETTE_BLUE: *wrPtr = 0x1f00; break;
-            default: *wrPtr = 0xffff; break;
-            }
-            wrPtr++;
-            sreg <<= BPP;            
-          }
-        }
+      int scanStart = pendingDirty.rowStart(scanY);
+      int scanEnd = pendingDirty.rowEnd(scanY);
+      pendingDirty.clearRow(scanY);
+
+      if (hashShadow) {
+        scanHashedLine(newLine, scanStart, scanEnd);
+        numLines++;
+        closeRects(scanY);
+        stepScanLine(nowMs);
+        continue;
+      }
 
-        bool endOfLine = ix >= stride - 1;
-        if (startByte >= 0 && (!change || endOfLine)) {
-          int endByte = endOfLine ? stride : ix;
-          int numBytes = endByte - startByte;
-          int startPix = startByte * PIXELS_PER_BYTE;
-          int numPixs = numBytes * PIXELS_PER_BYTE;
-          lcd.pushImageDMA(startPix, scanY, numPixs, 1, lineBuff);
-          memcpy(oldLine + startByte, newLine + startByte, numBytes);
-          startByte = -1;
+      uint8_t* oldLine = ((uint8_t*)spOld.getBuffer()) + stride * scanY;
+      scanStats.bytesCompared += scanEnd - scanStart;
+      scanStats.bytesSkipped += stride - (scanEnd - scanStart);
+
+      int ix = scanStart;
+      while (ix < scanEnd) {
+        int startByte, endByte;
+        if (firstTrans) {
+          startByte = scanStart;
+          endByte = scanEnd;
+        }
+        else if (!findChangedRun(oldLine, newLine, ix, scanEnd, &startByte, &endByte)) {
+          break;
         }
+
+        addRun(startByte, endByte, scanY);
+        memcpy(oldLine + startByte, newLine + startByte, endByte - startByte);
+        ix = endByte;
       }
 
-      if (dmaStarted) break;
+      numLines++;
+      closeRects(scanY);
       stepScanLine(nowMs);
-      if (scanRemaining <= 0) break;
+    }
+
+    // 次の呼び出しまでにフロントバッファが替わるかもしれないので全て送っておく
+    while (numOpenRects > 0) {
+      flushRect(openRects[--numOpenRects]);
     }
   }
 
-  void serviceEnd(uint64_t nowMs) {
-    if (idle()) return;
+  // 走査範囲を含む区間のハッシュを比べ、変わった区間を送る
+  // 走査範囲の外のバイトはパネルと同じなので、区間の端まで送ってよい
+  void scanHashedLine(const uint8_t *newLine, int scanStart, int scanEnd) {
+    uint32_t *hashes = segmentHashes + NUM_SEGMENTS * scanY;
+    int seg0 = scanStart / HASH_SEGMENT_BYTES;
+    int seg1 = (scanEnd + HASH_SEGMENT_BYTES - 1) / HASH_SEGMENT_BYTES;
+    int bx0 = seg0 * HASH_SEGMENT_BYTES;
+    int bx1 = seg1 * HASH_SEGMENT_BYTES > stride ? stride : seg1 * HASH_SEGMENT_BYTES;
+    scanStats.bytesCompared += bx1 - bx0;
+    scanStats.bytesSkipped += stride - (bx1 - bx0);
+
+    if (firstTrans) {
+      for (int i = seg0; i < seg1; i++) hashes[i] = hashSegmentAt(newLine, stride, i);
+      addRun(bx0, bx1, scanY);
+      return;
+    }
+    int i = seg0;
+    int runStart, runEnd;
+    while (i < seg1 && findChangedSegments(hashes, newLine, stride, i, seg1, &runStart, &runEnd)) {
+      int x1 = runEnd * HASH_SEGMENT_BYTES > stride ? stride : runEnd * HASH_SEGMENT_BYTES;
+      addRun(runStart * HASH_SEGMENT_BYTES, x1, scanY);
+      i = runEnd;
+    }
+  }
+
+  // y 行目の変更区間 [x0, x1) を、上の行から続く矩形に加えるか新しい矩形にする
+  void addRun(int x0, int x1, int y) {
+    if (!coalesceRects) {
+      flushRect(Rect{(int16_t)x0, (int16_t)x1, (int16_t)y, (int16_t)(y + 1)});
+      return;
+    }
+
+    int best = -1;
+    int bestGain = 0;
+    for (int i = 0; i < numOpenRects; i++) {
+      const Rect &r = openRects[i];
+      if (r.y1 != y && r.y1 != y + 1) continue;
+      int nx0 = x0 < r.x0 ? x0 : r.x0;
+      int nx1 = x1 > r.x1 ? x1 : r.x1;
+      int ny1 = y + 1;
+      if (ny1 - r.y0 > RECT_MAX_LINES) continue;
+      // 別のウィンドウで送る場合と比べて節約できるバイト数
+      int added = (nx1 - nx0) * (ny1 - r.y0) - (r.x1 - r.x0) * (r.y1 - r.y0);
+      int gain = WINDOW_COMMAND_BYTES + ((x1 - x0) - added) * BYTES_PER_PACKED_BYTE;
+      if (gain >= 0 && (best < 0 || gain > bestGain)) {
+        best = i;
+        bestGain = gain;
+      }
+    }
+
+    if (best >= 0) {
+      Rect &r = openRects[best];
+      if (x0 < r.x0) r.x0 = x0;
+      if (x1 > r.x1) r.x1 = x1;
+      r.y1 = y + 1;
+      return;
+    }
 
+    if (numOpenRects >= MAX_OPEN_RECTS) {
+      flushRect(openRects[0]);
+      openRects[0] = openRects[--numOpenRects];
+    }
+    openRects[numOpenRects++] = Rect{(int16_t)x0, (int16_t)x1, (int16_t)y, (int16_t)(y + 1)};
+  }
+
+  // y 行目で延びなかった矩形を送る
+  void closeRects(int y) {
+    int i = 0;
+    while (i < numOpenRects) {
+      if (openRects[i].y1 != y + 1) {
+        flushRect(openRects[i]);
+        openRects[i] = openRects[--numOpenRects];
+      }
+      else {
+        i++;
+      }
+    }
+  }
+
+  void flushRect(const Rect &r) {
+    if (!dmaStarted) {
+      lcd.startWrite();
+      dmaStarted = true;
+    }
+
+    int numBytes = r.x1 - r.x0;
+    int numPixs = numBytes * PIXELS_PER_BYTE;
+    int numLines = r.y1 - r.y0;
+    const uint8_t *src = ((const uint8_t*)getFrontBuffer().getBuffer()) + stride * r.y0 + r.x0;
+    uint16_t *lineBuff = acquireLineBuff();
+    PERF_BEGIN(CONVERT);
+    for (int i = 0; i < numLines; i++) {
+      EXPAND_TABLE.expand(src + stride * i, numBytes, lineBuff + numPixs * i);
+    }
+    PERF_END(CONVERT);
+    lcd.pushImageDMA(r.x0 * PIXELS_PER_BYTE, r.y0, numPixs, numLines, lineBuff);
+
+    scanStats.windows++;
+    scanStats.commandBytes += WINDOW_COMMAND_BYTES;
+    scanStats.pixelBytes += numPixs * numLines * sizeof(uint16_t);
+  }
+
+  // 最後のスパンの転送完了を待ってバスを解放する
+  void serviceEnd(uint64_t nowMs) {
     if (dmaStarted) {
+      PERF_SCOPE(DMA_WAIT);
       lcd.endWrite();
       dmaStarted = false;
+      lineBuffInFlight = -1;
     }
+  }
 
-    stepScanLine(nowMs);
+  uint16_t *acquireLineBuff() {
+    int i = nextLineBuff;
+    nextLineBuff = (i + 1) % numLineBuffs;
+    // DMA は 1 本ずつ順に流れるので、転送中になり得るのは最後に渡したバッファだけ
+    if (i == lineBuffInFlight) {
+      PERF_SCOPE(DMA_WAIT);
+      lcd.waitDMA();
+    }
+    lineBuffInFlight = i;
+    return lineBuffs[i];
   }
 
   void stepScanLine(uint64_t nowMs) {
+    focus.step(scanY);
     scanRemaining -= 1;
-    if (scanY + 1 < height) {
-      scanY += 1;
-    }
-    else {
-      scanY = 0;
+    scanY = scanY + 1 < height ? scanY + 1 : 0;
+    // フォーカスから送ると下端はフレームの途中なので、送るラインが尽きたところをフレームの終わりにする
+    if (scanRemaining == 0) {
+      // 最後の矩形もこのフレームのバイト数に数える
+      while (numOpenRects > 0) {
+        flushRect(openRects[--numOpenRects]);
+      }
       firstTrans = false;
       fpsFrameCount++;
+      lastFrameBytes.store(scanStats.pixelBytes - frameStartPixelBytes, std::memory_order_relaxed);
+      frameStartPixelBytes = scanStats.pixelBytes;
       uint32_t elapsedMs = nowMs - fpsStartTimeMs;
       if (elapsedMs >= 1000) {
-        fps = (float)fpsFrameCount * 1000 / elapsedMs;
+        fpsX10.store(fpsFrameCount * 10000 / elapsedMs, std::memory_order_relaxed);
         fpsStartTimeMs = nowMs;
         fpsFrameCount = 0;
       }
     }
   }
 
-  void paintFps(uint64_t nowMs) {
-    LGFX_Sprite &g = getBackBuffer();
-    char buf[64];
-    snprintf(buf, sizeof(buf), "FPS:%.1f", fps);
-    g.setTextColor(PALETTE_BLACK, PALETTE_WHITE);
-    g.drawString(buf, 4, 4, 1);
+  // HUD をバックバッファに描く。表示しないときも、前のフレームの HUD を消すために毎フレーム呼ぶ
+  void paintHud(FrameHud &hud) {
+    commitFrame();
+    int w = 0;
+    int h = 0;
+    if (hud.enabled()) {
+      const HudText &text = hud.refresh(fpsX10.load(std::memory_order_relaxed), lastFrameBytes.load(std::memory_order_relaxed));
+      w = HUD_ATLAS.draw((uint8_t*)getBackBuffer().getBuffer(), stride, width, HUD_X, HUD_Y, text);
+      h = text.numLines * HudAtlas<BPP>::CELL_HEIGHT;
+      markDirty(HUD_X, HUD_Y, w, h);
+    }
+#if LCD_RETAINED
+    hudWidth[drawIndex] = w;
+    hudHeight[drawIndex] = h;
+    int cw = w > lastHudWidth ? w : lastHudWidth;
+    int ch = h > lastHudHeight ? h : lastHudHeight;
+    if (frameChangesValid[drawIndex] && cw > 0) {
+      frameChanges[drawIndex].mark(HUD_X / PIXELS_PER_BYTE, HUD_Y, (HUD_X + cw) / PIXELS_PER_BYTE, HUD_Y + ch);
+    }
+    lastHudWidth = w;
+    lastHudHeight = h;
+#endif
   }
 
   bool idle() {
     return scanRemaining <= 0;
   }
 
+  // 転送を始めておらず、バスを他のデバイス (タッチパネル) に使わせてよい
+  bool busFree() const {
+    return !dmaStarted;
+  }
+
+  // コア 0: 描いているフレームで先に送る行 [y0, y1) と、その位置を決めたタッチを読んだ時刻
+  void setFocus(int y0, int y1, uint64_t touchUs) {
+    focus.set(drawIndex, y0, y1, height, touchUs);
+  }
+
+  // スキャンする側: フォーカスを送り終えて DMA も終わっていれば、そのタッチの時刻を返す
+  bool takeFocusSent(uint64_t *touchUs) {
+    return !dmaStarted && focus.take(touchUs);
+  }
+
 };
 
 }
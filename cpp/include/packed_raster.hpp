@@ -0,0 +1,159 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// 1 バイトに複数画素を詰めたフレームバッファ (上位ビットが左) への直接描画
+// LGFX_Sprite::fillCircle と同じ画素を塗る
+
+namespace shapoco {
+
+template<int BPP>
+class PackedRaster {
+public:
+  static_assert(BPP == 1 || BPP == 2 || BPP == 4 || BPP == 8, "BPP must be 1, 2, 4 or 8");
+  static constexpr int PIXELS_PER_BYTE = 8 / BPP;
+  static constexpr int MAX_RADIUS = 255;
+
+  struct Circle {
+    int16_t x, y, r;
+    uint8_t col;
+  };
+
+  // 色を 1 バイト分に並べたもの
+  static constexpr uint8_t pattern(uint8_t col) {
+    uint8_t p = col & ((1 << BPP) - 1);
+    for (int i = BPP; i < 8; i *= 2) p |= p << i;
+    return p;
+  }
+
+  // 1 行の [x0, x1) を塗る。クリップ済みであること
+  static void fillSpan(uint8_t *line, int x0, int x1, uint8_t pat) {
+    if (x0 >= x1) return;
+    int b0 = x0 / PIXELS_PER_BYTE;
+    int b1 = (x1 - 1) / PIXELS_PER_BYTE;
+    uint8_t headMask = 0xff >> (BPP * (x0 % PIXELS_PER_BYTE));
+    uint8_t tailMask = 0xff << (8 - BPP * ((x1 - 1) % PIXELS_PER_BYTE + 1));
+    if (b0 == b1) {
+      uint8_t mask = headMask & tailMask;
+      line[b0] = (line[b0] & ~mask) | (pat & mask);
+      return;
+    }
+    if (headMask != 0xff) {
+      line[b0] = (line[b0] & ~headMask) | (pat & headMask);
+      b0++;
+    }
+    if (tailMask != 0xff) {
+      line[b1] = (line[b1] & ~tailMask) | (pat & tailMask);
+      b1--;
+    }
+    if (b0 <= b1) memset(line + b0, pat, b1 - b0 + 1);
+  }
+
+  // src の [x0, x1) を dst の同じ位置に写す。クリップ済みであること
+  static void copySpan(uint8_t *dst, const uint8_t *src, int x0, int x1) {
+    if (x0 >= x1) return;
+    int b0 = x0 / PIXELS_PER_BYTE;
+    int b1 = (x1 - 1) / PIXELS_PER_BYTE;
+    uint8_t headMask = 0xff >> (BPP * (x0 % PIXELS_PER_BYTE));
+    uint8_t tailMask = 0xff << (8 - BPP * ((x1 - 1) % PIXELS_PER_BYTE + 1));
+    if (b0 == b1) {
+      uint8_t mask = headMask & tailMask;
+      dst[b0] = (dst[b0] & ~mask) | (src[b0] & mask);
+      return;
+    }
+    dst[b0] = (dst[b0] & ~headMask) | (src[b0] & headMask);
+    dst[b1] = (dst[b1] & ~tailMask) | (src[b1] & tailMask);
+    if (b1 - b0 > 1) memcpy(dst + b0 + 1, src + b0 + 1, b1 - b0 - 1);
+  }
+
+  // 中心からの行毎の半幅を求める (LGFXBase::fill_circle_helper と同じ中点アルゴリズム)
+  // halfWidth[dy] (0 <= dy <= r) に入る
+  static void circleHalfWidths(int r, int16_t *halfWidth) {
+    for (int i = 0; i <= r; i++) halfWidth[i] = -1;
+    halfWidth[0] = r;
+    if (r <= 0) return;
+    int f = 1 - r;
+    int ddF_y = -(r << 1);
+    int ddF_x = 1;
+    int i = 0;
+    int j = -1;
+    do {
+      while (f < 0) {
+        ++i;
+        f += (ddF_x += 2);
+      }
+      f += (ddF_y += 2);
+      if (i - j) {
+        if (i > halfWidth[r]) halfWidth[r] = i;
+        j = i;
+      }
+      if (r > halfWidth[i]) halfWidth[i] = r;
+    } while (++i < --r);
+  }
+
+  static void fillCircle(uint8_t *buff, int stride, int width, int height, int cx, int cy, int r, uint8_t col) {
+    fillCircleClipped(buff, stride, 0, 0, width, height, cx, cy, r, col);
+  }
+
+  // [clipX0, clipX1) x [clipY0, clipY1) の内側だけを塗る
+  static void fillCircleClipped(uint8_t *buff, int stride, int clipX0, int clipY0, int clipX1, int clipY1, int cx, int cy, int r, uint8_t col) {
+    if (r < 0 || r > MAX_RADIUS) return;
+    int16_t halfWidth[MAX_RADIUS + 1];
+    circleHalfWidths(r, halfWidth);
+    fillCircleRows(buff, stride, clipX0, clipY0, clipX1, clipY1, cx, cy, r, halfWidth, pattern(col));
+  }
+
+  // circleHalfWidths() で求めた半幅を使って塗る
+  static void fillCircleRows(uint8_t *buff, int stride, int clipX0, int clipY0, int clipX1, int clipY1,
+      int cx, int cy, int r, const int16_t *halfWidth, uint8_t pat) {
+    int y0 = cy - r < clipY0 ? clipY0 : cy - r;
+    int y1 = cy + r + 1 > clipY1 ? clipY1 : cy + r + 1;
+    for (int y = y0; y < y1; y++) {
+      int hw = halfWidth[y < cy ? cy - y : y - cy];
+      if (hw < 0) continue;
+      int x0 = cx - hw < clipX0 ? clipX0 : cx - hw;
+      int x1 = cx + hw + 1 > clipX1 ? clipX1 : cx + hw + 1;
+      fillSpan(buff + stride * y, x0, x1, pat);
+    }
+  }
+
+  static void fillRect(uint8_t *buff, int stride, int x0, int y0, int x1, int y1, uint8_t col) {
+    uint8_t pat = pattern(col);
+    if (x0 % PIXELS_PER_BYTE == 0 && x1 % PIXELS_PER_BYTE == 0) {
+      if (x0 >= x1) return;
+      uint8_t *p = buff + x0 / PIXELS_PER_BYTE;
+      int n = (x1 - x0) / PIXELS_PER_BYTE;
+      for (int y = y0; y < y1; y++) memset(p + stride * y, pat, n);
+      return;
+    }
+    for (int y = y0; y < y1; y++) fillSpan(buff + stride * y, x0, x1, pat);
+  }
+
+  // 複数の円を順に塗る。同じ半径が続く間は半幅のテーブルを使い回す
+  static void fillCircles(uint8_t *buff, int stride, int width, int height, const Circle *circles, int n) {
+    int16_t halfWidth[MAX_RADIUS + 1];
+    int tableRadius = -1;
+    for (int i = 0; i < n; i++) {
+      const Circle &c = circles[i];
+      if (c.r < 0 || c.r > MAX_RADIUS) continue;
+      int y0 = c.y - c.r < 0 ? 0 : c.y - c.r;
+      int y1 = c.y + c.r + 1 > height ? height : c.y + c.r + 1;
+      if (y0 >= y1 || c.x + c.r < 0 || c.x - c.r >= width) continue;
+      if (c.r != tableRadius) {
+        circleHalfWidths(c.r, halfWidth);
+        tableRadius = c.r;
+      }
+      uint8_t pat = pattern(c.col);
+      for (int y = y0; y < y1; y++) {
+        int hw = halfWidth[y < c.y ? c.y - y : y - c.y];
+        if (hw < 0) continue;
+        int x0 = c.x - hw < 0 ? 0 : c.x - hw;
+        int x1 = c.x + hw + 1 > width ? width : c.x + hw + 1;
+        fillSpan(buff + stride * y, x0, x1, pat);
+      }
+    }
+  }
+};
+
+}
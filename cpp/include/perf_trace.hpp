@@ -0,0 +1,232 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+// 処理区間の開始と終了をコア毎のリングバッファに記録し、まとめてバイナリで書き出す
+// 書き出したものは host/perf_trace_decode で Chrome trace (Perfetto) の JSON にする
+// 0 なら記録のコードは全て消える
+#ifndef PERF_TRACE
+#define PERF_TRACE (0)
+#endif
+
+// コア毎に溜めておけるイベント数 (2 のべき乗)。溢れた分は捨てて数える
+#ifndef PERF_TRACE_CAPACITY
+#define PERF_TRACE_CAPACITY (1024)
+#endif
+
+#if PERF_TRACE
+#ifdef SHAPOPAD_HOST
+#include <chrono>
+#else
+#include "hardware/timer.h"
+#include "pico/platform.h"
+#endif
+#endif
+
+namespace shapoco {
+
+enum class PerfEvent : uint8_t {
+  UPDATE,        // World::update()
+  PAINT,         // World::servicePaint() の 1 回分
+  SCAN,          // serviceStart(): 差分の検出と送信
+  CONVERT,       // パックされた画素から RGB565 への展開
+  DMA_WAIT,      // 前の転送の完了待ち
+  TOUCH,         // タッチパネルの読み出し
+  SUBMIT,        // フレームを送る順番に並べた / flip した
+  DRAIN,         // 記録の書き出し
+  NUM_EVENTS,
+};
+
+static constexpr const char *PERF_EVENT_NAMES[] = {
+  "update", "paint", "scan", "convert", "dma_wait", "touch", "submit", "drain",
+};
+
+enum class PerfPhase : uint8_t {
+  BEGIN = 0,
+  END = 1,
+  INSTANT = 2,
+};
+
+struct PerfRecord {
+  uint32_t ticks;
+  uint8_t event;
+  uint8_t phase;
+};
+
+// 書き出す形式
+//   パケット: 'P' 'T' type:u8 ... checksum:u8 (type から直前までのバイトの和)
+//   type 'H': ticksPerUs:u32
+//   type 'E': core:u8 count:u8 dropped:u16 baseTicks:u32
+//             count 個の (event | phase << 6):u8, varint 前のイベントからの tick 数
+// テキストの出力と混ざっても同期バイトと checksum で見つけられる
+static constexpr uint8_t PERF_SYNC0 = 'P';
+static constexpr uint8_t PERF_SYNC1 = 'T';
+static constexpr int PERF_MAX_EVENTS_PER_PACKET = 64;
+static constexpr int PERF_MAX_PACKET_BYTES = 3 + 8 + PERF_MAX_EVENTS_PER_PACKET * 6 + 1;
+
+// 1 つのコアが書き、書き出す側が読む
+template<int CAPACITY>
+class PerfRing {
+public:
+  static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of 2");
+
+  PerfRecord records[CAPACITY];
+  std::atomic<uint32_t> head{0};
+  std::atomic<uint32_t> tail{0};
+  std::atomic<uint32_t> dropped{0};
+
+  inline void push(uint32_t ticks, PerfEvent ev, PerfPhase ph) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= CAPACITY) {
+      dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return;
+    }
+    PerfRecord &r = records[h & (CAPACITY - 1)];
+    r.ticks = ticks;
+    r.event = (uint8_t)ev;
+    r.phase = (uint8_t)ph;
+    head.store(h + 1, std::memory_order_release);
+  }
+};
+
+class PerfTrace {
+public:
+  static constexpr int NUM_CORES = 2;
+  using Ring = PerfRing<PERF_TRACE_CAPACITY>;
+
+  Ring rings[NUM_CORES];
+  uint32_t ticksPerUs;
+  uint32_t droppedReported[NUM_CORES] = {};
+
+  PerfTrace(uint32_t ticksPerUs) : ticksPerUs(ticksPerUs) { }
+
+  // パケットを書き出す関数
+  using WriteFunc = void (*)(const uint8_t *data, int size);
+
+  // 溜まっている記録を全て書き出す。書き出した数を返す
+  // 途中から受け取っても時間の単位が分かるよう、毎回ヘッダを付ける
+  int drain(WriteFunc write) {
+    int total = 0;
+    bool headerWritten = false;
+    for (int core = 0; core < NUM_CORES; core++) {
+      Ring &ring = rings[core];
+      uint32_t t = ring.tail.load(std::memory_order_relaxed);
+      uint32_t h = ring.head.load(std::memory_order_acquire);
+      if (t != h && !headerWritten) {
+        writeHeader(write);
+        headerWritten = true;
+      }
+      while (t != h) {
+        int count = h - t;
+        if (count > PERF_MAX_EVENTS_PER_PACKET) count = PERF_MAX_EVENTS_PER_PACKET;
+        uint32_t dropped = ring.dropped.load(std::memory_order_relaxed);
+        uint32_t newDrops = dropped - droppedReported[core];
+        droppedReported[core] = dropped;
+
+        uint8_t buff[PERF_MAX_PACKET_BYTES];
+        int n = 0;
+        buff[n++] = PERF_SYNC0;
+        buff[n++] = PERF_SYNC1;
+        buff[n++] = 'E';
+        buff[n++] = core;
+        buff[n++] = count;
+        buff[n++] = newDrops > 0xffff ? 0xff : newDrops;
+        buff[n++] = newDrops > 0xffff ? 0xff : newDrops >> 8;
+        uint32_t last = ring.records[t & (PERF_TRACE_CAPACITY - 1)].ticks;
+        putU32(buff, &n, last);
+        for (int i = 0; i < count; i++) {
+          const PerfRecord &r = ring.records[(t + i) & (PERF_TRACE_CAPACITY - 1)];
+          buff[n++] = r.event | (r.phase << 6);
+          putVarint(buff, &n, r.ticks - last);
+          last = r.ticks;
+        }
+        appendChecksum(buff, &n);
+        t += count;
+        ring.tail.store(t, std::memory_order_release);
+        write(buff, n);
+        total += count;
+      }
+    }
+    return total;
+  }
+
+private:
+  void writeHeader(WriteFunc write) {
+    uint8_t buff[8];
+    int n = 0;
+    buff[n++] = PERF_SYNC0;
+    buff[n++] = PERF_SYNC1;
+    buff[n++] = 'H';
+    putU32(buff, &n, ticksPerUs);
+    appendChecksum(buff, &n);
+    write(buff, n);
+  }
+
+  static void putU32(uint8_t *buff, int *n, uint32_t v) {
+    for (int i = 0; i < 4; i++) buff[(*n)++] = v >> (8 * i);
+  }
+
+  static void putVarint(uint8_t *buff, int *n, uint32_t v) {
+    while (v >= 0x80) {
+      buff[(*n)++] = (v & 0x7f) | 0x80;
+      v >>= 7;
+    }
+    buff[(*n)++] = v;
+  }
+
+  static void appendChecksum(uint8_t *buff, int *n) {
+    uint8_t sum = 0;
+    for (int i = 2; i < *n; i++) sum += buff[i];
+    buff[(*n)++] = sum;
+  }
+};
+
+#if PERF_TRACE
+
+#ifdef SHAPOPAD_HOST
+// ホストでは ns 単位。スキャンアウトのスレッドは perfHostCore = 1 にする
+static constexpr uint32_t PERF_TICKS_PER_US = 1000;
+inline thread_local uint8_t perfHostCore = 0;
+static inline uint32_t perfTicks() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+static inline int perfCore() { return perfHostCore; }
+#else
+// RP2040 (Cortex-M0+) にはサイクルカウンタが無いので、両コアで共通の 1MHz タイマを使う
+static constexpr uint32_t PERF_TICKS_PER_US = 1;
+static inline uint32_t perfTicks() { return timer_hw->timerawl; }
+static inline int perfCore() { return get_core_num(); }
+#endif
+
+inline PerfTrace perfTrace(PERF_TICKS_PER_US);
+
+static inline void perfRecord(PerfEvent ev, PerfPhase ph) {
+  perfTrace.rings[perfCore()].push(perfTicks(), ev, ph);
+}
+
+class PerfScope {
+public:
+  PerfEvent ev;
+  PerfScope(PerfEvent ev) : ev(ev) { perfRecord(ev, PerfPhase::BEGIN); }
+  ~PerfScope() { perfRecord(ev, PerfPhase::END); }
+};
+
+#define PERF_CONCAT_(a, b) a##b
+#define PERF_CONCAT(a, b) PERF_CONCAT_(a, b)
+#define PERF_BEGIN(ev) ::shapoco::perfRecord(::shapoco::PerfEvent::ev, ::shapoco::PerfPhase::BEGIN)
+#define PERF_END(ev) ::shapoco::perfRecord(::shapoco::PerfEvent::ev, ::shapoco::PerfPhase::END)
+#define PERF_INSTANT(ev) ::shapoco::perfRecord(::shapoco::PerfEvent::ev, ::shapoco::PerfPhase::INSTANT)
+#define PERF_SCOPE(ev) ::shapoco::PerfScope PERF_CONCAT(perfScope, __LINE__)(::shapoco::PerfEvent::ev)
+
+#else
+
+#define PERF_BEGIN(ev) do { } while (0)
+#define PERF_END(ev) do { } while (0)
+#define PERF_INSTANT(ev) do { } while (0)
+#define PERF_SCOPE(ev) do { } while (0)
+
+#endif
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+
+// ドラッグしているいのちの周りの行 (フォーカス) を先に送る
+// 0 ならフレームの先頭から順に送り、フォーカスは送り終えるまでの時間を測るだけに使う
+#ifndef LCD_PRIORITY_SCAN
+#define LCD_PRIORITY_SCAN (1)
+#endif
+
+namespace shapoco {
+
+// フレーム毎のフォーカスの行範囲と、その位置を決めたタッチを読んだ時刻を持ち、
+// スキャンアウトがその範囲を送り終えたことを知らせる
+// set() は描く側が描いているフレームに、begin() / step() / take() はスキャンする側が呼ぶ
+// フレームの受け渡しは FramePipeline を通るので、同じフレームを両側が同時に触ることは無い
+template<int DEPTH>
+class ScanFocus {
+public:
+  struct Band {
+    int16_t y0 = 0;
+    int16_t y1 = 0;
+    uint64_t touchUs = 0;
+  };
+
+  // 行 [y0, y1) をフォーカスにする。呼ばなければそのフレームにフォーカスは無い
+  void set(int frameIndex, int y0, int y1, int height, uint64_t touchUs) {
+    Band &b = bands[frameIndex];
+    b.y0 = y0 < 0 ? 0 : y0;
+    b.y1 = y1 > height ? height : y1;
+    b.touchUs = touchUs;
+  }
+
+  // フレームのスキャンを始めるときに呼び、フォーカスの先頭の行を返す (無ければ -1)
+  // 前のフレームで描いた位置も消す必要があるので、その範囲も含める
+  int begin(int frameIndex) {
+    Band b = bands[frameIndex];
+    bands[frameIndex] = Band();
+    int y0 = b.y0;
+    int y1 = b.y1;
+    if (y0 < y1 && shown.y0 < shown.y1) {
+      if (shown.y0 < y0) y0 = shown.y0;
+      if (shown.y1 > y1) y1 = shown.y1;
+    }
+    shown = b;
+    scanY0 = y0;
+    scanY1 = y1;
+    rowsLeft = y0 < y1 ? y1 - y0 : 0;
+    touchUs = b.touchUs;
+    sent = false;
+    return rowsLeft > 0 ? y0 : -1;
+  }
+
+  // スキャンが y 行目を通り過ぎるときに呼ぶ
+  void step(int y) {
+    if (rowsLeft > 0 && scanY0 <= y && y < scanY1 && --rowsLeft == 0) sent = true;
+  }
+
+  // フォーカスを全て送り終えていたら、その位置を決めたタッチの時刻を返す (1 フレームに 1 回)
+  // 送った行の DMA が終わってから呼ぶこと
+  bool take(uint64_t *us) {
+    if (!sent) return false;
+    sent = false;
+    *us = touchUs;
+    return true;
+  }
+
+private:
+  Band bands[DEPTH];
+  // 前に送り始めたフレームのフォーカス
+  Band shown;
+  int scanY0 = 0;
+  int scanY1 = 0;
+  int rowsLeft = 0;
+  uint64_t touchUs = 0;
+  bool sent = false;
+};
+
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// LcdService のスキャンアウトの内側のループ
+// 変更のあったバイト列の検出と、パックされた画素の RGB565 への展開
+
+namespace shapoco {
+
+// ワード単位の比較は下位アドレスのバイトが下位ビットに来る前提
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static constexpr bool SCAN_KERNEL_BIG_ENDIAN = true;
+#else
+static constexpr bool SCAN_KERNEL_BIG_ENDIAN = false;
+#endif
+
+// バイト毎に、そのバイトが 0 なら 0x80、そうでなければ 0 を返す
+static inline uint32_t zeroBytes32(uint32_t x) {
+  return ~(((x & 0x7f7f7f7fu) + 0x7f7f7f7fu) | x | 0x7f7f7f7fu);
+}
+
+// 0 でないフラグのうち最も下位アドレスにあるバイトの位置
+static inline int firstByteIndex32(uint32_t flags) {
+  return SCAN_KERNEL_BIG_ENDIAN ? (__builtin_clz(flags) >> 3) : (__builtin_ctz(flags) >> 3);
+}
+
+static inline uint32_t loadAligned32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, __builtin_assume_aligned(p, 4), sizeof(v));
+  return v;
+}
+
+// [from, to) の中で oldLine と newLine が最初に異なるバイトから始まる連続した
+// 変更区間 [*runStart, *runEnd) を探す。変更が無ければ false を返す
+static inline bool findChangedRun(
+  const uint8_t *oldLine, const uint8_t *newLine, int from, int to,
+  int *runStart, int *runEnd
+) {
+  int i = from;
+  // 両方のポインタが同じだけずれている場合のみワード単位で比較する
+  bool wordable = (((uintptr_t)oldLine ^ (uintptr_t)newLine) & 3) == 0;
+
+  if (wordable) {
+    while (i < to && ((uintptr_t)(newLine + i) & 3)) {
+      if (oldLine[i] != newLine[i]) goto found;
+      i++;
+    }
+    while (i + 4 <= to) {
+      uint32_t x = loadAligned32(oldLine + i) ^ loadAligned32(newLine + i);
+      if (x) {
+        i += firstByteIndex32(x);
+        goto found;
+      }
+      i += 4;
+    }
+  }
+  while (i < to) {
+    if (oldLine[i] != newLine[i]) goto found;
+    i++;
+  }
+  return false;
+
+found:
+  *runStart = i;
+  i++;
+  if (wordable) {
+    while (i < to && ((uintptr_t)(newLine + i) & 3)) {
+      if (oldLine[i] == newLine[i]) goto end;
+      i++;
+    }
+    while (i + 4 <= to) {
+      uint32_t z = zeroBytes32(loadAligned32(oldLine + i) ^ loadAligned32(newLine + i));
+      if (z) {
+        i += firstByteIndex32(z);
+        goto end;
+      }
+      i += 4;
+    }
+  }
+  while (i < to && oldLine[i] != newLine[i]) i++;
+
+end:
+  *runEnd = i;
+  return true;
+}
+
+// 1 バイトに詰められた画素 (上位ビットが左) をまとめて展開するテーブル
+template<int BPP>
+struct ExpandTable {
+  static constexpr int PIXELS_PER_BYTE = 8 / BPP;
+  static constexpr int NUM_COLORS = 1 << BPP;
+
+  uint16_t pixels[256][PIXELS_PER_BYTE];
+
+  // colors: NUM_COLORS 色分の RGB565
+  constexpr ExpandTable(const uint16_t *colors) : pixels() {
+    for (int b = 0; b < 256; b++) {
+      for (int ipix = 0; ipix < PIXELS_PER_BYTE; ipix++) {
+        int colIndex = (b >> (8 - BPP * (ipix + 1))) & (NUM_COLORS - 1);
+        pixels[b][ipix] = colors[colIndex];
+      }
+    }
+  }
+
+  void expand(const uint8_t *src, int numBytes, uint16_t *dst) const {
+    if constexpr (PIXELS_PER_BYTE == 1) {
+      const uint16_t *table = pixels[0];
+      for (int i = 0; i < numBytes; i++) {
+        dst[i] = table[src[i]];
+      }
+      return;
+    }
+    for (int i = 0; i < numBytes; i++) {
+      memcpy(dst, pixels[src[i]], sizeof(pixels[0]));
+      dst += PIXELS_PER_BYTE;
+    }
+  }
+};
+
+// 1 ラインのハッシュ (前回送ったラインと同じか調べる)
+// 4 バイト毎に混ぜる
+static inline uint32_t hashLine(const uint8_t *p, int numBytes) {
+  uint32_t h = 2166136261u;
+  int i = 0;
+  for (; i + 4 <= numBytes; i += 4) {
+    uint32_t w;
+    memcpy(&w, p + i, sizeof(w));
+    h = (h ^ w) * 16777619u;
+    h ^= h >> 15;
+  }
+  for (; i < numBytes; i++) h = (h ^ p[i]) * 16777619u;
+  return h ^ (h >> 13);
+}
+
+// パネルの内容の代わりに覚えておく区間ハッシュの 1 区間のバイト数 (2bpp で 32 画素)
+static constexpr int HASH_SEGMENT_BYTES = 8;
+
+// 区間のハッシュ
+// 各段は前の値と入力のワードのどちらについても全単射なので、1 ワードだけが変わった場合は必ず値が変わる
+static inline uint32_t hashSegment(const uint8_t *p, int numBytes) {
+  uint32_t h = 0x9e3779b9u;
+  for (int i = 0; i < numBytes; i += 4) {
+    uint32_t w = 0;
+    memcpy(&w, p + i, numBytes - i < 4 ? numBytes - i : 4);
+    h = (h + w) * 0x85ebca6bu;
+    h ^= h >> 16;
+  }
+  return h;
+}
+
+// i 番目の区間のハッシュ。区間が全て入っていれば長さを定数にして展開させる
+static inline uint32_t hashSegmentAt(const uint8_t *line, int numBytes, int i) {
+  const uint8_t *p = line + i * HASH_SEGMENT_BYTES;
+  int n = numBytes - i * HASH_SEGMENT_BYTES;
+  if (n >= HASH_SEGMENT_BYTES) return hashSegment(p, HASH_SEGMENT_BYTES);
+  return hashSegment(p, n);
+}
+
+// 区間 [from, to) の中で hashes と一致しない最初の区間から続く区間 [*runStart, *runEnd) を探し、
+// 見た区間の hashes を新しい値にする。変更が無ければ false を返す
+// line は numBytes バイトで、最後の区間は短くてもよい
+static inline bool findChangedSegments(
+  uint32_t *hashes, const uint8_t *line, int numBytes, int from, int to,
+  int *runStart, int *runEnd
+) {
+  int i = from;
+  for (; i < to; i++) {
+    uint32_t h = hashSegmentAt(line, numBytes, i);
+    if (h != hashes[i]) {
+      hashes[i] = h;
+      break;
+    }
+  }
+  if (i >= to) return false;
+  *runStart = i++;
+  for (; i < to; i++) {
+    uint32_t h = hashSegmentAt(line, numBytes, i);
+    if (h == hashes[i]) break;
+    hashes[i] = h;
+  }
+  *runEnd = i;
+  return true;
+}
+
+// 以下は比較用の 1 バイトずつの実装
+
+static inline bool findChangedRunScalar(
+  const uint8_t *oldLine, const uint8_t *newLine, int from, int to,
+  int *runStart, int *runEnd
+) {
+  int i = from;
+  while (i < to && oldLine[i] == newLine[i]) i++;
+  if (i >= to) return false;
+  *runStart = i;
+  while (i < to && oldLine[i] != newLine[i]) i++;
+  *runEnd = i;
+  return true;
+}
+
+template<int BPP>
+static inline void expandPixelsScalar(
+  const uint8_t *src, int numBytes, const uint16_t *colors, uint16_t *dst
+) {
+  for (int i = 0; i < numBytes; i++) {
+    uint8_t sreg = src[i];
+    for (int ipix = 0; ipix < 8 / BPP; ipix++) {
+      *(dst++) = colors[(sreg >> (8 - BPP)) & ((1 << BPP) - 1)];
+      sreg <<= BPP;
+    }
+  }
+}
+
+}
@@ -0,0 +1,620 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+
+#ifdef SHAPOPAD_HOST
+#include "lgfx_host.hpp"
+#else
+#include "lgfx_ili9488.hpp"
+#endif
+
+#include "frame_hud.hpp"
+#include "frame_pipeline.hpp"
+#include "half_width_cache.hpp"
+#include "lcd_palette.hpp"
+#include "packed_raster.hpp"
+#include "perf_trace.hpp"
+#include "scan_focus.hpp"
+#include "scan_kernel.hpp"
+
+#ifndef LCD_DISPLAY_LIST_CAPACITY
+#define LCD_DISPLAY_LIST_CAPACITY (2048)
+#endif
+
+// LcdService と同じ API で、フレームバッファを持たずにスキャンアウトしながら 1 ラインずつ描く
+// - 描画は円のリストに記録するだけで、確定時に上端の行の順に並べておく
+// - スキャンアウトではそのラインに掛かる円 (アクティブな円) を記録順に塗ってから送る
+// - パネル上の各ラインのハッシュを覚えておき、変わらなかったラインは送らない
+
+namespace shapoco {
+
+using namespace lgfx;
+
+template<typename PALETTE, int WIDTH, int HEIGHT, int DEPTH = LCD_PIPELINE_DEPTH>
+class ScanlineService {
+public:
+  using PaletteType = PALETTE;
+  static constexpr int BPP = PALETTE::BPP;
+  static_assert(BPP == 1 || BPP == 2 || BPP == 4 || BPP == 8, "BPP must be 1, 2, 4 or 8");
+  static constexpr int PIXELS_PER_BYTE = 8 / BPP;
+  static constexpr uint8_t PALETTE_BACKGROUND = PALETTE::BACKGROUND;
+  static constexpr uint8_t PALETTE_FOREGROUND = PALETTE::FOREGROUND;
+  static constexpr ExpandTable<BPP> EXPAND_TABLE{PALETTE::RGB565};
+  static constexpr HudAtlas<BPP> HUD_ATLAS{PALETTE_FOREGROUND, PALETTE_BACKGROUND};
+  using Raster = PackedRaster<BPP>;
+  using Circle = typename Raster::Circle;
+
+  static constexpr int width = WIDTH;
+  static constexpr int height = HEIGHT;
+  static constexpr int stride = (WIDTH * BPP + 7) / 8;
+  static_assert(WIDTH % PIXELS_PER_BYTE == 0, "WIDTH must be a multiple of pixels per byte");
+  static_assert(HEIGHT <= 0x10000, "line counts are 16 bits");
+
+  // 描画中、送る順番待ち、スキャン中のフレーム分のリスト
+  static constexpr int PIPELINE_DEPTH = DEPTH;
+  static constexpr int NUM_SLOTS = DEPTH;
+  static constexpr int CAPACITY = LCD_DISPLAY_LIST_CAPACITY;
+  static_assert(CAPACITY <= 0x10000, "item index is 16 bits");
+  // HUD の左上 (LcdService と同じ)
+  static constexpr int HUD_X = 8;
+  static constexpr int HUD_Y = 4;
+  static constexpr int HUD_HEIGHT = HudText::MAX_LINES * HudAtlas<BPP>::CELL_HEIGHT;
+  static constexpr int MAX_LINE_BUFFS = 4;
+  static constexpr int SCAN_LINES_PER_SERVICE = 8;
+
+  // 上下に続く変更ラインを矩形にまとめる (LcdService と同じ基準)
+  static constexpr int WINDOW_COMMAND_BYTES = (3 + 8) * 2;
+  static constexpr int BYTES_PER_PACKED_BYTE = PIXELS_PER_BYTE * sizeof(uint16_t);
+  static constexpr int RECT_MAX_LINES = 4;
+
+  // 半幅のテーブルの領域 (シーンの半径がほぼ全て入る)
+  static constexpr int HALF_WIDTH_POOL = 2048;
+  using HalfWidths = HalfWidthCache<HALF_WIDTH_POOL>;
+
+  // バイト単位の [x0, x1) x [y0, y1)
+  struct Rect {
+    int16_t x0, x1, y0, y1;
+  };
+
+  struct ScanStats {
+    uint64_t frames = 0;
+    uint64_t linesRendered = 0;
+    uint64_t linesChanged = 0;   // ハッシュが変わったライン
+    uint64_t activeItems = 0;    // ライン毎のアクティブな円の数の合計
+    uint64_t bytesSent = 0;      // 送ったパックされた形式のバイト数
+    uint64_t windows = 0;
+    uint64_t commandBytes = 0;
+    uint64_t pixelBytes = 0;
+    uint64_t droppedItems = 0;   // リストが溢れて描かなかった円
+  };
+
+  struct Slot {
+    Circle *items = nullptr;
+    // 画面に掛かる円の番号を上端の行の順に並べたもの (同じ行なら記録順)
+    uint16_t *order = nullptr;
+    int count = 0;
+    int dropped = 0;
+    int numOrdered = 0;
+    bool ordered = false;
+    uint8_t bg = PALETTE_BACKGROUND;
+    // HUD (HUD_Y から textHeight 行分)
+    LGFX_Sprite text;
+    int textWidth = 0;
+    int textHeight = 0;
+  };
+
+  const int rotation;
+  LGFX_ILI9488 lcd;
+  Slot slots[NUM_SLOTS];
+  HalfWidths halfWidths;
+
+  int numLineBuffs = 2;
+  uint16_t *lineBuffs[MAX_LINE_BUFFS] = {nullptr};
+  int nextLineBuff = 0;
+  int lineBuffInFlight = -1;
+
+  // パネルの各ラインのハッシュと、背景色以外を含むバイト範囲
+  uint32_t lineHash[HEIGHT];
+  int16_t shownX0[HEIGHT];
+  int16_t shownX1[HEIGHT];
+
+  // スキャン中のラインに掛かる円 (記録順)。activeY が負なら次のラインで作り直す
+  uint16_t *active;
+  int numActive = 0;
+  int nextOrdered = 0;
+  int activeY = -1;
+
+  // 送る前の矩形のライン (パックされた形式)
+  uint8_t rectLines[stride * RECT_MAX_LINES];
+  Rect openRect;
+  bool rectOpen = false;
+
+  bool coalesceRects = true;
+  // false なら毎回全てのラインを送る
+  bool dirtyTracking = true;
+  ScanStats scanStats;
+
+  int drawIndex = 0;
+  int scanIndex = 1;
+  FramePipeline<DEPTH> pipeline;
+
+  int scanY = 0;
+  int scanRemaining = 0;
+  bool dmaStarted = false;
+  bool firstTrans = true;
+  // ドラッグしているいのちの周りから送り始める。false でもフォーカスを送り終えた時刻は知らせる
+  bool priorityScan = LCD_PRIORITY_SCAN;
+  ScanFocus<DEPTH> focus;
+
+  uint64_t fpsStartTimeMs = 0;
+  int fpsFrameCount = 0;
+  std::atomic<uint32_t> fpsX10{0};
+  std::atomic<uint32_t> lastFrameBytes{0};
+  uint64_t frameStartPixelBytes = 0;
+
+  ScanlineService(int rotation) :
+    rotation(rotation),
+    lcd(WIDTH, HEIGHT, rotation),
+    active(new uint16_t[CAPACITY])
+  {
+    for (int i = 0; i < NUM_SLOTS; i++) {
+      slots[i].items = new Circle[CAPACITY];
+      slots[i].order = new uint16_t[CAPACITY];
+    }
+  }
+
+  ~ScanlineService() {
+    for (int i = 0; i < NUM_SLOTS; i++) {
+      delete[] slots[i].items;
+      delete[] slots[i].order;
+    }
+    delete[] active;
+    delete[] lineBuffs[0];
+  }
+
+  ScanlineService(const ScanlineService &) = delete;
+  ScanlineService &operator=(const ScanlineService &) = delete;
+
+  void init(uint64_t nowMs) {
+    delete[] lineBuffs[0];
+    lineBuffs[0] = new uint16_t[width * RECT_MAX_LINES * numLineBuffs];
+    for (int i = 1; i < numLineBuffs; i++) {
+      lineBuffs[i] = lineBuffs[0] + width * RECT_MAX_LINES * i;
+    }
+
+    lcd.init();
+    lcd.setRotation(rotation);
+    lcd.setColorDepth(16);
+    for (int i = 0; i < NUM_SLOTS; i++) {
+      Slot &s = slots[i];
+      s.count = 0;
+      s.dropped = 0;
+      s.numOrdered = 0;
+      s.ordered = true;
+      s.bg = PALETTE_BACKGROUND;
+      s.text.setColorDepth(BPP);
+      s.text.createSprite(width, HUD_HEIGHT);
+      s.textWidth = 0;
+      s.textHeight = 0;
+    }
+    for (int y = 0; y < height; y++) {
+      lineHash[y] = 0;
+      shownX0[y] = 0;
+      shownX1[y] = stride;
+    }
+    halfWidths.clear();
+    numActive = 0;
+    nextOrdered = 0;
+    activeY = -1;
+    rectOpen = false;
+    drawIndex = 0;
+    scanIndex = 1;
+    pipeline.reset(drawIndex, scanIndex);
+    scanY = 0;
+    scanRemaining = 0;
+    nextLineBuff = 0;
+    lineBuffInFlight = -1;
+    firstTrans = true;
+    fpsStartTimeMs = nowMs;
+    fpsFrameCount = 0;
+    fpsX10.store(0, std::memory_order_relaxed);
+    lastFrameBytes.store(0, std::memory_order_relaxed);
+    frameStartPixelBytes = scanStats.pixelBytes;
+  }
+
+  // フレームの状態に使うメモリのバイト数 (LcdService::frameMemoryBytes() と比べる)
+  int frameMemoryBytes() const {
+    return sizeof(*this)
+      + NUM_SLOTS * CAPACITY * (sizeof(Circle) + sizeof(uint16_t))
+      + NUM_SLOTS * stride * HUD_HEIGHT
+      + CAPACITY * sizeof(uint16_t)
+      + width * RECT_MAX_LINES * numLineBuffs * sizeof(uint16_t);
+  }
+
+  // 描画は次の commitFrame() まで記録するだけ
+
+  void clearBackBuffer(uint8_t col = PALETTE_BACKGROUND) {
+    Slot &s = slots[drawIndex];
+    s.bg = col;
+    s.count = 0;
+    s.dropped = 0;
+    s.ordered = false;
+    s.textWidth = 0;
+    s.textHeight = 0;
+  }
+
+  void fillCircle(int x, int y, int r, uint8_t col) {
+    Slot &s = slots[drawIndex];
+    if (s.count >= CAPACITY) {
+      // フレームバッファが無いので、溢れた円は描けない
+      s.dropped++;
+      scanStats.droppedItems++;
+      return;
+    }
+    s.items[s.count++] = Circle{(int16_t)x, (int16_t)y, (int16_t)r, col};
+    s.ordered = false;
+  }
+
+  void fillCircles(const Circle *circles, int n) {
+    for (int i = 0; i < n; i++) fillCircle(circles[i].x, circles[i].y, circles[i].r, circles[i].col);
+  }
+
+  // 記録した円を上端の行の順に並べる。flip() / submitBackBuffer() からも呼ぶ
+  void commitFrame() {
+    Slot &s = slots[drawIndex];
+    if (s.ordered) return;
+    s.ordered = true;
+
+    // 行毎に数えてから並べるので、同じ行の中は記録順になる
+    uint16_t start[HEIGHT + 1];
+    memset(start, 0, sizeof(start));
+    for (int i = 0; i < s.count; i++) {
+      const Circle &c = s.items[i];
+      if (visible(c)) start[top(c) + 1]++;
+    }
+    for (int y = 0; y < height; y++) start[y + 1] += start[y];
+    s.numOrdered = start[height];
+    for (int i = 0; i < s.count; i++) {
+      const Circle &c = s.items[i];
+      if (visible(c)) s.order[start[top(c)]++] = i;
+    }
+  }
+
+  void flip() {
+    PERF_INSTANT(SUBMIT);
+    commitFrame();
+    int frameIndex = drawIndex;
+    drawIndex = scanIndex;
+    pipeline.flipped(frameIndex, drawIndex);
+    startScan(frameIndex);
+  }
+
+  // 以下はスキャンアウトを別のコアで行う場合に使う (LcdService と同じ)
+
+  bool acquireBackBuffer() {
+    if (drawIndex >= 0) return true;
+    int i = pipeline.acquire();
+    if (i < 0) return false;
+    drawIndex = i;
+    return true;
+  }
+
+  void submitBackBuffer() {
+    PERF_INSTANT(SUBMIT);
+    commitFrame();
+    pipeline.submit(drawIndex);
+    drawIndex = -1;
+  }
+
+  bool serviceScanOut(uint64_t nowMs) {
+    if (idle()) {
+      int frameIndex = pipeline.takeNext(scanIndex);
+      if (frameIndex < 0) return false;
+      startScan(frameIndex);
+    }
+    serviceStart(nowMs);
+    serviceEnd(nowMs);
+    if (idle()) pipeline.scanned();
+    return true;
+  }
+
+  bool scanOutDrained() const {
+    return pipeline.drained();
+  }
+
+  void startScan(int frameIndex) {
+    scanIndex = frameIndex;
+    int focusY = focus.begin(frameIndex);
+    if (idle()) {
+      // フォーカスから送り始め、下端で折り返して残りを送る (最初のフレームは全体を先頭から)
+      scanY = priorityScan && focusY >= 0 && !firstTrans ? focusY : 0;
+    }
+    scanRemaining = height;
+    // スキャンの途中でフレームが替わったらアクティブな円を作り直す
+    activeY = -1;
+    scanStats.frames++;
+  }
+
+  void serviceStart(uint64_t nowMs) {
+    if (idle()) return;
+    PERF_SCOPE(SCAN);
+    Slot &s = slots[scanIndex];
+    int numLines = 0;
+    while (scanRemaining > 0 && numLines < SCAN_LINES_PER_SERVICE) {
+      scanLine(s, scanY);
+      numLines++;
+      stepScanLine(nowMs);
+    }
+    // 次の呼び出しまでにスキャン中のフレームが替わるかもしれないので全て送っておく
+    if (rectOpen) flushRect();
+  }
+
+  void serviceEnd(uint64_t nowMs) {
+    if (dmaStarted) {
+      PERF_SCOPE(DMA_WAIT);
+      lcd.endWrite();
+      dmaStarted = false;
+      lineBuffInFlight = -1;
+    }
+  }
+
+  // 表示しないときはスキャンアウトで重ねないだけ
+  void paintHud(FrameHud &hud) {
+    Slot &s = slots[drawIndex];
+    s.textWidth = 0;
+    s.textHeight = 0;
+    if (!hud.enabled()) return;
+    const HudText &text = hud.refresh(fpsX10.load(std::memory_order_relaxed), lastFrameBytes.load(std::memory_order_relaxed));
+    s.textWidth = HUD_ATLAS.draw((uint8_t*)s.text.getBuffer(), stride, width, HUD_X, 0, text);
+    s.textHeight = text.numLines * HudAtlas<BPP>::CELL_HEIGHT;
+  }
+
+  bool idle() {
+    return scanRemaining <= 0;
+  }
+
+  // 転送を始めておらず、バスを他のデバイス (タッチパネル) に使わせてよい
+  bool busFree() const {
+    return !dmaStarted;
+  }
+
+  // コア 0: 描いているフレームで先に送る行 [y0, y1) と、その位置を決めたタッチを読んだ時刻
+  void setFocus(int y0, int y1, uint64_t touchUs) {
+    focus.set(drawIndex, y0, y1, height, touchUs);
+  }
+
+  // スキャンする側: フォーカスを送り終えて DMA も終わっていれば、そのタッチの時刻を返す
+  bool takeFocusSent(uint64_t *touchUs) {
+    return !dmaStarted && focus.take(touchUs);
+  }
+
+  // 描画中 / スキャン中のフレームの y ラインをパックされた形式で dst に描く (検証用)
+  // スキャンアウトとは別に、全ての円を順に見て描く
+  void readBackLine(int y, uint8_t *dst) { renderLineDirect(slots[drawIndex], y, dst); }
+  void readFrontLine(int y, uint8_t *dst) { renderLineDirect(slots[scanIndex], y, dst); }
+
+private:
+  static bool visible(const Circle &c) {
+    return 0 <= c.r && c.r <= Raster::MAX_RADIUS
+      && c.y + c.r >= 0 && c.y - c.r < HEIGHT
+      && c.x + c.r >= 0 && c.x - c.r < WIDTH;
+  }
+
+  static int top(const Circle &c) {
+    return c.y - c.r < 0 ? 0 : c.y - c.r;
+  }
+
+  // y ラインに掛かる円を active に揃える (y が前回の次のラインでなければ最初から)
+  void advanceActive(Slot &s, int y) {
+    if (activeY < 0 || y != activeY + 1) {
+      // フォーカスから送り始めると途中から作り直すので、上で終わった円は入れず、
+      // 残った円を並べてから一度だけレコード順に並べ替える
+      numActive = 0;
+      nextOrdered = 0;
+      while (nextOrdered < s.numOrdered) {
+        uint16_t idx = s.order[nextOrdered];
+        const Circle &c = s.items[idx];
+        if (top(c) > y) break;
+        nextOrdered++;
+        if (c.y + c.r >= y) active[numActive++] = idx;
+      }
+      std::sort(active, active + numActive);
+    }
+    while (nextOrdered < s.numOrdered) {
+      uint16_t idx = s.order[nextOrdered];
+      if (top(s.items[idx]) > y) break;
+      nextOrdered++;
+      // 新しく掛かる円は少ないので後ろから挿入する
+      int i = numActive++;
+      while (i > 0 && active[i - 1] > idx) {
+        active[i] = active[i - 1];
+        i--;
+      }
+      active[i] = idx;
+    }
+    activeY = y;
+  }
+
+  // アクティブな円で 1 ラインを描き、背景色以外のバイト範囲を返す
+  // 通り過ぎた円は active から外す
+  void renderLine(Slot &s, int y, uint8_t *line, int *ex0, int *ex1) {
+    memset(line, Raster::pattern(s.bg), stride);
+    int x0 = WIDTH;
+    int x1 = 0;
+    int n = 0;
+    for (int i = 0; i < numActive; i++) {
+      uint16_t idx = active[i];
+      const Circle &c = s.items[idx];
+      if (c.y + c.r < y) continue;
+      active[n++] = idx;
+      int hw = halfWidths.lookup(c.r)[y < c.y ? c.y - y : y - c.y];
+      if (hw < 0) continue;
+      int sx0 = c.x - hw < 0 ? 0 : c.x - hw;
+      int sx1 = c.x + hw + 1 > WIDTH ? WIDTH : c.x + hw + 1;
+      if (sx0 >= sx1) continue;
+      Raster::fillSpan(line, sx0, sx1, Raster::pattern(c.col));
+      if (sx0 < x0) x0 = sx0;
+      if (sx1 > x1) x1 = sx1;
+    }
+    numActive = n;
+    scanStats.activeItems += n;
+    overlayText(s, y, line, &x0, &x1);
+
+    if (s.bg != PALETTE_BACKGROUND) {
+      *ex0 = 0;
+      *ex1 = stride;
+    }
+    else if (x0 < x1) {
+      *ex0 = x0 / PIXELS_PER_BYTE;
+      *ex1 = (x1 + PIXELS_PER_BYTE - 1) / PIXELS_PER_BYTE;
+    }
+    else {
+      *ex0 = *ex1 = 0;
+    }
+  }
+
+  void renderLineDirect(Slot &s, int y, uint8_t *line) {
+    memset(line, Raster::pattern(s.bg), stride);
+    int16_t halfWidth[Raster::MAX_RADIUS + 1];
+    for (int i = 0; i < s.count; i++) {
+      const Circle &c = s.items[i];
+      if (!visible(c) || y < c.y - c.r || y > c.y + c.r) continue;
+      Raster::circleHalfWidths(c.r, halfWidth);
+      Raster::fillCircleRows(line - stride * y, stride, 0, y, WIDTH, y + 1, c.x, c.y, c.r, halfWidth, Raster::pattern(c.col));
+    }
+    int x0 = WIDTH;
+    int x1 = 0;
+    overlayText(s, y, line, &x0, &x1);
+  }
+
+  void overlayText(Slot &s, int y, uint8_t *line, int *x0, int *x1) {
+    if (s.textWidth <= 0 || y < HUD_Y || y >= HUD_Y + s.textHeight) return;
+    int tx1 = HUD_X + s.textWidth > WIDTH ? WIDTH : HUD_X + s.textWidth;
+    const uint8_t *src = (const uint8_t*)s.text.getBuffer() + stride * (y - HUD_Y);
+    Raster::copySpan(line, src, HUD_X, tx1);
+    if (HUD_X < *x0) *x0 = HUD_X;
+    if (tx1 > *x1) *x1 = tx1;
+  }
+
+  void scanLine(Slot &s, int y) {
+    advanceActive(s, y);
+    int row = rectOpen ? openRect.y1 - openRect.y0 : 0;
+    uint8_t *line = rectLines + stride * row;
+    int ex0, ex1;
+    renderLine(s, y, line, &ex0, &ex1);
+    scanStats.linesRendered++;
+
+    // パネル上の前の内容と今回の内容の両方を含む範囲を送る
+    uint32_t h = hashLine(line, stride);
+    bool changed = h != lineHash[y];
+    int sx0 = ex0 < shownX0[y] ? ex0 : shownX0[y];
+    int sx1 = ex1 > shownX1[y] ? ex1 : shownX1[y];
+    if (ex0 >= ex1) {
+      sx0 = shownX0[y];
+      sx1 = shownX1[y];
+    }
+    else if (shownX0[y] >= shownX1[y]) {
+      sx0 = ex0;
+      sx1 = ex1;
+    }
+    if (firstTrans || !dirtyTracking) {
+      changed = true;
+      sx0 = 0;
+      sx1 = stride;
+    }
+    lineHash[y] = h;
+    shownX0[y] = ex0;
+    shownX1[y] = ex1;
+    if (changed) scanStats.linesChanged++;
+
+    if (!changed || sx0 >= sx1) {
+      if (rectOpen) flushRect();
+      return;
+    }
+    addLine(sx0, sx1, y, line);
+  }
+
+  // y ラインの [x0, x1) を、上のラインから続く矩形に加えるか新しい矩形にする
+  void addLine(int x0, int x1, int y, const uint8_t *line) {
+    if (rectOpen) {
+      const Rect &r = openRect;
+      int nx0 = x0 < r.x0 ? x0 : r.x0;
+      int nx1 = x1 > r.x1 ? x1 : r.x1;
+      int added = (nx1 - nx0) * (y + 1 - r.y0) - (r.x1 - r.x0) * (r.y1 - r.y0);
+      int gain = WINDOW_COMMAND_BYTES + ((x1 - x0) - added) * BYTES_PER_PACKED_BYTE;
+      if (coalesceRects && r.y1 == y && gain >= 0) {
+        openRect.x0 = nx0;
+        openRect.x1 = nx1;
+        openRect.y1 = y + 1;
+        if (openRect.y1 - openRect.y0 >= RECT_MAX_LINES) flushRect();
+        return;
+      }
+      flushRect();
+      memmove(rectLines, line, stride);
+    }
+    openRect = Rect{(int16_t)x0, (int16_t)x1, (int16_t)y, (int16_t)(y + 1)};
+    rectOpen = true;
+    if (!coalesceRects) flushRect();
+  }
+
+  void flushRect() {
+    rectOpen = false;
+    if (!dmaStarted) {
+      lcd.startWrite();
+      dmaStarted = true;
+    }
+    const Rect &r = openRect;
+    int numBytes = r.x1 - r.x0;
+    int numPixs = numBytes * PIXELS_PER_BYTE;
+    int numLines = r.y1 - r.y0;
+    uint16_t *lineBuff = acquireLineBuff();
+    PERF_BEGIN(CONVERT);
+    for (int i = 0; i < numLines; i++) {
+      EXPAND_TABLE.expand(rectLines + stride * i + r.x0, numBytes, lineBuff + numPixs * i);
+    }
+    PERF_END(CONVERT);
+    lcd.pushImageDMA(r.x0 * PIXELS_PER_BYTE, r.y0, numPixs, numLines, lineBuff);
+
+    scanStats.windows++;
+    scanStats.commandBytes += WINDOW_COMMAND_BYTES;
+    scanStats.pixelBytes += numPixs * numLines * sizeof(uint16_t);
+    scanStats.bytesSent += numBytes * numLines;
+  }
+
+  uint16_t *acquireLineBuff() {
+    int i = nextLineBuff;
+    nextLineBuff = (i + 1) % numLineBuffs;
+    if (i == lineBuffInFlight) {
+      PERF_SCOPE(DMA_WAIT);
+      lcd.waitDMA();
+    }
+    lineBuffInFlight = i;
+    return lineBuffs[i];
+  }
+
+  void stepScanLine(uint64_t nowMs) {
+    focus.step(scanY);
+    scanRemaining -= 1;
+    scanY = scanY + 1 < height ? scanY + 1 : 0;
+    // フォーカスから送ると下端はフレームの途中なので、送るラインが尽きたところをフレームの終わりにする
+    if (scanRemaining == 0) {
+      // 最後の矩形もこのフレームのバイト数に数える
+      if (rectOpen) flushRect();
+      firstTrans = false;
+      fpsFrameCount++;
+      lastFrameBytes.store(scanStats.pixelBytes - frameStartPixelBytes, std::memory_order_relaxed);
+      frameStartPixelBytes = scanStats.pixelBytes;
+      uint32_t elapsedMs = nowMs - fpsStartTimeMs;
+      if (elapsedMs >= 1000) {
+        fpsX10.store(fpsFrameCount * 10000 / elapsedMs, std::memory_order_relaxed);
+        fpsStartTimeMs = nowMs;
+        fpsFrameCount = 0;
+      }
+    }
+  }
+};
+
+}
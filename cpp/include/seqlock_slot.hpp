@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <type_traits>
+
+namespace shapoco {
+
+// 最新の値を 1 つだけ持つ seqlock
+// store() は書く側のコア (スレッド) からのみ呼ぶ。load() は書いている途中に当たったら読み直す
+// 値は 32bit の atomic に分けて持つので Cortex-M0+ でもロックフリーで、書きかけの値を返すことも無い
+template<typename T>
+class SeqLockSlot {
+  static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+
+public:
+  static constexpr int NUM_WORDS = (sizeof(T) + 3) / 4;
+
+  void store(const T &value) {
+    uint32_t w[NUM_WORDS] = {};
+    memcpy(w, &value, sizeof(T));
+    uint32_t s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < NUM_WORDS; i++) words[i].store(w[i], std::memory_order_relaxed);
+    seq.store(s + 2, std::memory_order_release);
+  }
+
+  // store() された回数を返す。0 ならまだ何も書かれていない
+  uint32_t load(T *value) const {
+    uint32_t w[NUM_WORDS];
+    uint32_t s0, s1;
+    do {
+      s0 = seq.load(std::memory_order_acquire);
+      for (int i = 0; i < NUM_WORDS; i++) w[i] = words[i].load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      s1 = seq.load(std::memory_order_relaxed);
+    } while ((s0 & 1) || s0 != s1);
+    memcpy(value, w, sizeof(T));
+    return s0 / 2;
+  }
+
+private:
+  std::atomic<uint32_t> seq{0};
+  std::atomic<uint32_t> words[NUM_WORDS] = {};
+};
+
+}
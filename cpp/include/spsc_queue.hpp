@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+namespace shapoco {
+
+// 単一生産者・単一消費者のロックフリーキュー
+// push() は生産者側、pop() は消費者側のコア (スレッド) からのみ呼ぶこと
+// 32bit の load/store しか使わないので Cortex-M0+ でもロックフリーになる
+template<typename T, int CAPACITY>
+class SpscQueue {
+  static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of 2");
+
+public:
+  bool push(const T &value) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) >= (uint32_t)CAPACITY) return false;
+    items[t & (CAPACITY - 1)] = value;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T *value) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) return false;
+    *value = items[h & (CAPACITY - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // 以下は相手側が動いている間は目安にしかならない
+  bool empty() const {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+
+  int size() const {
+    return (int)(tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire));
+  }
+
+  // 両側とも止まっているときにだけ呼ぶこと
+  void reset() {
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  T items[CAPACITY];
+  std::atomic<uint32_t> head{0};
+  std::atomic<uint32_t> tail{0};
+};
+
+}
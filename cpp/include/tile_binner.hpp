@@ -0,0 +1,242 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "packed_raster.hpp"
+
+// 記録した円をタイル毎のリストに振り分け、タイル毎に掛かっている円だけで塗る
+// タイル毎のリストのハッシュを覚えておき、
+// - バッファに前回描いた内容と同じタイルは塗らない
+// - 直前のフレームと同じタイルはスキャンアウトでも比較しない
+
+namespace shapoco {
+
+template<int BPP, int WIDTH, int HEIGHT, int NUM_SLOTS, int CAPACITY>
+class TileBinner {
+public:
+  using Raster = PackedRaster<BPP>;
+  using Circle = typename Raster::Circle;
+  static constexpr int TILE_SIZE = 32;
+  static constexpr int TILES_X = (WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+  static constexpr int TILES_Y = (HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+  static constexpr int NUM_TILES = TILES_X * TILES_Y;
+  // タイルに振り分けた参照の数の上限
+  static constexpr int MAX_REFS = CAPACITY * 4;
+  static_assert(CAPACITY <= 0x10000, "item index is 16 bits");
+  static_assert(MAX_REFS <= 0xffff, "bin offsets are 16 bits");
+  static_assert(TILE_SIZE % Raster::PIXELS_PER_BYTE == 0, "tiles must be byte aligned");
+  static_assert(TILES_X <= 64, "tile row mask is 64 bits");
+
+  struct Stats {
+    uint64_t frames = 0;
+    uint64_t refs = 0;
+    uint64_t tilesDrawn = 0;
+    uint64_t tilesSkipped = 0;
+    uint64_t tilesChanged = 0;  // 直前のフレームから変わったタイル (スキャンアウトの対象)
+    uint64_t refOverflows = 0;
+  };
+
+  // タイル t の参照は binRefs[binStart[t] .. binStart[t + 1])
+  uint16_t binStart[NUM_TILES + 1];
+  uint16_t *binRefs;
+  uint32_t tileHash[NUM_TILES];
+  // スロット (描画バッファ) 毎の内容のハッシュと、直前のフレームのハッシュ
+  uint32_t slotHash[NUM_SLOTS][NUM_TILES];
+  bool slotValid[NUM_SLOTS];
+  uint32_t prevHash[NUM_TILES];
+  bool prevValid = false;
+  // 塗る円の番号の集合 (使い終わったら 0 に戻す)
+  uint32_t itemBits[(CAPACITY + 31) / 32];
+  Stats stats;
+
+  TileBinner() : binRefs(new uint16_t[MAX_REFS]) {
+    memset(itemBits, 0, sizeof(itemBits));
+    invalidate();
+  }
+
+  ~TileBinner() {
+    delete[] binRefs;
+  }
+
+  TileBinner(const TileBinner &) = delete;
+  TileBinner &operator=(const TileBinner &) = delete;
+
+  void invalidate() {
+    for (int i = 0; i < NUM_SLOTS; i++) slotValid[i] = false;
+    prevValid = false;
+  }
+
+  // バッファの内容がハッシュと対応しなくなった (直接描いた)
+  // そのフレームもスキャンアウトされるので直前のフレームのハッシュも捨てる
+  void invalidate(int slot) {
+    slotValid[slot] = false;
+    prevValid = false;
+  }
+
+  // 次のフレームの直前に送られるフレームが render() で描いたものでない
+  void forgetPrevious() {
+    prevValid = false;
+  }
+
+  // items で slot のバッファを更新する
+  // forceX0..forceY1 はリスト以外で描いたもの (文字など) の跡で、そこのタイルは必ず塗り直す
+  // markChanged(x0, y0, x1, y1) には直前のフレームから変わったタイルの矩形を渡す
+  // drawFull(c) は切り取りの要らない円を描く
+  // 振り分けが溢れたら false を返し、何もしない
+  template<typename MARK_CHANGED, typename DRAW_FULL>
+  bool render(int slot, uint8_t *buff, int stride, uint8_t bg, const Circle *items, int n,
+      int forceX0, int forceY0, int forceX1, int forceY1, MARK_CHANGED markChanged, DRAW_FULL drawFull) {
+    if (!bin(items, n)) {
+      stats.refOverflows++;
+      invalidate(slot);
+      return false;
+    }
+    stats.frames++;
+
+    int ftx0 = forceX0 / TILE_SIZE;
+    int fty0 = forceY0 / TILE_SIZE;
+    int ftx1 = forceX1 > forceX0 ? (forceX1 + TILE_SIZE - 1) / TILE_SIZE : ftx0;
+    int fty1 = forceY1 > forceY0 ? (forceY1 + TILE_SIZE - 1) / TILE_SIZE : fty0;
+
+    // 塗り直すタイルを決める
+    uint64_t drawMask[TILES_Y];
+    for (int ty = 0; ty < TILES_Y; ty++) {
+      drawMask[ty] = 0;
+      for (int tx = 0; tx < TILES_X; tx++) {
+        int t = ty * TILES_X + tx;
+        uint32_t h = tileHash[t];
+        if (!prevValid || prevHash[t] != h) {
+          stats.tilesChanged++;
+          markChanged(tx * TILE_SIZE, ty * TILE_SIZE, clipX((tx + 1) * TILE_SIZE), clipY((ty + 1) * TILE_SIZE));
+        }
+        prevHash[t] = h;
+        bool forced = ftx0 <= tx && tx < ftx1 && fty0 <= ty && ty < fty1;
+        if (slotValid[slot] && !forced && slotHash[slot][t] == h) {
+          stats.tilesSkipped++;
+          continue;
+        }
+        slotHash[slot][t] = h;
+        stats.tilesDrawn++;
+        drawMask[ty] |= (uint64_t)1 << tx;
+      }
+    }
+    slotValid[slot] = true;
+    prevValid = true;
+
+    // 横に並んだタイルはまとめて、掛かっている円を記録順に塗る
+    int16_t halfWidth[Raster::MAX_RADIUS + 1];
+    int tableRadius = -1;
+    for (int ty = 0; ty < TILES_Y; ty++) {
+      uint64_t m = drawMask[ty];
+      int y0 = ty * TILE_SIZE;
+      int y1 = clipY(y0 + TILE_SIZE);
+      while (m) {
+        int tx0 = __builtin_ctzll(m);
+        int tx1 = tx0;
+        while (tx1 < TILES_X && (m >> tx1) & 1) tx1++;
+        m &= ~((tx1 >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << tx1) - 1));
+        int x0 = tx0 * TILE_SIZE;
+        int x1 = clipX(tx1 * TILE_SIZE);
+        Raster::fillRect(buff, stride, x0, y0, x1, y1, bg);
+
+        int first = n;
+        int last = -1;
+        for (int t = ty * TILES_X + tx0; t < ty * TILES_X + tx1; t++) {
+          for (int k = binStart[t]; k < binStart[t + 1]; k++) {
+            int i = binRefs[k];
+            itemBits[i >> 5] |= (uint32_t)1 << (i & 31);
+            if (i < first) first = i;
+            if (i > last) last = i;
+          }
+        }
+        for (int w = first >> 5; w <= (last >> 5); w++) {
+          uint32_t bits = itemBits[w];
+          itemBits[w] = 0;
+          while (bits) {
+            const Circle &c = items[(w << 5) + __builtin_ctz(bits)];
+            bits &= bits - 1;
+            if (c.x - c.r >= x0 && c.x + c.r < x1 && c.y - c.r >= y0 && c.y + c.r < y1) {
+              drawFull(c);
+              continue;
+            }
+            if (c.r != tableRadius) {
+              Raster::circleHalfWidths(c.r, halfWidth);
+              tableRadius = c.r;
+            }
+            Raster::fillCircleRows(buff, stride, x0, y0, x1, y1, c.x, c.y, c.r, halfWidth, Raster::pattern(c.col));
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+private:
+  static int clipX(int x) { return x > WIDTH ? WIDTH : x; }
+  static int clipY(int y) { return y > HEIGHT ? HEIGHT : y; }
+
+  static bool tileRange(const Circle &c, int *tx0, int *ty0, int *tx1, int *ty1) {
+    if (c.r < 0 || c.r > Raster::MAX_RADIUS) return false;
+    int x0 = c.x - c.r < 0 ? 0 : c.x - c.r;
+    int y0 = c.y - c.r < 0 ? 0 : c.y - c.r;
+    int x1 = c.x + c.r + 1 > WIDTH ? WIDTH : c.x + c.r + 1;
+    int y1 = c.y + c.r + 1 > HEIGHT ? HEIGHT : c.y + c.r + 1;
+    if (x0 >= x1 || y0 >= y1) return false;
+    *tx0 = x0 / TILE_SIZE;
+    *ty0 = y0 / TILE_SIZE;
+    *tx1 = (x1 + TILE_SIZE - 1) / TILE_SIZE;
+    *ty1 = (y1 + TILE_SIZE - 1) / TILE_SIZE;
+    return true;
+  }
+
+  // 数えてから並べるので、各タイルの中は記録順になる
+  bool bin(const Circle *items, int n) {
+    uint16_t count[NUM_TILES];
+    memset(count, 0, sizeof(count));
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+      int tx0, ty0, tx1, ty1;
+      if (!tileRange(items[i], &tx0, &ty0, &tx1, &ty1)) continue;
+      total += (tx1 - tx0) * (ty1 - ty0);
+      if (total > MAX_REFS) return false;
+      for (int ty = ty0; ty < ty1; ty++) {
+        for (int tx = tx0; tx < tx1; tx++) count[ty * TILES_X + tx]++;
+      }
+    }
+    stats.refs += total;
+
+    int sum = 0;
+    for (int t = 0; t < NUM_TILES; t++) {
+      binStart[t] = sum;
+      sum += count[t];
+      count[t] = 0;
+      tileHash[t] = 2166136261u;
+    }
+    binStart[NUM_TILES] = sum;
+
+    for (int i = 0; i < n; i++) {
+      const Circle &c = items[i];
+      int tx0, ty0, tx1, ty1;
+      if (!tileRange(c, &tx0, &ty0, &tx1, &ty1)) continue;
+      uint32_t key = hashCircle(c);
+      for (int ty = ty0; ty < ty1; ty++) {
+        for (int tx = tx0; tx < tx1; tx++) {
+          int t = ty * TILES_X + tx;
+          binRefs[binStart[t] + count[t]++] = i;
+          tileHash[t] = (tileHash[t] ^ key) * 16777619u;
+        }
+      }
+    }
+    return true;
+  }
+
+  static uint32_t hashCircle(const Circle &c) {
+    uint32_t h = (uint16_t)c.x | ((uint32_t)(uint16_t)c.y << 16);
+    h ^= ((uint32_t)(uint16_t)c.r << 7) ^ ((uint32_t)c.col << 25);
+    h *= 0x9e3779b1u;
+    return h ^ (h >> 15);
+  }
+};
+
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "perf_trace.hpp"
+#include "seqlock_slot.hpp"
+
+// タッチパネルを読む間隔 [us]
+#ifndef TOUCH_SAMPLE_INTERVAL_US
+#define TOUCH_SAMPLE_INTERVAL_US (5000)
+#endif
+
+// スキャンアウトがフレームの途中のとき、フレームの間の隙間を待つ最長の時間 [us]
+// これを過ぎたらライン (DMA の塊) の間で読む
+#ifndef TOUCH_MAX_DEFER_US
+#define TOUCH_MAX_DEFER_US (5000)
+#endif
+
+namespace shapoco {
+
+struct TouchSample {
+  int16_t x = 0;
+  int16_t y = 0;
+  bool touched = false;
+  // 最後にパネルを読んだ時刻 [us]
+  uint64_t timeUs = 0;
+};
+
+// タッチパネル (XPT2046) を表示と共有している SPI バスの空き時間に読み、
+// 押下と位置を均して最新の状態として渡す
+// poll() はバスを持っているコアが転送の合間に呼び、latest() はどのコアから呼んでもよい
+class TouchSampler {
+public:
+  // 押した/離したと決めるのに、続けて同じ結果になる必要がある回数
+  static constexpr int PRESS_SAMPLES = 2;
+  static constexpr int RELEASE_SAMPLES = 3;
+
+  struct Stats {
+    uint32_t samples = 0;
+    // フレームの間を待ちきれず、ラインの間で読んだ回数
+    uint32_t midScanSamples = 0;
+    // フレームの間まで読むのを遅らせた回数
+    uint32_t deferredSamples = 0;
+    // 予定の時刻から読むまでの最大の遅れ [us]
+    uint32_t maxLateUs = 0;
+    // バスが使われていたので読まなかった呼び出し (正しく呼んでいれば 0)
+    uint32_t busyRefusals = 0;
+    uint32_t presses = 0;
+    // 確定する前に元に戻った押下/離し
+    uint32_t glitches = 0;
+  };
+
+  uint32_t intervalUs = TOUCH_SAMPLE_INTERVAL_US;
+  uint32_t maxDeferUs = TOUCH_MAX_DEFER_US;
+  Stats stats;
+
+  // busFree: DMA を含めてバスを使っていない
+  // scanIdle: スキャンアウトがフレームの間で止まっている
+  // read(int16_t *x, int16_t *y) はパネルを読んで触れていれば true を返す。読んだら true
+  template<typename READ>
+  bool poll(uint64_t nowUs, bool busFree, bool scanIdle, READ read) {
+    if (nowUs < nextUs) return false;
+    if (!busFree) {
+      stats.busyRefusals++;
+      return false;
+    }
+    uint64_t lateUs = nowUs - nextUs;
+    if (!scanIdle && lateUs < maxDeferUs) {
+      if (!deferring) stats.deferredSamples++;
+      deferring = true;
+      return false;
+    }
+    deferring = false;
+    if (!scanIdle) stats.midScanSamples++;
+    if (nextUs > 0 && lateUs > stats.maxLateUs) stats.maxLateUs = lateUs;
+
+    int16_t x = 0, y = 0;
+    bool touched;
+    {
+      PERF_SCOPE(TOUCH);
+      touched = read(&x, &y);
+    }
+    stats.samples++;
+    // 遅れても次の予定は元の間隔のまま。大きく遅れたら今から数え直す
+    nextUs += intervalUs;
+    if (nextUs <= nowUs) nextUs = nowUs + intervalUs;
+
+    filter(nowUs, touched, x, y);
+    slot.store(state);
+    return true;
+  }
+
+  TouchSample latest() const {
+    TouchSample s;
+    slot.load(&s);
+    return s;
+  }
+
+private:
+  SeqLockSlot<TouchSample> slot;
+  TouchSample state;
+  uint64_t nextUs = 0;
+  bool deferring = false;
+  // 確定していない押下/離しが続いている回数
+  int pending = 0;
+  // 触れている間の直近の位置
+  int16_t histX[3];
+  int16_t histY[3];
+  int numHist = 0;
+
+  static int16_t median3(const int16_t *v) {
+    int16_t a = v[0], b = v[1], c = v[2];
+    if (a > b) { int16_t t = a; a = b; b = t; }
+    if (b > c) b = c;
+    return a > b ? a : b;
+  }
+
+  void filter(uint64_t nowUs, bool touched, int16_t x, int16_t y) {
+    if (touched == state.touched) {
+      if (pending > 0) stats.glitches++;
+      pending = 0;
+    }
+    else if (++pending >= (touched ? PRESS_SAMPLES : RELEASE_SAMPLES)) {
+      state.touched = touched;
+      pending = 0;
+      if (touched) stats.presses++;
+    }
+
+    // 離し際の抵抗膜は位置が大きく振れるので、触れていないときの位置は使わない
+    if (!touched) {
+      numHist = 0;
+    }
+    else {
+      if (numHist < 3) numHist++;
+      for (int i = numHist - 1; i > 0; i--) {
+        histX[i] = histX[i - 1];
+        histY[i] = histY[i - 1];
+      }
+      histX[0] = x;
+      histY[0] = y;
+      // 1 回だけ飛んだ値は直近 3 回の中央値で捨てる
+      if (state.touched) {
+        state.x = numHist < 3 ? x : median3(histX);
+        state.y = numHist < 3 ? y : median3(histY);
+      }
+    }
+    state.timeUs = nowUs;
+  }
+};
+
+}
@@ -3,10 +3,27 @@
 #include "hardware/clocks.h"
 #include "hardware/dma.h"
 #include "pico/stdlib.h"
+#include "pico/multicore.h"
 
 #include "lgfx_ili9488.hpp"
 #include "lcd_service.hpp"
+#include "scanline_service.hpp"
 #include "inochi/inochi.hpp"
+#include "frame_hud.hpp"
+#include "frame_pacer.hpp"
+#include "perf_trace.hpp"
+#include "touch_sampler.hpp"
+
+// スキャンアウト (差分検出・変換・DMA) をコア 1 で行う
+// コア間の受け渡しはホストのスレッド (shapopad_host --core1) でしか確かめていないので、既定では使わない
+#ifndef SCAN_ON_CORE1
+#define SCAN_ON_CORE1 (0)
+#endif
+
+// フレームバッファを持たず、スキャンアウトしながら 1 ラインずつ描いて送る
+#ifndef LCD_SCANLINE
+#define LCD_SCANLINE (0)
+#endif
 
 namespace shapoco {
 
@@ -14,17 +31,66 @@ using namespace lgfx;
 using namespace shapoco::inochi;
 
 uint64_t nextUpdateTimeUs = 0;
+// フレームの間隔は物理演算のステップの整数倍から、スキャンアウトに掛かる時間で選ぶ
+FramePacer pacer(World::STEP_US);
+// USB の stdio に 'h' を送ると表示を切り替える
+FrameHud hud;
+// 前のフレームを渡した時刻と、そのフレームの update() と描画の時間
+uint64_t lastFrameUs = 0;
+uint32_t frameUpdateUs = 0;
+uint32_t framePaintUs = 0;
+// タッチパネルは表示と SPI バスを共有するので、スキャンアウトするコアが転送の合間に読む
+// update() は最後に読んだ値を受け取るだけ
+TouchSampler touchSampler;
+
+#if SCAN_ON_CORE1
+// update() したフレームを描き終えて渡すまでの間
+bool frameOpen = false;
+#else
+// 前のフレームを始めてから描画とスキャンアウトに使った時間と、そのうちスキャンアウトの時間
+uint32_t frameBusyUs = 0;
+uint32_t frameScanUs = 0;
+#endif
+
+#if PERF_TRACE
+// 改行の変換を通さずに USB の stdio へ流す
+void perfWrite(const uint8_t *data, int size) {
+  for (int i = 0; i < size; i++) putchar_raw(data[i]);
+}
+
+// 両コアの記録をコア 0 からまとめて書き出す。リングが溢れないようフレーム毎に行う
+void drainPerfTrace() {
+  PERF_SCOPE(DRAIN);
+  perfTrace.drain(perfWrite);
+}
+#endif
 
 #if 1
 static constexpr int SCREEN_WIDTH = 480;
 static constexpr int SCREEN_HEIGHT = 320;
-LcdService screen(SCREEN_WIDTH, SCREEN_HEIGHT, 3);
+static constexpr int SCREEN_ROTATION = 3;
 #else
 static constexpr int SCREEN_WIDTH = 320;
 static constexpr int SCREEN_HEIGHT = 480;
-LcdService screen(SCREEN_WIDTH, SCREEN_HEIGHT, 0);
+static constexpr int SCREEN_ROTATION = 0;
 #endif
 
+// 色深度はパレット型で選ぶ (Palette1bpp / 2bpp / 4bpp / 8bpp)
+#if LCD_SCANLINE
+using Screen = ScanlineService<Palette2bpp, SCREEN_WIDTH, SCREEN_HEIGHT>;
+#else
+using Screen = LcdService<Palette2bpp, SCREEN_WIDTH, SCREEN_HEIGHT>;
+#endif
+Screen screen(SCREEN_ROTATION);
+
+// inochi の色からパレット番号へ
+static constexpr uint8_t PALETTE_INDEX[] = {
+  Screen::PaletteType::BLACK,
+  Screen::PaletteType::RED,
+  Screen::PaletteType::BLUE,
+  Screen::PaletteType::WHITE,
+};
+
 World world;
 
 HostAPI apis;
@@ -34,29 +100,72 @@ uint64_t getTimeMs() {
   return time_us_64() / 1000;
 }
 
+uint64_t getTimeUs() {
+  return time_us_64();
+}
+
 VecI getScreenSize() {
   return VecI{SCREEN_WIDTH, SCREEN_HEIGHT};
 }
 
 void clearScreen() {
-  LGFX_Sprite &g = screen.getBackBuffer();
-  g.clear(Palette::WHITE);
+  screen.clearBackBuffer(PALETTE_INDEX[Palette::WHITE]);
 }
 
 void drawCircle(VecI pos, int r, Palette col) {
-  LGFX_Sprite &g = screen.getBackBuffer();
-  g.fillCircle(pos.x, pos.y, r, col);
+  screen.fillCircle(pos.x, pos.y, r, PALETTE_INDEX[col]);
 }
 
 void getTouchState(TouchState *touch) {
+  TouchSample s = touchSampler.latest();
+  touchState.touched = s.touched;
+  touchState.pos = VecI{s.x, s.y};
+  touchState.timeUs = s.timeUs;
+  *touch = touchState;
+}
+
+// スキャンアウトの合間に呼ぶ。読む時期は TouchSampler が決める
+void pollTouch() {
 #if TOUCH_ENABLED
-  touchState.touched = screen.lcd.getTouch(&touchState.pos.x, &touchState.pos.y);
-#else
-  touchState.touched = false;
+  touchSampler.poll(time_us_64(), screen.busFree(), screen.idle(), [](int16_t *x, int16_t *y) {
+    return screen.lcd.getTouch(x, y) != 0;
+  });
 #endif
-  *touch = touchState;
 }
 
+// 渡すフレームで、ドラッグしているいのちの周りを先に送らせる
+void setScanFocus() {
+  VecI pos;
+  int r;
+  if (world.getDragFocus(&pos, &r)) screen.setFocus(pos.y - r, pos.y + r + 1, touchState.timeUs);
+}
+
+// スキャンする側: フォーカスを送り終えたら、タッチを読んでからの時間を HUD に渡す
+void noteFocusSent() {
+  uint64_t touchUs;
+  if (screen.takeFocusSent(&touchUs) && touchUs > 0) hud.noteTouchLatency(time_us_64() - touchUs);
+}
+
+#if SCAN_ON_CORE1
+void core1Main(void) {
+  uint32_t scanBusyUs = 0;
+  while (true) {
+    uint64_t nowUs = time_us_64();
+    if (screen.serviceScanOut(nowUs / 1000)) {
+      scanBusyUs += time_us_64() - nowUs;
+      noteFocusSent();
+      if (screen.idle()) {
+        pacer.noteScanTime(scanBusyUs);
+        hud.noteScanTime(scanBusyUs);
+        scanBusyUs = 0;
+      }
+    }
+    // ライン間はバスが空いている
+    pollTouch();
+  }
+}
+#endif
+
 void setup(void) {
   set_sys_clock_khz(250000, true);
   sleep_ms(100);
@@ -128,6 +237,7 @@ void setup(void) {
 
   HostAPI intf;
   intf.getTimeMs = getTimeMs;
+  intf.getTimeUs = getTimeUs;
   intf.getScreenSize = getScreenSize;
   intf.clearScreen = clearScreen;
   intf.drawCircle = drawCircle;
@@ -143,24 +253,103 @@ void setup(void) {
   gpio_init(13);
   gpio_set_dir(13, GPIO_OUT);
   gpio_put(13, true);
+
+#if SCAN_ON_CORE1
+  multicore_launch_core1(core1Main);
+#endif
+}
+
+// フレームを渡すときに呼ぶ。表示の切り替えもフレーム毎に見る
+void noteFrame(uint64_t nowUs) {
+  if (getchar_timeout_us(0) == 'h') hud.cycleMode();
+  hud.noteFrame(lastFrameUs ? nowUs - lastFrameUs : 0, frameUpdateUs, framePaintUs);
+  lastFrameUs = nowUs;
+  frameUpdateUs = 0;
+  framePaintUs = 0;
 }
 
 void loop(void) {
   uint64_t nowUs = time_us_64();
   uint64_t nowMs = nowUs / 1000;
 
+#if SCAN_ON_CORE1
+  // コア 0 は物理演算と描画だけを行う
+  // update() はバッファを待たずに始め、描き終えたフレームはすぐに送る順番に並べる
+  if (!frameOpen && nowUs >= nextUpdateTimeUs) {
+    nextUpdateTimeUs += pacer.nextInterval();
+    nextUpdateTimeUs = nowUs > nextUpdateTimeUs ? nowUs : nextUpdateTimeUs;
+
+    PERF_BEGIN(UPDATE);
+    world.update();
+    PERF_END(UPDATE);
+    frameUpdateUs = time_us_64() - nowUs;
+    frameOpen = true;
+  }
+  if (frameOpen && screen.acquireBackBuffer()) {
+    uint64_t t = time_us_64();
+    PERF_BEGIN(PAINT);
+    world.servicePaint();
+    // 記録した円はここで描くので描画の時間に含める
+    if (world.idle()) screen.commitFrame();
+    PERF_END(PAINT);
+    framePaintUs += time_us_64() - t;
+    if (world.idle()) {
+      noteFrame(time_us_64());
+      screen.paintHud(hud);
+      setScanFocus();
+      screen.submitBackBuffer();
+      frameOpen = false;
+#if PERF_TRACE
+      drainPerfTrace();
+#endif
+    }
+  }
+#else
   if (nowUs >= nextUpdateTimeUs && world.idle()) {
-    nextUpdateTimeUs += 1000 * 1000 / 60;
+    // 同じコアでは描画の合間に送るので、描画も含めた時間で間隔を選ぶ
+    pacer.noteScanTime(frameBusyUs);
+    frameBusyUs = 0;
+    nextUpdateTimeUs += pacer.nextInterval();
     nextUpdateTimeUs = nowUs > nextUpdateTimeUs ? nowUs : nextUpdateTimeUs;
 
-    screen.paintFps(nowMs);
+    uint64_t tc = time_us_64();
+    screen.commitFrame();
+    framePaintUs += time_us_64() - tc;
+    noteFrame(nowUs);
+    hud.noteScanTime(frameScanUs);
+    frameScanUs = 0;
+    screen.paintHud(hud);
+    setScanFocus();
     screen.flip();
 
+    uint64_t t = time_us_64();
+    PERF_BEGIN(UPDATE);
     world.update();
+    PERF_END(UPDATE);
+    frameUpdateUs = time_us_64() - t;
+#if PERF_TRACE
+    drainPerfTrace();
+#endif
   }
+  bool busy = !screen.idle() || !world.idle();
+  uint64_t t0 = time_us_64();
   screen.serviceStart(nowMs);
-  world.servicePaint();
+  uint64_t t1 = time_us_64();
+  if (!world.idle()) {
+    PERF_BEGIN(PAINT);
+    world.servicePaint();
+    PERF_END(PAINT);
+  }
+  uint64_t t2 = time_us_64();
   screen.serviceEnd(nowMs);
+  uint64_t t3 = time_us_64();
+  framePaintUs += t2 - t1;
+  frameScanUs += (t1 - t0) + (t3 - t2);
+  if (busy) frameBusyUs += t3 - nowUs;
+  noteFocusSent();
+  // serviceEnd() で転送を終えているのでバスが空いている
+  pollTouch();
+#endif
 } 
 
 int main(void) {